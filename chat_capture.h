@@ -0,0 +1,94 @@
+#ifndef CHAT_CAPTURE_H
+#define CHAT_CAPTURE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "chat_protocol.h"
+
+// Traffic capture written by new_server.cpp --capture and read by
+// chatsphere_replay.cpp. The file starts with CAPTURE_MAGIC, followed by
+// one record per inbound event, big-endian like the wire protocol:
+//
+//   event(1) type(1) flags(1) reserved(1) length(4) time(8) connection(8) payload(length)
+//
+// time is nanoseconds since the capture started and connection an id
+// unique within the file. Hello and Frame records carry the frame as the
+// server decoded it, so replaying them reproduces the client's protocol.
+// Records from different reactor threads are not interleaved in time
+// order; readers sort by time.
+
+const char CAPTURE_MAGIC[8] = {'C', 'S', 'C', 'A', 'P', 'T', '0', '1'};
+const size_t CAPTURE_RECORD_HEADER_SIZE = 24;
+
+enum class CaptureEvent : uint8_t {
+    Connect = 1,     // accepted; no payload
+    Hello = 2,       // the handshake: "username:room" or "username:room:lastSeq"
+    Frame = 3,       // a frame from a joined client
+    Disconnect = 4,  // closed by either side
+};
+
+// Set on Hello and Frame records of legacy text clients.
+const uint8_t CAPTURE_LEGACY = 0x01;
+
+struct CaptureRecord {
+    CaptureEvent event;
+    FrameType type;
+    uint8_t flags;
+    uint64_t timeNs;
+    uint64_t connection;
+    // Points into the parsed buffer.
+    std::string_view payload;
+};
+
+inline void appendCaptureRecord(std::string& out, const CaptureRecord& record) {
+    char header[CAPTURE_RECORD_HEADER_SIZE];
+    uint32_t length = static_cast<uint32_t>(record.payload.size());
+    header[0] = static_cast<char>(record.event);
+    header[1] = static_cast<char>(record.type);
+    header[2] = static_cast<char>(record.flags);
+    header[3] = 0;
+    for (int i = 0; i < 4; ++i) {
+        header[4 + i] = static_cast<char>((length >> (24 - 8 * i)) & 0xFF);
+    }
+    for (int i = 0; i < 8; ++i) {
+        header[8 + i] = static_cast<char>((record.timeNs >> (56 - 8 * i)) & 0xFF);
+        header[16 + i] = static_cast<char>((record.connection >> (56 - 8 * i)) & 0xFF);
+    }
+    out.append(header, CAPTURE_RECORD_HEADER_SIZE);
+    out.append(record.payload.data(), record.payload.size());
+}
+
+// Parses the record at the start of [data, data + available); `size` is
+// its total length. A truncated tail, as left by a crash, is NeedMore.
+inline DecodeStatus parseCaptureRecord(const char* data, size_t available, CaptureRecord& record, size_t& size) {
+    if (available < CAPTURE_RECORD_HEADER_SIZE) return DecodeStatus::NeedMore;
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(data);
+    if (header[0] < static_cast<uint8_t>(CaptureEvent::Connect) || header[0] > static_cast<uint8_t>(CaptureEvent::Disconnect)) {
+        return DecodeStatus::Error;
+    }
+
+    uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) length = (length << 8) | header[4 + i];
+    if (length > MAX_FRAME_PAYLOAD) return DecodeStatus::Error;
+    if (available < CAPTURE_RECORD_HEADER_SIZE + length) return DecodeStatus::NeedMore;
+
+    uint64_t timeNs = 0;
+    uint64_t connection = 0;
+    for (int i = 0; i < 8; ++i) {
+        timeNs = (timeNs << 8) | header[8 + i];
+        connection = (connection << 8) | header[16 + i];
+    }
+
+    record.event = static_cast<CaptureEvent>(header[0]);
+    record.type = static_cast<FrameType>(header[1]);
+    record.flags = header[2];
+    record.timeNs = timeNs;
+    record.connection = connection;
+    record.payload = std::string_view(data + CAPTURE_RECORD_HEADER_SIZE, length);
+    size = CAPTURE_RECORD_HEADER_SIZE + length;
+    return DecodeStatus::Frame;
+}
+
+#endif
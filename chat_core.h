@@ -0,0 +1,1186 @@
+#ifndef CHAT_CORE_H
+#define CHAT_CORE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <algorithm>
+
+#include "chat_protocol.h"
+
+// Transport-independent core of new_server.cpp: rooms, history, the
+// handshake and message routing. ChatCore never touches a socket. A
+// ChatTransport hands it decoded frames and receives every outbound
+// message through deliver(). The server's reactor shards are one
+// transport; MemoryTransport, at the end of this file, is another, used
+// by chatsphere_microbench to time the core's operations in isolation.
+
+// Stable reference to an entry in a SlotMap. Slots are reused, so the
+// generation is bumped on every release: a handle kept past its entry's
+// lifetime goes stale instead of aliasing the next occupant.
+struct SlotHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+    bool operator==(const SlotHandle& other) const { return index == other.index && generation == other.generation; }
+    bool operator!=(const SlotHandle& other) const { return !(*this == other); }
+};
+
+// Dense storage with O(1) insert, lookup and erase by handle. Freed slots
+// go on a free list and are refilled before the vector grows. Pointers
+// returned by get() are invalidated by the next insert().
+template <typename T>
+class SlotMap {
+private:
+    struct Slot {
+        std::optional<T> value;
+        uint32_t generation = 0;
+    };
+    std::vector<Slot> slots;
+    std::vector<uint32_t> freeList;
+    size_t live = 0;
+
+public:
+    // Default-constructs a new entry and returns its handle.
+    SlotHandle insert() {
+        uint32_t index;
+        if (!freeList.empty()) {
+            index = freeList.back();
+            freeList.pop_back();
+        } else {
+            index = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        slots[index].value.emplace();
+        ++live;
+        SlotHandle handle;
+        handle.index = index;
+        handle.generation = slots[index].generation;
+        return handle;
+    }
+
+    T* get(SlotHandle handle) {
+        if (handle.index >= slots.size()) return nullptr;
+        Slot& slot = slots[handle.index];
+        return slot.value && slot.generation == handle.generation ? &*slot.value : nullptr;
+    }
+
+    const T* get(SlotHandle handle) const {
+        return const_cast<SlotMap*>(this)->get(handle);
+    }
+
+    void erase(SlotHandle handle) {
+        if (!get(handle)) return;
+        Slot& slot = slots[handle.index];
+        slot.value.reset();
+        ++slot.generation;
+        freeList.push_back(handle.index);
+        --live;
+    }
+
+    size_t size() const { return live; }
+
+    template <typename F>
+    void forEach(F f) {
+        for (auto& slot : slots) {
+            if (slot.value) f(*slot.value);
+        }
+    }
+};
+
+inline unsigned highestBit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+}
+
+// Per-thread cache of the blocks messages are built in. Requests are
+// rounded up to a power-of-two size class; a freed block goes onto the
+// freeing thread's list for its class rather than back to malloc, so once
+// the lists are warm a steady stream of messages allocates nothing. Each
+// block is allocated on its own, which lets a message die on a different
+// thread from the one that built it (at shutdown, say). Blocks above the
+// largest class, and frees beyond a class's cache limit, go to the heap.
+class MessageArena {
+public:
+    static constexpr size_t MIN_BLOCK = 32;
+    static constexpr size_t CLASSES = 13;  // 32 B .. 128 KiB
+    // Cached bytes per class per thread.
+    static constexpr size_t MAX_CACHED_BYTES = 1024 * 1024;
+
+    static void* allocate(size_t bytes) {
+        size_t index = classFor(bytes);
+        if (index >= CLASSES) return ::operator new(bytes);
+        // Always the full class size: the block may be freed onto another
+        // thread's list for its class.
+        if (retired) return ::operator new(MIN_BLOCK << index);
+        FreeLists& lists = local();
+        FreeBlock* block = lists.heads[index];
+        if (!block) return ::operator new(MIN_BLOCK << index);
+        lists.heads[index] = block->next;
+        --lists.counts[index];
+        return block;
+    }
+
+    static void deallocate(void* pointer, size_t bytes) {
+        size_t index = classFor(bytes);
+        if (index >= CLASSES || retired) {
+            ::operator delete(pointer);
+            return;
+        }
+        FreeLists& lists = local();
+        if (lists.counts[index] >= MAX_CACHED_BYTES / (MIN_BLOCK << index)) {
+            ::operator delete(pointer);
+            return;
+        }
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        block->next = lists.heads[index];
+        lists.heads[index] = block;
+        ++lists.counts[index];
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct FreeLists {
+        FreeBlock* heads[CLASSES] = {};
+        size_t counts[CLASSES] = {};
+
+        ~FreeLists() {
+            retired = true;
+            for (FreeBlock* head : heads) {
+                while (head) {
+                    FreeBlock* next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+        }
+    };
+
+    // Set once this thread's lists are gone; later frees (from other
+    // thread-local destructors) bypass the cache.
+    static inline thread_local bool retired = false;
+
+    static FreeLists& local() {
+        static thread_local FreeLists lists;
+        return lists;
+    }
+
+    static size_t classFor(size_t bytes) {
+        if (bytes <= MIN_BLOCK) return 0;
+        return highestBit(bytes - 1) + 1 - highestBit(MIN_BLOCK);
+    }
+};
+
+// Standard allocator over MessageArena.
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator() {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(MessageArena::allocate(n * sizeof(T))); }
+    void deallocate(T* pointer, size_t n) { MessageArena::deallocate(pointer, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+// An immutable message as the server routes it. It is encoded into its
+// frame once, when created, straight from the pieces of its payload;
+// room history and every recipient's output queue hold a SharedMessage
+// reference to that same buffer, so fanning out to N members costs no
+// per-recipient allocation or copy. Legacy text clients get a second
+// rendering, built the first time one needs it. The message, its
+// reference count and both renderings live in MessageArena blocks.
+class ChatMessage {
+public:
+    FrameType type;
+    uint64_t sequence;
+    ArenaString frame;
+
+    ChatMessage(FrameType t, uint64_t seq, std::initializer_list<std::string_view> pieces) : type(t), sequence(seq) {
+        size_t length = 0;
+        for (std::string_view piece : pieces) length += piece.size();
+        frame.reserve(FRAME_HEADER_SIZE + length);
+        char header[FRAME_HEADER_SIZE];
+        writeFrameHeader(header, t, seq, length);
+        frame.append(header, FRAME_HEADER_SIZE);
+        for (std::string_view piece : pieces) frame.append(piece.data(), piece.size());
+    }
+
+    std::string_view payload() const {
+        return std::string_view(frame).substr(FRAME_HEADER_SIZE);
+    }
+
+    std::string_view wire(bool framed) const {
+        if (framed) return frame;
+        if (legacy.empty()) {
+            legacy.reserve(payload().size() + 5);
+            if (type == FrameType::Private) legacy = "[PM]";
+            legacy.append(payload().data(), payload().size());
+            legacy += '\n';
+        }
+        return legacy;
+    }
+
+private:
+    mutable ArenaString legacy;
+};
+
+typedef std::shared_ptr<const ChatMessage> SharedMessage;
+
+// Builds a message whose payload is the concatenation of `pieces`.
+inline SharedMessage makeMessage(FrameType type, uint64_t sequence, std::initializer_list<std::string_view> pieces) {
+    return std::allocate_shared<ChatMessage>(ArenaAllocator<ChatMessage>(), type, sequence, pieces);
+}
+
+inline SharedMessage makeMessage(FrameType type, uint64_t sequence, std::string_view payload) {
+    return makeMessage(type, sequence, {payload});
+}
+
+// Destination for outbound chat traffic, addressed by connection handle.
+// The server implements it by appending to the recipient's output queue
+// rather than calling send().
+class MessageSink {
+public:
+    virtual ~MessageSink() {}
+    virtual void deliver(SlotHandle recipient, const SharedMessage& message) = 0;
+    // Queues a run of messages before writing any of them, so a join
+    // replay goes out in a few gathered writes instead of one per message.
+    virtual void deliverBatch(SlotHandle recipient, const std::vector<SharedMessage>& messages) = 0;
+};
+
+// Log-linear histogram in the style of HdrHistogram. Values below 16 get
+// a bucket each and every power of two above that is split into 16
+// buckets, so a recorded value is known to within 1/16 (6.25%) over the
+// whole 64-bit range. Recording is a bit scan and three increments.
+class Histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    Histogram() : counts(BUCKETS, 0) {}
+
+    void record(uint64_t value) {
+        ++counts[bucketFor(value)];
+        ++total;
+        sum += value;
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t valueSum() const { return sum; }
+    uint64_t bucketCount(size_t index) const { return counts[index]; }
+
+    // Largest value that lands in bucket `index`.
+    static uint64_t upperBound(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        unsigned magnitude = static_cast<unsigned>(index / SUB_BUCKETS - 1);
+        uint64_t next = static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS + 1);
+        // The top bucket's bound wraps to UINT64_MAX.
+        return (next << magnitude) - 1;
+    }
+
+    // Upper bound of the bucket holding quantile q (0..1); 0 when empty.
+    uint64_t quantile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return upperBound(i);
+        }
+        return UINT64_MAX;
+    }
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+
+    static size_t bucketFor(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        unsigned magnitude = highestBit(value) - SUB_BUCKET_BITS;
+        return (magnitude + 1) * SUB_BUCKETS + static_cast<size_t>((value >> magnitude) & (SUB_BUCKETS - 1));
+    }
+};
+
+// Traffic through one room since it was opened.
+struct RoomStats {
+    uint64_t messagesIn = 0;
+    uint64_t messagesOut = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    // Queued messages discarded or coalesced by the slow-consumer policy.
+    uint64_t dropped = 0;
+};
+
+// What the core has routed. Room traffic is also counted per room.
+struct CoreStats {
+    uint64_t messagesIn = 0;
+    // Messages that found a rate limit's bucket empty.
+    uint64_t shed = 0;
+    uint64_t deferred = 0;
+    // Recipients of each room message.
+    Histogram fanout;
+    // From the read that brought a chat message in to its hand-off to the
+    // last recipient's socket or output queue.
+    Histogram fanoutLatencyNs;
+};
+
+// A token bucket's refill rate and size, in nanoseconds so that checking
+// one is integer compares and adds: a token takes refillNs to come back
+// and a full bucket holds capacityNs worth of them.
+struct RateLimit {
+    // 0 means unlimited.
+    int64_t refillNs = 0;
+    int64_t capacityNs = 0;
+
+    static RateLimit perSecond(uint32_t rate, uint32_t burst) {
+        RateLimit limit;
+        if (rate == 0) return limit;
+        limit.refillNs = 1000000000 / static_cast<int64_t>(rate);
+        limit.capacityNs = limit.refillNs * std::max<uint32_t>(burst, 1);
+        return limit;
+    }
+
+    bool enabled() const { return refillNs > 0; }
+};
+
+// What happens to a message sent with an empty bucket.
+enum class FloodPolicy {
+    // Dropped; the sender is told once per burst.
+    Shed,
+    // Left unread until the bucket refills, so TCP pushes back on the
+    // sender. Transports that cannot hold input shed instead.
+    Defer,
+};
+
+struct RateLimits {
+    // Every chat message and PM a connection sends.
+    RateLimit connection;
+    // Every chat message sent to a room, whoever sends it.
+    RateLimit room;
+    FloodPolicy policy = FloodPolicy::Defer;
+};
+
+// Token bucket kept as the time at which it will be full again (GCRA's
+// theoretical arrival time), so it refills implicitly and never needs a
+// timer. Times are steady-clock nanoseconds.
+class TokenBucket {
+public:
+    // Earliest time at which a token is available.
+    int64_t readyAt(const RateLimit& limit) const {
+        return limit.enabled() ? fullAt + limit.refillNs - limit.capacityNs : INT64_MIN;
+    }
+
+    void take(const RateLimit& limit, int64_t now) {
+        if (limit.enabled()) fullAt = std::max(fullAt, now) + limit.refillNs;
+    }
+
+private:
+    int64_t fullAt = 0;
+};
+
+// Caps on how much history a room retains; whichever is hit first evicts
+// the oldest message.
+struct HistoryLimits {
+    size_t maxMessages = 1000;
+    size_t maxBytes = 256 * 1024;
+};
+
+// Fixed-capacity ring of a room's most recent messages. Slots grow up to
+// maxMessages and are then reused, so memory is bounded by both limits no
+// matter how long the room lives.
+class MessageRing {
+private:
+    std::vector<SharedMessage> slots;
+    size_t head = 0;
+    size_t count = 0;
+    size_t bytes = 0;
+    HistoryLimits limits;
+
+    const SharedMessage& at(size_t index) const {
+        return slots[(head + index) % slots.size()];
+    }
+
+    void popOldest() {
+        bytes -= slots[head]->frame.size();
+        slots[head].reset();
+        head = (head + 1) % slots.size();
+        --count;
+    }
+
+    // Index of the first message newer than `sequence`. Sequences
+    // increase along the ring, so this is a binary search.
+    size_t firstAfter(uint64_t sequence) const {
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (at(mid)->sequence <= sequence) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+public:
+    MessageRing() {}
+    explicit MessageRing(const HistoryLimits& l) : limits(l) {}
+
+    size_t size() const { return count; }
+    size_t byteSize() const { return bytes; }
+
+    // Retains `message`, evicting the oldest to make room. Returns false
+    // if the ring keeps nothing.
+    bool push(const SharedMessage& message) {
+        if (limits.maxMessages == 0) return false;
+        size_t size = message->frame.size();
+        while (count > 0 && (count == limits.maxMessages || bytes + size > limits.maxBytes)) {
+            popOldest();
+        }
+        if (count == slots.size()) {
+            // Every allocated slot is live: grow, keeping the oldest first.
+            std::rotate(slots.begin(), slots.begin() + head, slots.end());
+            head = 0;
+            slots.push_back(message);
+        } else {
+            slots[(head + count) % slots.size()] = message;
+        }
+        ++count;
+        bytes += size;
+        return true;
+    }
+
+    // Appends every retained message, oldest first.
+    void appendTo(std::vector<SharedMessage>& out) const {
+        out.reserve(out.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            out.push_back(at(i));
+        }
+    }
+
+    // Sequence of the oldest retained message, or 0 when empty.
+    uint64_t oldestSequence() const {
+        return count > 0 ? at(0)->sequence : 0;
+    }
+
+    // The retained message with this sequence, or null.
+    const SharedMessage* find(uint64_t sequence) const {
+        size_t index = firstAfter(sequence - 1);
+        return index < count && at(index)->sequence == sequence ? &at(index) : nullptr;
+    }
+
+    // Appends the retained messages newer than `sequence`, oldest first.
+    void appendSince(uint64_t sequence, std::vector<SharedMessage>& out) const {
+        size_t low = firstAfter(sequence);
+        out.reserve(out.size() + count - low);
+        for (size_t i = low; i < count; ++i) {
+            out.push_back(at(i));
+        }
+    }
+};
+
+// Inverted index over the chat messages in a room's history, for
+// /search. Each word maps to the sequences of the messages containing
+// it, in ascending order. Evicted messages are not looked at again:
+// their entries are skipped by queries and swept out once they outnumber
+// the live ones, so the index stays within twice its live size and
+// eviction costs nothing per word. A query walks the shortest of its
+// words' lists from the newest end, binary-searches the others and stops
+// at the limit, so it costs O(limit x words x log n) however long the
+// history is rather than a scan of it.
+class HistoryIndex {
+public:
+    // Longer words are indexed and searched by their first MAX_WORD bytes.
+    static constexpr size_t MAX_WORD = 32;
+
+    size_t words() const { return postings.size(); }
+
+    void add(const ChatMessage& message) {
+        if (message.type != FrameType::Chat) return;
+        uint32_t count = 0;
+        forEachWord(message.payload(), scratch, [&](const std::string& word) {
+            std::vector<uint64_t>& sequences = postings[word];
+            // A word repeated within the message is listed once.
+            if (sequences.empty() || sequences.back() != message.sequence) {
+                sequences.push_back(message.sequence);
+                ++count;
+            }
+        });
+        indexed.push_back(Indexed{message.sequence, count});
+        entries += count;
+    }
+
+    // Messages before `sequence` have left the history.
+    void retainFrom(uint64_t sequence) {
+        oldest = sequence;
+        while (indexedHead < indexed.size() && indexed[indexedHead].sequence < oldest) {
+            stale += indexed[indexedHead++].words;
+        }
+        if (indexedHead >= 64 && indexedHead * 2 >= indexed.size()) {
+            indexed.erase(indexed.begin(), indexed.begin() + static_cast<std::ptrdiff_t>(indexedHead));
+            indexedHead = 0;
+        }
+        if (stale > MIN_SWEEP && stale * 2 > entries) sweep();
+    }
+
+    // Appends the sequences of the newest messages containing every word
+    // of `query`, newest first, at most `limit` of them.
+    void search(std::string_view query, size_t limit, std::vector<uint64_t>& out) const {
+        struct Range {
+            const uint64_t* begin;
+            const uint64_t* end;
+        };
+        std::vector<Range> ranges;
+        bool missing = false;
+        std::string word;
+        forEachWord(query, word, [&](const std::string& queryWord) {
+            auto it = postings.find(queryWord);
+            if (it == postings.end()) {
+                missing = true;
+                return;
+            }
+            const uint64_t* end = it->second.data() + it->second.size();
+            ranges.push_back(Range{std::lower_bound(it->second.data(), end, oldest), end});
+        });
+        if (missing || ranges.empty()) return;
+        std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.end - a.begin < b.end - b.begin; });
+        const Range shortest = ranges[0];
+        size_t found = 0;
+        for (const uint64_t* candidate = shortest.end; candidate != shortest.begin && found < limit;) {
+            uint64_t sequence = *--candidate;
+            bool everywhere = true;
+            for (size_t i = 1; i < ranges.size() && everywhere; ++i) {
+                // Candidates only decrease, so each list's range shrinks.
+                ranges[i].end = std::upper_bound(ranges[i].begin, ranges[i].end, sequence);
+                everywhere = ranges[i].end != ranges[i].begin && ranges[i].end[-1] == sequence;
+            }
+            if (everywhere) {
+                out.push_back(sequence);
+                ++found;
+            }
+        }
+    }
+
+private:
+    // Stale entries are left alone below this many.
+    static constexpr size_t MIN_SWEEP = 4096;
+
+    // An indexed message and how many entries it added.
+    struct Indexed {
+        uint64_t sequence;
+        uint32_t words;
+    };
+
+    std::unordered_map<std::string, std::vector<uint64_t>> postings;
+    // Indexed messages in order, from indexedHead on still retained.
+    std::vector<Indexed> indexed;
+    size_t indexedHead = 0;
+    // All entries in `postings`, and those of evicted messages.
+    size_t entries = 0;
+    size_t stale = 0;
+    uint64_t oldest = 0;
+    // Reused for each word of an indexed message, to keep lookups free of
+    // allocations.
+    std::string scratch;
+
+    void sweep() {
+        for (auto it = postings.begin(); it != postings.end();) {
+            std::vector<uint64_t>& sequences = it->second;
+            auto live = std::lower_bound(sequences.begin(), sequences.end(), oldest);
+            if (live == sequences.end()) {
+                it = postings.erase(it);
+                continue;
+            }
+            sequences.erase(sequences.begin(), live);
+            ++it;
+        }
+        entries -= stale;
+        stale = 0;
+    }
+
+    // Words are runs of ASCII letters and digits, lowercased, or of
+    // non-ASCII bytes, so UTF-8 text stays whole.
+    template <typename Visit>
+    static void forEachWord(std::string_view text, std::string& word, Visit visit) {
+        size_t i = 0;
+        while (i < text.size()) {
+            while (i < text.size() && !isWordByte(text[i])) ++i;
+            if (i == text.size()) break;
+            size_t start = i;
+            while (i < text.size() && isWordByte(text[i])) ++i;
+            word.assign(text.data() + start, std::min(i - start, MAX_WORD));
+            for (char& c : word) c = toLower(c);
+            visit(word);
+        }
+    }
+
+    static bool isWordByte(char c) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        return byte >= 0x80 || (byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z');
+    }
+
+    static char toLower(char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+};
+
+// Durable copy of a room's messages. The server's RoomLog implements it;
+// rooms without one are memory-only.
+class MessageJournal {
+public:
+    virtual ~MessageJournal() {}
+    virtual void append(const ChatMessage& message) = 0;
+};
+
+class ChatRoom {
+public:
+    std::string name;
+    // Handles of the connections in the room, in no particular order.
+    std::vector<SlotHandle> members;
+    // Usernames of members on federated peers, as their nodes announced
+    // them; only for member lists.
+    std::vector<std::string> remoteMembers;
+    MessageRing messageHistory;
+    // Words of the chat messages in messageHistory, for /search.
+    HistoryIndex searchIndex;
+    uint64_t nextSequence = 1;
+    // Durable log this room appends to, when the server has --data-dir.
+    MessageJournal* log = nullptr;
+    RoomStats stats;
+    TokenBucket chatBucket;
+
+    ChatRoom(const std::string& n, const HistoryLimits& limits) : name(n), messageHistory(limits) {}
+    ChatRoom() {}
+
+    // Returns the member's position, which the caller keeps for removal.
+    size_t addMember(SlotHandle member) {
+        members.push_back(member);
+        return members.size() - 1;
+    }
+
+    // Removes the member at `position` by moving the last member into it.
+    // Returns the moved member's handle (invalid if none moved) so the
+    // caller can update its stored position.
+    SlotHandle removeMember(size_t position) {
+        members[position] = members.back();
+        members.pop_back();
+        return position < members.size() ? members[position] : SlotHandle();
+    }
+
+    void broadcast(const SharedMessage& message, SlotHandle exclude, MessageSink& sink) const {
+        for (const auto& member : members) {
+            if (member != exclude) {
+                sink.deliver(member, message);
+            }
+        }
+    }
+
+    // Appends to history under the room's next sequence number. The
+    // payload is the concatenation of `pieces`.
+    SharedMessage addMessage(FrameType type, std::initializer_list<std::string_view> pieces) {
+        SharedMessage message = makeMessage(type, nextSequence++, pieces);
+        remember(message);
+        if (log) log->append(*message);
+        return message;
+    }
+
+    SharedMessage addMessage(FrameType type, std::string_view payload) {
+        return addMessage(type, {payload});
+    }
+
+    // Attaches a durable log whose tail was recovered into `recovered`;
+    // numbering continues at `next`.
+    void attachLog(MessageJournal& journal, uint64_t next, const std::vector<SharedMessage>& recovered) {
+        log = &journal;
+        nextSequence = next;
+        for (const auto& message : recovered) {
+            remember(message);
+        }
+    }
+
+    // Appends the newest retained chat messages containing every word of
+    // `query`, oldest first, at most `limit` of them.
+    void search(std::string_view query, size_t limit, std::vector<SharedMessage>& out) const {
+        std::vector<uint64_t> sequences;
+        searchIndex.search(query, limit, sequences);
+        for (auto it = sequences.rbegin(); it != sequences.rend(); ++it) {
+            if (const SharedMessage* message = messageHistory.find(*it)) out.push_back(*message);
+        }
+    }
+
+    // Retains a message in the history ring, and its words in the index.
+    void remember(const SharedMessage& message) {
+        if (!messageHistory.push(message)) return;
+        searchIndex.add(*message);
+        searchIndex.retainFrom(messageHistory.oldestSequence());
+    }
+
+    // Replays history to a joining client. A client resuming after
+    // `lastSeen` only gets the messages it missed; if some of those have
+    // already left the ring it gets a gap notice and everything retained.
+    // Returns the number of messages replayed.
+    size_t sendHistory(SlotHandle recipient, MessageSink& sink, uint64_t lastSeen = 0) const {
+        std::vector<SharedMessage> replay;
+        // A client ahead of us saw a previous incarnation of the room.
+        if (lastSeen == 0 || lastSeen >= nextSequence) {
+            messageHistory.appendTo(replay);
+        } else {
+            uint64_t oldest = messageHistory.size() > 0 ? messageHistory.oldestSequence() : nextSequence;
+            if (lastSeen + 1 < oldest) {
+                replay.push_back(makeMessage(FrameType::System, 0,
+                    "[history gap: " + std::to_string(oldest - lastSeen - 1) + " messages are no longer available]"));
+                messageHistory.appendTo(replay);
+            } else {
+                messageHistory.appendSince(lastSeen, replay);
+            }
+        }
+        sink.deliverBatch(recipient, replay);
+        return replay.size();
+    }
+};
+
+// What the core keeps for each connection. Transports derive their own
+// connection type from it and add whatever their I/O needs.
+struct Session {
+    SlotHandle handle;
+    // Binary frames rather than legacy text lines; set by the transport
+    // before the handshake.
+    bool framed = false;
+    bool joined = false;
+    std::string username;
+    ChatRoom* room = nullptr;
+    // Position in room->members, so leaving is O(1).
+    size_t memberIndex = 0;
+    TokenBucket sendBucket;
+    // Told its messages are being dropped; cleared by the next one let
+    // through.
+    bool throttled = false;
+};
+
+// The side of the server that owns the connections' I/O. The core calls
+// deliver() for every outbound message. The other hooks let a transport
+// spread rooms over shards, attach durable logs and report what the core
+// did; they default to doing nothing.
+template <typename Connection>
+class ChatTransport : public MessageSink {
+public:
+    // Offered a connection whose handshake names `roomName`. Returns true
+    // if the room lives elsewhere and the transport has taken the
+    // connection out of the core's table to move it there.
+    virtual bool moveElsewhere(Connection&, std::string_view /*hello*/, const std::string& /*roomName*/) { return false; }
+    // A room was just created, e.g. to attach its durable log.
+    virtual void roomOpened(ChatRoom&) {}
+    // A PM whose target is not connected here. Returns true if it was
+    // passed on, in which case the transport answers the sender.
+    virtual bool relayPrivate(Connection&, std::string_view /*target*/, std::string_view /*content*/) { return false; }
+    virtual void joined(Connection&, uint64_t /*lastSeen*/, size_t /*replayed*/) {}
+    virtual void left(std::string_view /*username*/, ChatRoom&) {}
+    // A message from a client here entered a room's history and went to
+    // the room's members: chat lines and join/leave notices.
+    virtual void published(ChatRoom&, const SharedMessage&) {}
+    virtual void chatted(Connection&, std::string_view /*line*/) {}
+    virtual void privateSent(Connection&, std::string_view /*target*/, std::string_view /*content*/) {}
+};
+
+enum class HelloResult { Joined, Rejected, Moved };
+
+enum class Admission { Accepted, Shed, Deferred };
+
+// Rooms, usernames and routing for one shard. Connection must derive from
+// Session. The handle open() returns names the connection everywhere: in
+// calls, in room membership and in the transport's deliver().
+template <typename Connection>
+class ChatCore {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Matches one search returns at most.
+    static constexpr size_t SEARCH_RESULTS = 20;
+
+    SlotMap<Connection> connections;
+    std::map<std::string, ChatRoom> rooms;
+    CoreStats stats;
+    HistoryLimits history;
+    // Per-room overrides of the history limits, keyed by room name.
+    std::map<std::string, HistoryLimits> roomHistory;
+    // Rooms outlive their last member, e.g. because their log is durable.
+    bool keepEmptyRooms = false;
+    RateLimits limits;
+
+    explicit ChatCore(ChatTransport<Connection>& t) : transport(t) {}
+
+    SlotHandle open() {
+        SlotHandle handle = connections.insert();
+        connections.get(handle)->handle = handle;
+        return handle;
+    }
+
+    const HistoryLimits& historyFor(const std::string& roomName) const {
+        auto it = roomHistory.find(roomName);
+        return it != roomHistory.end() ? it->second : history;
+    }
+
+    ChatRoom& openRoom(const std::string& roomName) {
+        auto it = rooms.find(roomName);
+        if (it == rooms.end()) {
+            it = rooms.emplace(roomName, ChatRoom(roomName, historyFor(roomName))).first;
+            transport.roomOpened(it->second);
+        }
+        return it->second;
+    }
+
+    Connection* findByUsername(std::string_view username) {
+        // The index is keyed by std::string; reusing one key buffer keeps
+        // lookups from allocating.
+        lookupKey.assign(username.data(), username.size());
+        auto it = usernameIndex.find(lookupKey);
+        return it != usernameIndex.end() ? connections.get(it->second) : nullptr;
+    }
+
+    SharedMessage memberList(const ChatRoom& room) const {
+        std::string result = "Members in room " + room.name + ": ";
+        for (size_t i = 0; i < room.members.size(); ++i) {
+            const Connection* member = connections.get(room.members[i]);
+            if (member) result += member->username;
+            if (i < room.members.size() - 1) result += ", ";
+        }
+        for (size_t i = 0; i < room.remoteMembers.size(); ++i) {
+            if (i > 0 || !room.members.empty()) result += ", ";
+            result += room.remoteMembers[i];
+        }
+        return makeMessage(FrameType::MemberList, 0, result);
+    }
+
+    // Names may not be empty (a room "" would be logged under a directory
+    // recovery cannot decode) or hold control characters: peer links put
+    // a newline after the room name, and clients would print escapes as
+    // they are.
+    static bool validName(std::string_view name) {
+        if (name.empty()) return false;
+        for (char c : name) {
+            if (static_cast<unsigned char>(c) < 0x20 || c == 0x7F) return false;
+        }
+        return true;
+    }
+
+    // Splits "username:room". A reconnecting framed client appends
+    // ":<last sequence seen>", returned in lastSeen (otherwise 0).
+    static bool parseHello(std::string_view data, bool framed, std::string& username, std::string& roomName, uint64_t& lastSeen) {
+        size_t delim = data.find(':');
+        if (delim == std::string_view::npos || delim == 0) return false;
+        username.assign(data.data(), delim);
+        roomName.assign(data.data() + delim + 1, data.size() - delim - 1);
+        lastSeen = framed ? parseResumeSequence(roomName) : 0;
+        return validName(username) && validName(roomName);
+    }
+
+    // Handles the first frame of a connection. Framed clients must send a
+    // Hello; in legacy mode the first line is the handshake.
+    HelloResult hello(Connection& conn, const Frame& frame) {
+        if (conn.framed && frame.type != FrameType::Hello) return HelloResult::Rejected;
+        return join(conn, frame.payload);
+    }
+
+    // Joins the room a handshake names, replays the history the client
+    // missed and tells the room. A Rejected connection should be closed.
+    HelloResult join(Connection& conn, std::string_view data) {
+        std::string username;
+        std::string roomName;
+        uint64_t lastSeen = 0;
+        if (!parseHello(data, conn.framed, username, roomName, lastSeen)) return HelloResult::Rejected;
+        if (transport.moveElsewhere(conn, data, roomName)) return HelloResult::Moved;
+
+        conn.username = username;
+        conn.joined = true;
+        usernameIndex.emplace(username, conn.handle);
+
+        ChatRoom& room = openRoom(roomName);
+        conn.room = &room;
+        conn.memberIndex = room.addMember(conn.handle);
+
+        size_t replayed = room.sendHistory(conn.handle, transport, lastSeen);
+        transport.joined(conn, lastSeen, replayed);
+        transport.deliver(conn.handle, memberList(room));
+
+        SharedMessage joinMsg = room.addMessage(FrameType::System, {username, " joined room ", roomName, "!"});
+        room.broadcast(joinMsg, conn.handle, transport);
+        transport.published(room, joinMsg);
+        return HelloResult::Joined;
+    }
+
+    // Routes a frame from a joined client: a PM to its target, anything
+    // else to the room. readAt is when the transport read it.
+    void receive(Connection& conn, const Frame& frame, Clock::time_point readAt) {
+        if (conn.framed && frame.type == FrameType::Search) {
+            search(conn, frame.payload);
+            return;
+        }
+        ChatRoom& room = *conn.room;
+        const std::string& username = conn.username;
+        ++stats.messagesIn;
+        ++room.stats.messagesIn;
+        room.stats.bytesIn += frame.payload.size();
+
+        // Everything below is a view into the frame or the connection; the
+        // only allocations are the messages that go out.
+        std::string_view message = frame.payload;
+        bool privateMessage = false;
+        std::string_view targetUser;
+        std::string_view pmContent;
+        if (conn.framed) {
+            if (frame.type == FrameType::Private) {
+                size_t colon = message.find(':');
+                if (colon == std::string_view::npos) return;
+                privateMessage = true;
+                targetUser = message.substr(0, colon);
+                pmContent = message.substr(colon + 1);
+            } else if (frame.type != FrameType::Chat) {
+                return;
+            }
+        } else if (message.substr(0, 4) == "[PM]") {
+            size_t firstColon = message.find(':', 4);
+            size_t secondColon = message.find(':', firstColon + 1);
+            if (firstColon == std::string_view::npos || secondColon == std::string_view::npos) return;
+            privateMessage = true;
+            targetUser = message.substr(firstColon + 1, secondColon - firstColon - 1);
+            pmContent = message.substr(secondColon + 1);
+        }
+
+        if (privateMessage) {
+            Connection* target = findByUsername(targetUser);
+            if (target) {
+                SharedMessage pmMessage = makeMessage(FrameType::Private, 0, {username, ":", pmContent});
+                transport.deliver(target->handle, pmMessage);
+                transport.deliver(conn.handle, pmMessage);
+                transport.privateSent(conn, targetUser, pmContent);
+            } else if (!transport.relayPrivate(conn, targetUser, pmContent)) {
+                transport.deliver(conn.handle, makeMessage(FrameType::System, 0, {"User ", targetUser, " not found."}));
+            }
+        } else {
+            // Framed clients send bare text; legacy clients send the whole
+            // "sender: text" line themselves.
+            SharedMessage chatMsg = conn.framed ? room.addMessage(FrameType::Chat, {username, ": ", message})
+                                                : room.addMessage(FrameType::Chat, message);
+            transport.chatted(conn, chatMsg->payload());
+            room.broadcast(chatMsg, conn.handle, transport);
+            transport.published(room, chatMsg);
+            stats.fanout.record(room.members.size() - 1);
+            stats.fanoutLatencyNs.record(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - readAt).count()));
+        }
+    }
+
+    // Answers a Search from the room's history index: a summary, then the
+    // newest matches, oldest first, each under its own sequence so the
+    // client can tell where in the room's history it was.
+    void search(Connection& conn, std::string_view terms) {
+        std::vector<SharedMessage> results(1);
+        conn.room->search(terms, SEARCH_RESULTS, results);
+        size_t found = results.size() - 1;
+        if (found == 0) {
+            results[0] = makeMessage(FrameType::System, 0, {"No messages in the history of ", conn.room->name, " match \"", terms, "\"."});
+        } else {
+            std::string count = std::to_string(found);
+            results[0] = makeMessage(FrameType::System, 0,
+                                     {found == SEARCH_RESULTS ? "Latest " : "", count, found == 1 ? " message" : " messages",
+                                      " matching \"", terms, "\":"});
+            for (size_t i = 1; i < results.size(); ++i) {
+                results[i] = makeMessage(FrameType::Search, results[i]->sequence, results[i]->payload());
+            }
+        }
+        transport.deliverBatch(conn.handle, results);
+    }
+
+    // Charges a frame from a joined client to its own bucket and, unless
+    // it is a PM, its room's. If either is empty nothing is charged: the
+    // frame is Deferred when the policy allows and the transport can hold
+    // it (retryAt is then when both buckets will have a token), and Shed
+    // otherwise. Only Accepted frames go on to receive().
+    Admission admit(Connection& conn, const Frame& frame, Clock::time_point now, bool canHold, Clock::time_point& retryAt) {
+        if (!limits.connection.enabled() && !limits.room.enabled()) return Admission::Accepted;
+        bool roomMessage = conn.framed ? frame.type == FrameType::Chat : frame.payload.substr(0, 4) != "[PM]";
+        int64_t at = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        int64_t ready = conn.sendBucket.readyAt(limits.connection);
+        if (roomMessage) ready = std::max(ready, conn.room->chatBucket.readyAt(limits.room));
+        if (ready <= at) {
+            conn.sendBucket.take(limits.connection, at);
+            if (roomMessage) conn.room->chatBucket.take(limits.room, at);
+            conn.throttled = false;
+            return Admission::Accepted;
+        }
+        if (limits.policy == FloodPolicy::Defer && canHold) {
+            ++stats.deferred;
+            retryAt = Clock::time_point(std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(ready)));
+            return Admission::Deferred;
+        }
+        ++stats.shed;
+        if (!conn.throttled) {
+            conn.throttled = true;
+            transport.deliver(conn.handle, makeMessage(FrameType::System, 0, "You are sending too fast; messages are being dropped."));
+        }
+        return Admission::Shed;
+    }
+
+    // Erases a connection. A joined client leaves its room and the rest of
+    // the room is told.
+    void close(SlotHandle handle) {
+        Connection* conn = connections.get(handle);
+        if (!conn) return;
+        if (!conn->joined) {
+            connections.erase(handle);
+            return;
+        }
+        ChatRoom& room = *conn->room;
+        std::string username = std::move(conn->username);
+        SlotHandle moved = room.removeMember(conn->memberIndex);
+        if (moved.valid()) connections.get(moved)->memberIndex = conn->memberIndex;
+        auto range = usernameIndex.equal_range(username);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == handle) {
+                usernameIndex.erase(it);
+                break;
+            }
+        }
+        connections.erase(handle);
+
+        SharedMessage leftMsg = room.addMessage(FrameType::System, {username, " left room ", room.name, "!"});
+        room.broadcast(leftMsg, SlotHandle(), transport);
+        transport.published(room, leftMsg);
+        transport.left(username, room);
+        closeIfUnused(room);
+    }
+
+    // A user joined or left `roomName` on a federated peer. Their
+    // messages arrive separately; this only keeps member lists whole.
+    void remotePresence(const std::string& roomName, std::string_view username, bool present) {
+        if (present) {
+            openRoom(roomName).remoteMembers.emplace_back(username);
+            return;
+        }
+        auto it = rooms.find(roomName);
+        if (it == rooms.end()) return;
+        std::vector<std::string>& remote = it->second.remoteMembers;
+        auto member = std::find(remote.begin(), remote.end(), username);
+        if (member == remote.end()) return;
+        *member = std::move(remote.back());
+        remote.pop_back();
+        closeIfUnused(it->second);
+    }
+
+private:
+    ChatTransport<Connection>& transport;
+
+    void closeIfUnused(ChatRoom& room) {
+        if (room.members.empty() && room.remoteMembers.empty() && !keepEmptyRooms) {
+            rooms.erase(std::string(room.name));
+        }
+    }
+
+    // PMs are addressed by username. A name can be in use on several
+    // connections at once.
+    std::unordered_multimap<std::string, SlotHandle> usernameIndex;
+    std::string lookupKey;
+
+    // Strips a ":<digits>" resume suffix from the room name and returns
+    // it, or 0 if there is none.
+    static uint64_t parseResumeSequence(std::string& roomName) {
+        size_t delim = roomName.rfind(':');
+        if (delim == std::string::npos || delim == 0 || delim + 1 == roomName.size() || delim + 21 <= roomName.size()) return 0;
+        uint64_t sequence = 0;
+        for (size_t i = delim + 1; i < roomName.size(); ++i) {
+            if (roomName[i] < '0' || roomName[i] > '9') return 0;
+            sequence = sequence * 10 + static_cast<uint64_t>(roomName[i] - '0');
+        }
+        roomName.erase(delim);
+        return sequence;
+    }
+};
+
+// A MemoryTransport client. Everything delivered to it piles up in inbox.
+struct MemoryConnection : Session {
+    std::vector<SharedMessage> inbox;
+};
+
+// Transport with no sockets: clients are driven by direct calls and their
+// output lands in their inbox. For tests and microbenchmarks of the core.
+class MemoryTransport : public ChatTransport<MemoryConnection> {
+public:
+    ChatCore<MemoryConnection> core;
+
+    MemoryTransport() : core(*this) {}
+
+    // Opens a framed client and sends its Hello. Returns an invalid
+    // handle if the handshake was rejected.
+    SlotHandle connect(std::string_view hello) {
+        SlotHandle handle = core.open();
+        MemoryConnection& conn = *core.connections.get(handle);
+        conn.framed = true;
+        if (core.hello(conn, Frame{FrameType::Hello, 0, hello}) != HelloResult::Joined) {
+            core.close(handle);
+            return SlotHandle();
+        }
+        return handle;
+    }
+
+    // Nothing can wait here, so messages over a rate limit are shed.
+    void send(SlotHandle client, FrameType type, std::string_view payload) {
+        MemoryConnection* conn = core.connections.get(client);
+        if (!conn || !conn->joined) return;
+        Frame frame{type, 0, payload};
+        ChatCore<MemoryConnection>::Clock::time_point now = ChatCore<MemoryConnection>::Clock::now();
+        ChatCore<MemoryConnection>::Clock::time_point retryAt;
+        if (core.admit(*conn, frame, now, false, retryAt) == Admission::Accepted) core.receive(*conn, frame, now);
+    }
+
+    void disconnect(SlotHandle client) {
+        core.close(client);
+    }
+
+    MemoryConnection* client(SlotHandle handle) {
+        return core.connections.get(handle);
+    }
+
+    void deliver(SlotHandle recipient, const SharedMessage& message) override {
+        MemoryConnection* conn = core.connections.get(recipient);
+        if (conn) conn->inbox.push_back(message);
+    }
+
+    void deliverBatch(SlotHandle recipient, const std::vector<SharedMessage>& messages) override {
+        MemoryConnection* conn = core.connections.get(recipient);
+        if (conn) conn->inbox.insert(conn->inbox.end(), messages.begin(), messages.end());
+    }
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <initializer_list>
+
+// Framed wire protocol shared by new_server.cpp and new_client.cpp.
+//
+// Every frame is a 16-byte big-endian header followed by the payload:
+//
+//   magic(1) version(1) type(1) flags(1) length(4) sequence(8) payload(length)
+//
+// The magic byte is not printable ASCII, so the server can tell a framed
+// client from a legacy text client by the first byte it receives.
+// Server-to-client room messages carry the room's sequence number; frames
+// that are not part of room history (PMs, member lists, errors) carry 0.
+// A reconnecting client sends the last sequence it saw in its Hello and
+// the server replays only what it missed, then the member list.
+// The server pings a framed client that has been silent for a while and
+// closes the connection if nothing, not even a Pong, comes back in time.
+// A Search is answered with a System summary, then the newest matching
+// messages from the room's history as Search frames, oldest first.
+// A client on the server's Unix socket may send RingSetup before its
+// Hello; the reply carries shared-memory rings (chat_ring.h) and every
+// later frame in either direction goes through them instead.
+//
+// Federated servers talk to each other over the same framing, with frame
+// types of their own. A link starts with a PeerHello from each side, then
+// each side's user directory as UserUp frames.
+
+const uint8_t FRAME_MAGIC = 0xC5;
+const uint8_t PROTOCOL_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 16;
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024;
+
+enum class FrameType : uint8_t {
+    Hello = 1,       // client -> server: "username:room", or "username:room:lastSeq" to resume
+    Chat = 2,        // client -> server: "text"         server -> client: "sender: text"
+    Private = 3,     // client -> server: "target:text"  server -> client: "sender:text"
+    System = 4,      // server -> client: join/leave notices and errors
+    MemberList = 5,  // server -> client: "Members in room <room>: a, b"
+    Ping = 6,        // either way: heartbeat; the peer answers with a Pong
+    Pong = 7,        // either way: echoes the Ping's payload
+    Search = 8,      // client -> server: "terms"  server -> client: one match, under its room sequence
+    RingSetup = 9,   // client -> server: "<bytes per direction>" or ""  server -> client: "<bytes>", see below
+
+    // Server <-> server, on --peer links only.
+    PeerHello = 16,   // "<node name>"
+    UserUp = 17,      // "username:room": joined a room on the sending node
+    UserDown = 18,    // "username:room": left it
+    RoomChat = 19,    // "room\n<chat payload>": sent to a room on the sending node
+    RoomNotice = 20,  // "room\n<notice>": join/leave notice from the sending node
+    PeerPrivate = 21, // "target:sender:text"
+};
+
+struct Frame {
+    FrameType type;
+    uint64_t sequence;
+    // Points into the decoder's buffer; valid until the next prepare().
+    std::string_view payload;
+};
+
+// Writes the FRAME_HEADER_SIZE header of a frame with `length` bytes of
+// payload, for callers that assemble the payload in place.
+inline void writeFrameHeader(char* header, FrameType type, uint64_t sequence, size_t length) {
+    header[0] = static_cast<char>(FRAME_MAGIC);
+    header[1] = static_cast<char>(PROTOCOL_VERSION);
+    header[2] = static_cast<char>(type);
+    header[3] = 0;
+    for (int i = 0; i < 4; ++i) {
+        header[4 + i] = static_cast<char>((length >> (24 - 8 * i)) & 0xFF);
+    }
+    for (int i = 0; i < 8; ++i) {
+        header[8 + i] = static_cast<char>((sequence >> (56 - 8 * i)) & 0xFF);
+    }
+}
+
+inline void appendFrame(std::string& out, FrameType type, uint64_t sequence, std::string_view payload) {
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, type, sequence, payload.size());
+    out.append(header, FRAME_HEADER_SIZE);
+    out.append(payload.data(), payload.size());
+}
+
+// Appends a frame whose payload is the concatenation of `pieces`, so a
+// payload like "target:text" needs no temporary string.
+inline void appendFrame(std::string& out, FrameType type, uint64_t sequence, std::initializer_list<std::string_view> pieces) {
+    size_t length = 0;
+    for (std::string_view piece : pieces) length += piece.size();
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, type, sequence, length);
+    out.append(header, FRAME_HEADER_SIZE);
+    for (std::string_view piece : pieces) out.append(piece.data(), piece.size());
+}
+
+enum class DecodeStatus { Frame, NeedMore, Error };
+
+// Parses the frame at the start of [data, data + available). On success
+// frame.payload points into data and `size` is the frame's total length.
+inline DecodeStatus parseFrame(const char* data, size_t available, Frame& frame, size_t& size) {
+    if (available < FRAME_HEADER_SIZE) return DecodeStatus::NeedMore;
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(data);
+    if (header[0] != FRAME_MAGIC || header[1] != PROTOCOL_VERSION) return DecodeStatus::Error;
+
+    uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) length = (length << 8) | header[4 + i];
+    if (length > MAX_FRAME_PAYLOAD) return DecodeStatus::Error;
+    if (available < FRAME_HEADER_SIZE + length) return DecodeStatus::NeedMore;
+
+    uint64_t sequence = 0;
+    for (int i = 0; i < 8; ++i) sequence = (sequence << 8) | header[8 + i];
+
+    frame.type = static_cast<FrameType>(header[2]);
+    frame.sequence = sequence;
+    frame.payload = std::string_view(data + FRAME_HEADER_SIZE, length);
+    size = FRAME_HEADER_SIZE + length;
+    return DecodeStatus::Frame;
+}
+
+inline std::string encodeFrame(FrameType type, uint64_t sequence, std::string_view payload) {
+    std::string out;
+    out.reserve(FRAME_HEADER_SIZE + payload.size());
+    appendFrame(out, type, sequence, payload);
+    return out;
+}
+
+// Incremental reassembly for one socket. recv() writes straight into the
+// decoder's buffer (prepare/commit) and next() hands out complete frames as
+// views into it, so partial and batched frames are handled without copying
+// payloads. Only the bytes of an incomplete trailing frame are ever moved.
+//
+// The first byte decides the mode. In Legacy mode there is no binary
+// framing: each newline-terminated line is returned as a Chat frame with
+// sequence 0 and the terminator stripped.
+class FrameDecoder {
+public:
+    enum class Mode { Unknown, Framed, Legacy };
+    typedef DecodeStatus Status;
+
+    FrameDecoder() : buffer(4096), readPos(0), writePos(0), lastSize(0), decodeMode(Mode::Unknown) {}
+
+    // Returns room for at least minSpace bytes at the end of the buffer.
+    char* prepare(size_t minSpace) {
+        // Rewinding an empty buffer is free and saves the memmove below.
+        if (readPos == writePos) {
+            readPos = 0;
+            writePos = 0;
+        }
+        if (buffer.size() - writePos < minSpace) {
+            if (readPos > 0) {
+                std::memmove(buffer.data(), buffer.data() + readPos, writePos - readPos);
+                writePos -= readPos;
+                readPos = 0;
+            }
+            if (buffer.size() - writePos < minSpace) {
+                buffer.resize(writePos + minSpace);
+            }
+        }
+        return buffer.data() + writePos;
+    }
+
+    size_t capacity() const {
+        return buffer.size() - writePos;
+    }
+
+    void commit(size_t bytes) {
+        writePos += bytes;
+        if (decodeMode == Mode::Unknown && writePos > readPos) {
+            decodeMode = static_cast<uint8_t>(buffer[readPos]) == FRAME_MAGIC ? Mode::Framed : Mode::Legacy;
+        }
+    }
+
+    Status next(Frame& frame) {
+        if (decodeMode == Mode::Legacy) return nextLine(frame);
+        if (decodeMode != Mode::Framed) return Status::NeedMore;
+
+        size_t size = 0;
+        Status status = parseFrame(buffer.data() + readPos, writePos - readPos, frame, size);
+        if (status == Status::Frame) {
+            readPos += size;
+            lastSize = size;
+        }
+        return status;
+    }
+
+    // Puts back the frame the last next() returned, which stays valid, so
+    // the next call returns it again. For input the reader cannot act on
+    // yet; only valid until the next prepare().
+    void unread() {
+        readPos -= lastSize;
+        lastSize = 0;
+    }
+
+    Mode mode() const { return decodeMode; }
+
+    // Unconsumed bytes, e.g. a legacy handshake sent without a newline.
+    std::string_view pending() const {
+        return std::string_view(buffer.data() + readPos, writePos - readPos);
+    }
+
+    void consume(size_t bytes) {
+        readPos += bytes;
+        lastSize = 0;
+    }
+
+private:
+    std::vector<char> buffer;
+    size_t readPos;
+    size_t writePos;
+    // Bytes the last frame took, for unread().
+    size_t lastSize;
+    Mode decodeMode;
+
+    Status nextLine(Frame& frame) {
+        const char* start = buffer.data() + readPos;
+        const char* end = static_cast<const char*>(std::memchr(start, '\n', writePos - readPos));
+        if (!end) {
+            return writePos - readPos > MAX_FRAME_PAYLOAD ? Status::Error : Status::NeedMore;
+        }
+        size_t length = static_cast<size_t>(end - start);
+        size_t lineLength = length;
+        if (lineLength > 0 && start[lineLength - 1] == '\r') --lineLength;
+        frame.type = FrameType::Chat;
+        frame.sequence = 0;
+        frame.payload = std::string_view(start, lineLength);
+        readPos += length + 1;
+        lastSize = length + 1;
+        return Status::Frame;
+    }
+};
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef CHAT_RING_H
+#define CHAT_RING_H
+
+// Shared-memory transport for clients on the server's host, negotiated
+// over the server's Unix socket with a RingSetup frame. The server creates
+// a sealed memfd holding two single-producer single-consumer byte rings,
+// one per direction, and passes it to the client with two eventfds: the
+// bell each side waits on. From then on the frames that would have gone
+// over the socket are copied through the rings, which only carries the
+// hangup. Delivery costs a memcpy, plus one eventfd write when the reader
+// had run dry and asked to be woken.
+//
+// Each ring counts the bytes ever written (head) and read (tail). A reader
+// that finds its ring empty sets readerWaiting and looks again; a writer
+// that publishes bytes and then sees the flag clears it and rings the
+// reader's bell. A writer that finds the ring full does the same with
+// writerWaiting. Each side keeps its own copy of the index it advances and
+// checks the peer's against it, so a misbehaving client can break its own
+// connection but not make the server read or write outside the mapping.
+//
+// Linux only: it needs memfd seals, eventfd and SCM_RIGHTS.
+
+#ifdef __linux__
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "chat_protocol.h"
+
+class SharedRing {
+public:
+    static constexpr size_t MIN_CAPACITY = 16 * 1024;
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+    static constexpr size_t MAX_CAPACITY = 16 * 1024 * 1024;
+
+    // Bytes per direction for a client's request: the next power of two
+    // within the limits, or the default for 0.
+    static size_t capacityFor(size_t requested) {
+        if (requested == 0) return DEFAULT_CAPACITY;
+        size_t capacity = MIN_CAPACITY;
+        while (capacity < requested && capacity < MAX_CAPACITY) capacity *= 2;
+        return capacity;
+    }
+
+    // Server side: creates the rings and both bells.
+    explicit SharedRing(size_t capacity) : server(true), size(capacity) {
+        memory = memfd_create("chatsphere-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        // Sealed so the client cannot shrink the file under our mapping.
+        if (memory < 0 || ftruncate(memory, static_cast<off_t>(mappingSize())) != 0 ||
+            fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+            fail("Shared ring creation failed: ");
+        }
+        map();
+        header = new (base) Header();
+        header->magic = MAGIC;
+        header->capacity = static_cast<uint32_t>(size);
+        // Neither side has looked yet, so the first bytes either way ring.
+        header->rings[0].readerWaiting.store(1);
+        header->rings[1].readerWaiting.store(1);
+        bells[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        bells[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (bells[0] < 0 || bells[1] < 0) fail("Shared ring bells failed: ");
+    }
+
+    // Client side: reads the server's answer to a RingSetup frame from a
+    // blocking Unix socket and maps the rings it carries. Throws with the
+    // server's explanation if it answered with anything else.
+    static std::unique_ptr<SharedRing> join(int socket) {
+        char reply[FRAME_HEADER_SIZE + 256];
+        int fds[3] = {-1, -1, -1};
+        size_t received = 0;
+        Frame frame{};
+        size_t frameSize = 0;
+        DecodeStatus status = DecodeStatus::NeedMore;
+        while (status == DecodeStatus::NeedMore && received < sizeof(reply)) {
+            iovec iov{reply + received, sizeof(reply) - received};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+            msghdr message{};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t bytes = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) break;
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && fds[0] < 0 &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+                    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+                }
+            }
+            received += static_cast<size_t>(bytes);
+            status = parseFrame(reply, received, frame, frameSize);
+        }
+        if (status != DecodeStatus::Frame || frame.type != FrameType::RingSetup || fds[0] < 0) {
+            for (int fd : fds) {
+                if (fd >= 0) close(fd);
+            }
+            if (status == DecodeStatus::Frame && frame.type == FrameType::System) {
+                throw std::runtime_error(std::string(frame.payload));
+            }
+            throw std::runtime_error("The server did not set up shared-memory rings.");
+        }
+        return std::unique_ptr<SharedRing>(new SharedRing(fds[0], fds[1], fds[2]));
+    }
+
+    ~SharedRing() {
+        release();
+    }
+
+    SharedRing(const SharedRing&) = delete;
+    SharedRing& operator=(const SharedRing&) = delete;
+
+    size_t capacity() const { return size; }
+
+    // The eventfd this side waits on for input, or for room to write.
+    int bell() const { return bells[server ? 0 : 1]; }
+
+    // Resets the bell after it rang, before the rings are looked at.
+    void clearBell() {
+        uint64_t count;
+        if (::read(bell(), &count, sizeof(count)) < 0) {
+            // Not rung since the last clear.
+        }
+    }
+
+    // Server side: sends `frame` over the Unix socket with the memory and
+    // both bells attached. Our copy of the memory fd is closed afterwards.
+    bool handOver(int socket, std::string_view frame) {
+        int fds[3] = {memory, bells[0], bells[1]};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+        iovec iov{const_cast<char*>(frame.data()), frame.size()};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+        close(memory);
+        memory = -1;
+        return sent == static_cast<ssize_t>(frame.size());
+    }
+
+    // Copies up to `length` waiting bytes into `buffer`. Returns 0 when the
+    // ring is empty, in which case the writer will ring our bell, and -1 if
+    // the peer corrupted the ring.
+    long read(char* buffer, size_t length) {
+        Control& ring = header->rings[server ? 0 : 1];
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        if (head == readPosition) {
+            ring.readerWaiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            head = ring.head.load(std::memory_order_acquire);
+            if (head == readPosition) return 0;
+            ring.readerWaiting.store(0, std::memory_order_relaxed);
+        }
+        if (head - readPosition > size) return -1;
+        length = static_cast<size_t>(std::min<uint64_t>(head - readPosition, length));
+        size_t offset = static_cast<size_t>(readPosition & (size - 1));
+        size_t first = std::min(length, size - offset);
+        const char* data = base + DATA_OFFSET + (server ? 0 : size);
+        std::memcpy(buffer, data + offset, first);
+        std::memcpy(buffer + first, data, length - first);
+        readPosition += length;
+        ring.tail.store(readPosition, std::memory_order_release);
+        wakePeer(ring.writerWaiting);
+        return static_cast<long>(length);
+    }
+
+    // Copies as much of `data` as the ring has room for. Returns the bytes
+    // written; when short, the reader will ring our bell once it has made
+    // room. -1 if the peer corrupted the ring.
+    long write(const char* data, size_t length) {
+        iovec piece{const_cast<char*>(data), length};
+        return writev(&piece, 1);
+    }
+
+    // Like write(), for `count` pieces in order, published together: the
+    // reader sees them, and is woken, once per call rather than per piece.
+    long writev(const iovec* pieces, size_t count) {
+        Control& ring = header->rings[server ? 1 : 0];
+        size_t length = 0;
+        for (size_t i = 0; i < count; ++i) length += pieces[i].iov_len;
+        uint64_t tail = ring.tail.load(std::memory_order_acquire);
+        if (writePosition - tail > size) return -1;
+        if (size - (writePosition - tail) < length) {
+            ring.writerWaiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            tail = ring.tail.load(std::memory_order_acquire);
+            if (writePosition - tail > size) return -1;
+        }
+        size_t space = static_cast<size_t>(size - (writePosition - tail));
+        char* target = base + DATA_OFFSET + (server ? size : 0);
+        uint64_t position = writePosition;
+        for (size_t i = 0; i < count && space > 0; ++i) {
+            size_t piece = std::min(pieces[i].iov_len, space);
+            const char* data = static_cast<const char*>(pieces[i].iov_base);
+            size_t offset = static_cast<size_t>(position & (size - 1));
+            size_t first = std::min(piece, size - offset);
+            std::memcpy(target + offset, data, first);
+            std::memcpy(target, data + first, piece - first);
+            position += piece;
+            space -= piece;
+        }
+        long written = static_cast<long>(position - writePosition);
+        if (written == 0) return 0;
+        writePosition = position;
+        ring.head.store(writePosition, std::memory_order_release);
+        wakePeer(ring.readerWaiting);
+        return written;
+    }
+
+private:
+    static constexpr uint32_t MAGIC = 0x43535231;  // "CSR1"
+    static constexpr size_t DATA_OFFSET = 4096;
+
+    // One direction's indices and wake-up flags, each on the cache line of
+    // the side that writes it.
+    struct Control {
+        alignas(64) std::atomic<uint64_t> head{0};
+        std::atomic<uint32_t> writerWaiting{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+        std::atomic<uint32_t> readerWaiting{0};
+    };
+
+    // At the start of the mapping; the data of ring 0 (client to server)
+    // and ring 1 (server to client) follows at DATA_OFFSET.
+    struct Header {
+        uint32_t magic = 0;
+        uint32_t capacity = 0;
+        Control rings[2];
+    };
+    static_assert(sizeof(Header) <= DATA_OFFSET, "ring header overlaps the data");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring indices must be lock-free to be shared");
+
+    bool server;
+    size_t size;
+    int memory = -1;
+    // bells[0] wakes the server, bells[1] the client.
+    int bells[2] = {-1, -1};
+    char* base = nullptr;
+    Header* header = nullptr;
+    uint64_t readPosition = 0;
+    uint64_t writePosition = 0;
+
+    // Client side: adopts the descriptors from the server's reply.
+    SharedRing(int memoryFd, int serverBell, int clientBell) : server(false), size(0), memory(memoryFd) {
+        bells[0] = serverBell;
+        bells[1] = clientBell;
+        struct stat info{};
+        if (serverBell < 0 || clientBell < 0 || fstat(memory, &info) != 0 || info.st_size < static_cast<off_t>(DATA_OFFSET)) {
+            fail("Shared ring mapping failed: ");
+        }
+        size = (static_cast<size_t>(info.st_size) - DATA_OFFSET) / 2;
+        map();
+        header = reinterpret_cast<Header*>(base);
+        if (header->magic != MAGIC || header->capacity != size || size < MIN_CAPACITY || (size & (size - 1)) != 0) {
+            release();
+            throw std::runtime_error("Shared ring has an unexpected layout.");
+        }
+        close(memory);
+        memory = -1;
+    }
+
+    size_t mappingSize() const {
+        return DATA_OFFSET + 2 * size;
+    }
+
+    void map() {
+        void* mapping = mmap(nullptr, mappingSize(), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+        if (mapping == MAP_FAILED) fail("Shared ring mapping failed: ");
+        base = static_cast<char*>(mapping);
+    }
+
+    // Rings the peer's bell if it asked to be woken. The fence orders our
+    // index update before the flag is read, against the fence the peer
+    // puts between setting the flag and looking at the index again.
+    void wakePeer(std::atomic<uint32_t>& waiting) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) == 0 || waiting.exchange(0) == 0) return;
+        uint64_t one = 1;
+        if (::write(bells[server ? 1 : 0], &one, sizeof(one)) < 0) {
+            // The counter is already non-zero, so the peer will wake.
+        }
+    }
+
+    [[noreturn]] void fail(const char* what) {
+        std::string error = what;
+        error += strerror(errno);
+        release();
+        throw std::runtime_error(error);
+    }
+
+    void release() {
+        if (base) munmap(base, mappingSize());
+        base = nullptr;
+        if (memory >= 0) close(memory);
+        memory = -1;
+        for (int& bell : bells) {
+            if (bell >= 0) close(bell);
+            bell = -1;
+        }
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef CHAT_TIMER_H
+#define CHAT_TIMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+// Hierarchical timer wheel. Time is counted in integer ticks (the server
+// uses milliseconds); there are LEVELS wheels of SLOTS slots, each slot of
+// level L spanning SLOTS^L ticks. A timer goes on the lowest level whose
+// current block also holds its deadline, so scheduling is a shift, a mask
+// and a push_back. When time enters a new block of some level, that
+// level's slot for the block is cascaded: its timers move down a level or
+// more. Each timer is moved at most LEVELS - 1 times, so the cost per
+// timer is O(1) however many are pending.
+//
+// Timers cannot be cancelled; the owner checks on expiry whether the value
+// still means anything (the server stores slot-map handles, which go stale
+// when a connection closes). Per-level occupancy bitmaps let advance() skip
+// empty slots and nextDeadline() answer without scanning.
+template <typename T>
+class TimerWheel {
+public:
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = uint64_t(1) << SLOT_BITS;
+    static constexpr unsigned LEVELS = 4;
+    // Deadlines this far ahead or more wait on an overflow list, examined
+    // each time the top level wraps (every 2^24 ticks, ~4.7 h at 1 ms).
+    static constexpr unsigned SPAN_BITS = SLOT_BITS * LEVELS;
+
+    explicit TimerWheel(uint64_t now = 0) : current(now) {}
+
+    size_t size() const { return count; }
+
+    // Adds a timer due at tick `deadline`. One already due fires on the
+    // next advance().
+    void schedule(uint64_t deadline, const T& value) {
+        if (deadline < current) deadline = current;
+        insert(Entry{deadline, value});
+        ++count;
+    }
+
+    // Fires every timer due at or before `now`, in deadline order, by
+    // calling fire(value). fire may schedule new timers.
+    template <typename Fire>
+    void advance(uint64_t now, Fire fire) {
+        while (current <= now) {
+            if (count == 0) {
+                current = now + 1;
+                break;
+            }
+            uint64_t offset = current & (SLOTS - 1);
+            uint64_t due = occupied[0] >> offset;
+            uint64_t next = due ? current + lowestBit(due) : (current | (SLOTS - 1)) + 1;
+            if (next > now) {
+                // Nothing more is due. Stopping at most at the block's end
+                // means at most one cascade is owed.
+                current = now + 1;
+                if ((current & (SLOTS - 1)) == 0) cascade();
+                break;
+            }
+            current = next;
+            if (due) {
+                fireSlot(current & (SLOTS - 1), fire);
+                ++current;
+            }
+            if ((current & (SLOTS - 1)) == 0) cascade();
+        }
+    }
+
+    // Earliest tick at which advance() has work: a timer to fire or a
+    // slot to cascade. UINT64_MAX when no timers are pending.
+    uint64_t nextDeadline() const {
+        if (count == 0) return UINT64_MAX;
+        uint64_t offset = current & (SLOTS - 1);
+        if (occupied[0] >> offset) return current + lowestBit(occupied[0] >> offset);
+        for (unsigned level = 1; level < LEVELS; ++level) {
+            unsigned shift = SLOT_BITS * level;
+            uint64_t index = (current >> shift) & (SLOTS - 1);
+            // Slots above the current one belong to this block; the
+            // current one was cascaded on entry.
+            uint64_t later = index + 1 < SLOTS ? occupied[level] >> (index + 1) : 0;
+            if (later) {
+                uint64_t slot = index + 1 + lowestBit(later);
+                return ((current >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) | (slot << shift);
+            }
+        }
+        // Only far-future timers are left: the next wrap of the top level.
+        return ((current >> SPAN_BITS) + 1) << SPAN_BITS;
+    }
+
+private:
+    struct Entry {
+        uint64_t deadline;
+        T value;
+    };
+
+    std::vector<Entry> slots[LEVELS][SLOTS];
+    uint64_t occupied[LEVELS] = {};
+    std::vector<Entry> overflow;
+    // Scratch for firing and cascading, kept to reuse its capacity.
+    std::vector<Entry> draining;
+    // Every timer due before this tick has fired.
+    uint64_t current;
+    size_t count = 0;
+
+    static unsigned lowestBit(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, value);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+    }
+
+    void insert(Entry entry) {
+        for (unsigned level = 0; level < LEVELS; ++level) {
+            unsigned shift = SLOT_BITS * (level + 1);
+            if ((entry.deadline >> shift) == (current >> shift)) {
+                uint64_t slot = (entry.deadline >> (SLOT_BITS * level)) & (SLOTS - 1);
+                slots[level][slot].push_back(std::move(entry));
+                occupied[level] |= uint64_t(1) << slot;
+                return;
+            }
+        }
+        overflow.push_back(std::move(entry));
+    }
+
+    // Takes a slot's timers out, leaving the slot empty but keeping the
+    // slot's vector capacity for reuse.
+    void take(unsigned level, uint64_t slot) {
+        draining.clear();
+        draining.swap(slots[level][slot]);
+        occupied[level] &= ~(uint64_t(1) << slot);
+    }
+
+    void giveBack(unsigned level, uint64_t slot) {
+        if (slots[level][slot].empty() && slots[level][slot].capacity() < draining.capacity()) {
+            slots[level][slot].swap(draining);
+        }
+        if (!slots[level][slot].empty()) occupied[level] |= uint64_t(1) << slot;
+    }
+
+    template <typename Fire>
+    void fireSlot(uint64_t slot, Fire& fire) {
+        // A callback may schedule into the slot being fired.
+        while (occupied[0] & (uint64_t(1) << slot)) {
+            take(0, slot);
+            count -= draining.size();
+            for (Entry& entry : draining) fire(entry.value);
+            draining.clear();
+            giveBack(0, slot);
+        }
+    }
+
+    // Called on entering a new level-0 block: redistributes the slot of
+    // each level whose block also changed, top level first.
+    void cascade() {
+        // Level L + 1 moves on when level L wraps to slot 0.
+        unsigned top = 1;
+        while (top + 1 < LEVELS && ((current >> (SLOT_BITS * top)) & (SLOTS - 1)) == 0) ++top;
+        if ((current & ((uint64_t(1) << SPAN_BITS) - 1)) == 0 && !overflow.empty()) {
+            std::vector<Entry> far;
+            far.swap(overflow);
+            for (Entry& entry : far) insert(std::move(entry));
+        }
+        for (unsigned level = top; level >= 1; --level) {
+            uint64_t slot = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+            if (!(occupied[level] & (uint64_t(1) << slot))) continue;
+            take(level, slot);
+            for (Entry& entry : draining) insert(std::move(entry));
+            draining.clear();
+            giveBack(level, slot);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,620 @@
+// chatsphere-bench: headless load generator for new_server.
+//
+// Opens --rooms rooms of bots, using the same framed Hello as ChatClient,
+// spread over --threads epoll loops. Room sizes average --members and are
+// either equal or Zipf-distributed (--distribution zipf), so a few rooms
+// are large and most are small. Once every bot has joined, bot 0 of each
+// room sends --messages chat messages while the others read. Senders run
+// flat out or at --rate messages per second per room, and never more than
+// --window messages ahead of the room's slowest reader so the server's
+// slow-consumer policy stays out of the measurement.
+//
+// Every payload starts with the time the message was meant to be sent, so
+// readers measure delivery latency from the intended send time: a sender
+// held back by the window does not hide the delay (coordinated omission).
+// Reports throughput, latency percentiles and, when the server process can
+// be found on this host, its CPU time per message.
+//
+// Bots connect over TCP by default. With --transport unix they use the
+// server's --unix-socket instead, and with --transport shm they also move
+// to shared-memory rings (chat_ring.h), so the three can be compared.
+//
+// Linux only: it needs epoll to drive thousands of sockets per thread and
+// /proc to find and measure the server.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include "chat_protocol.h"
+#include "chat_ring.h"
+
+#ifndef __linux__
+#error "chatsphere-bench needs epoll (Linux)."
+#endif
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+
+typedef std::chrono::steady_clock Clock;
+
+// Width of the hex send timestamp at the start of every payload.
+static const size_t STAMP_DIGITS = 16;
+
+enum class Transport { Tcp, Unix, SharedMemory };
+
+struct BenchOptions {
+    std::string host = "127.0.0.1";
+    int port = 0;
+    Transport transport = Transport::Tcp;
+    // The server's --unix-socket, for the unix and shm transports.
+    std::string unixSocket;
+    // Ring size asked for per direction with --transport shm; 0 takes the
+    // server's default.
+    size_t ringBytes = 0;
+    size_t rooms = 100;
+    size_t members = 10;
+    bool zipf = false;
+    double zipfExponent = 1.0;
+    size_t messages = 1000;
+    size_t window = 64;
+    // Messages per second per room; 0 sends as fast as the window allows.
+    double rate = 0;
+    size_t payloadBytes = 64;
+    size_t threads = 1;
+    int timeoutSeconds = 60;
+    // Server to charge CPU time to; found by its listening port if 0.
+    int serverPid = 0;
+};
+
+struct Bot {
+    int fd = -1;
+    size_t room = 0;
+    bool joined = false;
+    size_t received = 0;
+    FrameDecoder decoder;
+    std::string out;
+    size_t outOffset = 0;
+    // Set with --transport shm; the socket then only reports the hangup.
+    std::unique_ptr<SharedRing> ring;
+};
+
+struct BenchRoom {
+    std::string name;
+    std::vector<size_t> bots;  // bots[0] sends, the rest read
+    size_t sent = 0;
+    size_t slowestReader = 0;
+    // Intended send time of the next message when --rate is set.
+    Clock::time_point nextSend;
+};
+
+// Shared between the worker threads and main.
+struct BenchState {
+    std::atomic<size_t> joinedBots{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> failed{false};
+    std::atomic<unsigned long long> deliveries{0};
+};
+
+static uint64_t stampNow(Clock::time_point time) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count());
+}
+
+// One epoll loop driving a subset of the rooms.
+class BenchWorker {
+private:
+    const BenchOptions& options;
+    BenchState& state;
+    std::vector<Bot> bots;
+    std::vector<BenchRoom> rooms;
+    std::string payload;
+    int epollFd;
+    unsigned long long remaining = 0;
+    unsigned long long expected = 0;
+    std::chrono::nanoseconds sendInterval{0};
+
+    // Asks for shared-memory rings over a freshly connected, still blocking
+    // Unix socket.
+    bool openRing(Bot& bot) {
+        std::string setup = encodeFrame(FrameType::RingSetup, 0, options.ringBytes ? std::to_string(options.ringBytes) : "");
+        if (send(bot.fd, setup.data(), setup.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(setup.size())) return false;
+        try {
+            bot.ring = SharedRing::join(bot.fd);
+        } catch (const std::exception& e) {
+            std::cerr << "Ring setup failed: " << e.what() << "\n";
+            errno = EPROTO;
+            return false;
+        }
+        return true;
+    }
+
+    // Epoll data is the bot's index, shifted left once; the low bit marks
+    // a ring bot's socket, which only reports the hangup.
+    bool connectBot(Bot& bot, const std::string& hello) {
+        uint64_t index = static_cast<uint64_t>(&bot - bots.data());
+        if (options.transport == Transport::Tcp) {
+            bot.fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (bot.fd < 0) return false;
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(options.port);
+            addr.sin_addr.s_addr = inet_addr(options.host.c_str());
+            if (connect(bot.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+            int one = 1;
+            setsockopt(bot.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        } else {
+            bot.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (bot.fd < 0) return false;
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            options.unixSocket.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+            if (connect(bot.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+            if (options.transport == Transport::SharedMemory && !openRing(bot)) return false;
+        }
+        fcntl(bot.fd, F_SETFL, fcntl(bot.fd, F_GETFL, 0) | O_NONBLOCK);
+        epoll_event ev{};
+        if (bot.ring) {
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u64 = index << 1;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, bot.ring->bell(), &ev) != 0) return false;
+            ev.events = EPOLLRDHUP | EPOLLET;
+            ev.data.u64 = index << 1 | 1;
+        } else {
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.u64 = index << 1;
+        }
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, bot.fd, &ev) != 0) return false;
+        appendFrame(bot.out, FrameType::Hello, 0, hello);
+        // A ring has no EPOLLOUT edge to send the Hello on.
+        return !bot.ring || flush(bot);
+    }
+
+    bool flush(Bot& bot) {
+        while (bot.outOffset < bot.out.size()) {
+            const char* data = bot.out.data() + bot.outOffset;
+            size_t length = bot.out.size() - bot.outOffset;
+            if (bot.ring) {
+                // A full ring rings our bell once the server makes room.
+                long written = bot.ring->write(data, length);
+                if (written <= 0) return written == 0;
+                bot.outOffset += static_cast<size_t>(written);
+                continue;
+            }
+            ssize_t sent = send(bot.fd, data, length, MSG_NOSIGNAL);
+            if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            bot.outOffset += static_cast<size_t>(sent);
+        }
+        bot.out.clear();
+        bot.outOffset = 0;
+        return true;
+    }
+
+    void refreshSlowestReader(BenchRoom& room) {
+        size_t slowest = options.messages;
+        for (size_t i = 1; i < room.bots.size(); ++i) {
+            slowest = std::min(slowest, bots[room.bots[i]].received);
+        }
+        room.slowestReader = slowest;
+    }
+
+    // Stamps the payload with its intended send time, as fixed-width hex.
+    void stamp(uint64_t nanos) {
+        static const char hex[] = "0123456789abcdef";
+        for (size_t i = 0; i < STAMP_DIGITS; ++i) {
+            payload[STAMP_DIGITS - 1 - i] = hex[(nanos >> (4 * i)) & 0xF];
+        }
+    }
+
+    // Sends whatever the window and, with --rate, the schedule allow.
+    void pump(BenchRoom& room, Clock::time_point now) {
+        if (!state.go || room.sent == options.messages) return;
+        if (room.sent - room.slowestReader >= options.window) refreshSlowestReader(room);
+        Bot& sender = bots[room.bots[0]];
+        // Unpaced messages are sent now, not when the loop last woke.
+        uint64_t sentAt = options.rate > 0 ? 0 : stampNow(Clock::now());
+        while (room.sent < options.messages && room.sent - room.slowestReader < options.window) {
+            if (options.rate > 0) {
+                if (room.nextSend > now) break;
+                stamp(stampNow(room.nextSend));
+                room.nextSend += sendInterval;
+            } else {
+                stamp(sentAt);
+            }
+            appendFrame(sender.out, FrameType::Chat, ++room.sent, payload);
+        }
+        if (!flush(sender)) state.failed = true;
+    }
+
+    // Chat payloads arrive as "sender: <stamp> xxx...".
+    void recordLatency(std::string_view text, Clock::time_point now) {
+        size_t start = text.find(": ");
+        if (start == std::string_view::npos || text.size() < start + 2 + STAMP_DIGITS) return;
+        uint64_t sentAt = 0;
+        for (size_t i = 0; i < STAMP_DIGITS; ++i) {
+            char c = text[start + 2 + i];
+            sentAt = (sentAt << 4) | static_cast<uint64_t>(c <= '9' ? c - '0' : c - 'a' + 10);
+        }
+        uint64_t receivedAt = stampNow(now);
+        latencies.push_back(receivedAt > sentAt ? receivedAt - sentAt : 0);
+    }
+
+    bool readBot(Bot& bot) {
+        if (bot.ring) bot.ring->clearBell();
+        while (true) {
+            char* buffer = bot.decoder.prepare(16384);
+            ssize_t bytes;
+            if (bot.ring) {
+                // The bell also means the server made room for our output.
+                bytes = bot.ring->read(buffer, bot.decoder.capacity());
+                if (bytes == 0) return flush(bot);
+                if (bytes < 0) return false;
+            } else {
+                bytes = recv(bot.fd, buffer, bot.decoder.capacity(), 0);
+                if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+                if (bytes < 0 && errno == EINTR) continue;
+                if (bytes <= 0) return false;
+            }
+            Clock::time_point now = Clock::now();
+            bot.decoder.commit(static_cast<size_t>(bytes));
+            Frame frame;
+            FrameDecoder::Status status;
+            while ((status = bot.decoder.next(frame)) == FrameDecoder::Status::Frame) {
+                if (frame.type == FrameType::Ping) {
+                    appendFrame(bot.out, FrameType::Pong, 0, frame.payload);
+                } else if (frame.type == FrameType::MemberList && !bot.joined) {
+                    bot.joined = true;
+                    ++state.joinedBots;
+                } else if (frame.type == FrameType::Chat && &bot != &bots[rooms[bot.room].bots[0]]) {
+                    ++bot.received;
+                    --remaining;
+                    recordLatency(frame.payload, now);
+                }
+            }
+            if (status == FrameDecoder::Status::Error) return false;
+            if (!bot.out.empty() && !flush(bot)) return false;
+        }
+    }
+
+public:
+    // Delivery latency of every chat message read, in nanoseconds.
+    std::vector<uint64_t> latencies;
+
+    // `roomSizes` pairs a global room id with its member count.
+    BenchWorker(const BenchOptions& opts, BenchState& st, const std::vector<std::pair<size_t, size_t>>& roomSizes)
+        : options(opts), state(st), payload(std::max(opts.payloadBytes, STAMP_DIGITS + 1), 'x'),
+          epollFd(epoll_create1(EPOLL_CLOEXEC)) {
+        payload[STAMP_DIGITS] = ' ';
+        if (options.rate > 0) {
+            sendInterval = std::chrono::nanoseconds(static_cast<long long>(1e9 / options.rate));
+        }
+        size_t totalBots = 0;
+        for (const auto& room : roomSizes) totalBots += room.second;
+        bots.resize(totalBots);
+        size_t index = 0;
+        for (size_t r = 0; r < roomSizes.size(); ++r) {
+            BenchRoom room;
+            room.name = "bench-" + std::to_string(roomSizes[r].first);
+            for (size_t m = 0; m < roomSizes[r].second; ++m, ++index) {
+                bots[index].room = r;
+                room.bots.push_back(index);
+            }
+            rooms.push_back(room);
+            expected += static_cast<unsigned long long>(roomSizes[r].second - 1) * options.messages;
+        }
+        remaining = expected;
+        latencies.reserve(expected);
+    }
+
+    ~BenchWorker() {
+        for (auto& bot : bots) {
+            if (bot.fd >= 0) close(bot.fd);
+        }
+        close(epollFd);
+    }
+
+    void run() {
+        for (auto& room : rooms) {
+            for (size_t m = 0; m < room.bots.size(); ++m) {
+                Bot& bot = bots[room.bots[m]];
+                if (!connectBot(bot, "bot" + std::to_string(m) + "-" + room.name + ":" + room.name)) {
+                    std::cerr << "Connect failed: " << strerror(errno) << "\n";
+                    state.failed = true;
+                    return;
+                }
+            }
+        }
+
+        std::vector<epoll_event> events(1024);
+        bool started = false;
+        // A paced sender needs waking for its next slot, not only for I/O.
+        int waitMs = options.rate > 0 ? 1 : 10;
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(options.timeoutSeconds);
+        while (remaining > 0 && !state.failed && Clock::now() < deadline) {
+            if (state.go && !started) {
+                started = true;
+                Clock::time_point now = Clock::now();
+                for (auto& room : rooms) {
+                    room.nextSend = now;
+                    pump(room, now);
+                }
+            }
+            int n = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), waitMs);
+            Clock::time_point now = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                Bot& bot = bots[events[i].data.u64 >> 1];
+                bool hungUp = events[i].data.u64 & 1;
+                if ((events[i].events & EPOLLOUT) && !flush(bot)) state.failed = true;
+                if (hungUp || ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !readBot(bot))) {
+                    std::cerr << "Bot in " << rooms[bot.room].name << " lost its connection.\n";
+                    state.failed = true;
+                }
+                if (started) pump(rooms[bot.room], now);
+            }
+            if (started && options.rate > 0) {
+                for (auto& room : rooms) pump(room, now);
+            }
+        }
+        state.deliveries += expected - remaining;
+    }
+};
+
+// Members per room: all equal, or Zipf-distributed with the same total so
+// room i gets a share proportional to 1 / (i + 1)^s. Every room keeps a
+// sender and at least one reader.
+static std::vector<size_t> roomSizes(const BenchOptions& options) {
+    std::vector<size_t> sizes(options.rooms, options.members);
+    if (!options.zipf) return sizes;
+    double weightSum = 0;
+    for (size_t i = 0; i < options.rooms; ++i) weightSum += 1.0 / std::pow(static_cast<double>(i + 1), options.zipfExponent);
+    double totalBots = static_cast<double>(options.rooms * options.members);
+    for (size_t i = 0; i < options.rooms; ++i) {
+        double share = totalBots / std::pow(static_cast<double>(i + 1), options.zipfExponent) / weightSum;
+        sizes[i] = std::max<size_t>(2, static_cast<size_t>(std::llround(share)));
+    }
+    return sizes;
+}
+
+// Finds the process listening on `port` by matching the socket inode in
+// /proc/net/tcp{,6} against every process's open fds. Returns 0 if none.
+static int findListeningPid(int port) {
+    std::vector<std::string> inodes;
+    for (const char* table : {"/proc/net/tcp", "/proc/net/tcp6"}) {
+        FILE* file = fopen(table, "r");
+        if (!file) continue;
+        char line[512];
+        while (fgets(line, sizeof(line), file)) {
+            char local[128];
+            unsigned state = 0;
+            unsigned long inode = 0;
+            if (sscanf(line, " %*d: %127s %*s %x %*s %*s %*s %*d %*d %lu", local, &state, &inode) != 3) continue;
+            const char* colon = strrchr(local, ':');
+            if (state == 0x0A && colon && strtol(colon + 1, nullptr, 16) == port) {
+                inodes.push_back("socket:[" + std::to_string(inode) + "]");
+            }
+        }
+        fclose(file);
+    }
+    if (inodes.empty()) return 0;
+
+    DIR* proc = opendir("/proc");
+    if (!proc) return 0;
+    int found = 0;
+    while (dirent* entry = readdir(proc)) {
+        int pid = atoi(entry->d_name);
+        if (pid <= 0 || pid == getpid()) continue;
+        std::string fdDir = std::string("/proc/") + entry->d_name + "/fd";
+        DIR* fds = opendir(fdDir.c_str());
+        if (!fds) continue;
+        while (dirent* fd = readdir(fds)) {
+            char target[64];
+            ssize_t length = readlink((fdDir + "/" + fd->d_name).c_str(), target, sizeof(target) - 1);
+            if (length <= 0) continue;
+            target[length] = '\0';
+            if (std::find(inodes.begin(), inodes.end(), target) != inodes.end()) {
+                found = pid;
+                break;
+            }
+        }
+        closedir(fds);
+        if (found) break;
+    }
+    closedir(proc);
+    return found;
+}
+
+// User plus system CPU time of a process, in seconds; negative if unknown.
+static double processCpuSeconds(int pid) {
+    FILE* file = fopen(("/proc/" + std::to_string(pid) + "/stat").c_str(), "r");
+    if (!file) return -1;
+    char buffer[1024];
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[length] = '\0';
+    // The command name may contain spaces; fields resume after its ')'.
+    const char* rest = strrchr(buffer, ')');
+    unsigned long long user = 0, system = 0;
+    if (!rest || sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &user, &system) != 2) return -1;
+    return static_cast<double>(user + system) / static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+static double ownCpuSeconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double percentileMicros(const std::vector<uint64_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size())));
+    return static_cast<double>(sorted[index]) / 1000.0;
+}
+
+static void printUsage() {
+    std::cerr << "Usage: chatsphere_bench <IP Address> <Port> [--rooms <n>] [--members <n>] [--distribution uniform|zipf]\n"
+              << "                        [--zipf-exponent <s>] [--messages <n>] [--rate <per second per room>]\n"
+              << "                        [--window <n>] [--size <bytes>] [--threads <n>] [--timeout <seconds>]\n"
+              << "                        [--server-pid <pid>] [--transport tcp|unix|shm] [--unix-socket <path>]\n"
+              << "                        [--ring-bytes <bytes>]\n";
+}
+
+static bool parseOptions(int argc, char* argv[], BenchOptions& options) {
+    options.host = argv[1];
+    options.port = std::stoi(argv[2]);
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--rooms") {
+            options.rooms = std::stoul(value);
+        } else if (flag == "--members") {
+            options.members = std::stoul(value);
+        } else if (flag == "--distribution") {
+            if (value != "uniform" && value != "zipf") return false;
+            options.zipf = value == "zipf";
+        } else if (flag == "--zipf-exponent") {
+            options.zipfExponent = std::stod(value);
+        } else if (flag == "--messages") {
+            options.messages = std::stoul(value);
+        } else if (flag == "--rate") {
+            options.rate = std::stod(value);
+        } else if (flag == "--window") {
+            options.window = std::stoul(value);
+        } else if (flag == "--size") {
+            options.payloadBytes = std::stoul(value);
+        } else if (flag == "--threads") {
+            options.threads = std::stoul(value);
+        } else if (flag == "--timeout") {
+            options.timeoutSeconds = std::stoi(value);
+        } else if (flag == "--server-pid") {
+            options.serverPid = std::stoi(value);
+        } else if (flag == "--transport") {
+            if (value == "tcp") {
+                options.transport = Transport::Tcp;
+            } else if (value == "unix") {
+                options.transport = Transport::Unix;
+            } else if (value == "shm") {
+                options.transport = Transport::SharedMemory;
+            } else {
+                return false;
+            }
+        } else if (flag == "--unix-socket") {
+            options.unixSocket = value;
+        } else if (flag == "--ring-bytes") {
+            options.ringBytes = std::stoul(value);
+        } else {
+            return false;
+        }
+    }
+    if (options.transport != Transport::Tcp && options.unixSocket.empty()) return false;
+    return options.members >= 2 && options.threads >= 1 && options.window >= 1 && options.rate >= 0;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    try {
+        if (argc < 3 || argc % 2 == 0 || !parseOptions(argc, argv, options)) {
+            printUsage();
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        printUsage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Largest rooms first, each to the least loaded thread.
+    std::vector<size_t> sizes = roomSizes(options);
+    std::vector<size_t> order(sizes.size());
+    for (size_t r = 0; r < order.size(); ++r) order[r] = r;
+    std::stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+    std::vector<std::vector<std::pair<size_t, size_t>>> assignments(options.threads);
+    std::vector<size_t> load(options.threads, 0);
+    for (size_t r : order) {
+        size_t thread = std::min_element(load.begin(), load.end()) - load.begin();
+        assignments[thread].push_back(std::make_pair(r, sizes[r]));
+        load[thread] += sizes[r];
+    }
+
+    BenchState state;
+    std::vector<std::unique_ptr<BenchWorker>> workers;
+    for (size_t t = 0; t < options.threads; ++t) {
+        workers.emplace_back(new BenchWorker(options, state, assignments[t]));
+    }
+
+    int serverPid = options.serverPid ? options.serverPid : findListeningPid(options.port);
+    if (serverPid == 0) {
+        std::cerr << "Server process for port " << options.port << " not found; CPU per message not reported.\n";
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(&BenchWorker::run, worker.get());
+    }
+
+    size_t totalBots = 0;
+    for (size_t size : sizes) totalBots += size;
+    Clock::time_point joinStart = Clock::now();
+    while (state.joinedBots < totalBots && !state.failed) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double joinSeconds = std::chrono::duration<double>(Clock::now() - joinStart).count();
+    double serverCpuStart = serverPid ? processCpuSeconds(serverPid) : -1;
+    double benchCpuStart = ownCpuSeconds();
+    Clock::time_point start = Clock::now();
+    state.go = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double serverCpu = serverPid && serverCpuStart >= 0 ? processCpuSeconds(serverPid) - serverCpuStart : -1;
+    double benchCpu = ownCpuSeconds() - benchCpuStart;
+
+    std::vector<uint64_t> latencies;
+    for (auto& worker : workers) {
+        latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    unsigned long long expected = 0;
+    for (size_t size : sizes) expected += static_cast<unsigned long long>(size - 1) * options.messages;
+    unsigned long long sent = static_cast<unsigned long long>(options.rooms) * options.messages;
+    std::cout << options.rooms << " rooms (" << (options.zipf ? "zipf" : "uniform") << ", "
+              << *std::min_element(sizes.begin(), sizes.end()) << " to " << *std::max_element(sizes.begin(), sizes.end())
+              << " members), " << options.messages << " messages per room";
+    if (options.rate > 0) std::cout << " at " << options.rate << "/s";
+    std::cout << ", " << std::max(options.payloadBytes, STAMP_DIGITS + 1) << " byte payloads\n"
+              << "joined " << totalBots << " bots in " << joinSeconds << " s\n"
+              << "delivered " << state.deliveries << " of " << expected << " in " << seconds << " s: "
+              << static_cast<unsigned long long>(state.deliveries / seconds) << " deliveries/s, "
+              << static_cast<unsigned long long>(sent / seconds) << " messages/s in\n"
+              << "latency us: p50 " << percentileMicros(latencies, 0.50) << ", p99 " << percentileMicros(latencies, 0.99)
+              << ", p999 " << percentileMicros(latencies, 0.999) << ", max "
+              << (latencies.empty() ? 0.0 : static_cast<double>(latencies.back()) / 1000.0) << "\n";
+    if (serverCpu >= 0) {
+        std::cout << "server cpu " << serverCpu << " s: " << serverCpu * 1e6 / static_cast<double>(sent)
+                  << " us per message in, " << serverCpu * 1e9 / static_cast<double>(std::max(1ULL, state.deliveries.load()))
+                  << " ns per delivery\n";
+    }
+    std::cout << "bench cpu " << benchCpu << " s\n";
+    return state.failed || state.deliveries != expected ? 1 : 0;
+}
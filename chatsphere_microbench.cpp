@@ -0,0 +1,301 @@
+// chatsphere-microbench: per-operation costs of the server core.
+//
+// Drives ChatCore through MemoryTransport, so no sockets, syscalls or
+// event loop are involved: what is timed is the core's own work, i.e.
+// parsing, routing, history and fan-out into the recipients' queues.
+// Each case runs its operation in batches for --seconds of measured time;
+// setup and clean-up between batches (emptying inboxes, reconnecting
+// clients) are not timed. The report gives nanoseconds per operation as
+// the mean over all batches and the p50/p99 of the batch means, plus the
+// heap allocations per operation, one case per line, so runs from
+// different builds can be diffed.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+
+#include "chat_core.h"
+#include "chat_timer.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct MicrobenchOptions {
+    // Only cases whose name contains this run.
+    std::string filter;
+    // Measured time per case.
+    double seconds = 0.5;
+};
+
+static MicrobenchOptions options;
+// Results are summed here so the compiler cannot drop the work.
+static volatile size_t sink;
+
+// Every operator new in the process is counted, so a case's allocations
+// per operation can be reported next to its time.
+static size_t allocations;
+
+void* operator new(size_t size) {
+    ++allocations;
+    if (void* pointer = std::malloc(size ? size : 1)) return pointer;
+    throw std::bad_alloc();
+}
+
+// Kept out of line: GCC otherwise sees free() on a pointer from operator
+// new and warns of a mismatch.
+#if defined(__GNUC__) && !defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+NOINLINE void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+NOINLINE void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+static bool selected(const std::string& name) {
+    return name.find(options.filter) != std::string::npos;
+}
+
+static double percentile(std::vector<double> values, double q) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, static_cast<size_t>(q * static_cast<double>(values.size())))];
+}
+
+// Times `op(i)` in batches of `batch` calls until options.seconds of
+// measured time have passed; `reset()` runs untimed after each batch.
+template <typename Op, typename Reset>
+static void measure(const std::string& name, size_t batch, Op op, Reset reset) {
+    std::vector<double> batchNs;
+    double measured = 0;
+    unsigned long long ops = 0;
+    size_t allocated = 0;
+    while (measured < options.seconds || batchNs.size() < 5) {
+        size_t allocationsBefore = allocations;
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < batch; ++i) op(i);
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        allocated += allocations - allocationsBefore;
+        reset();
+        measured += elapsed;
+        ops += batch;
+        batchNs.push_back(elapsed * 1e9 / static_cast<double>(batch));
+    }
+    std::cout << std::left << std::setw(24) << name << std::right << std::setw(12) << ops << std::fixed
+              << std::setprecision(1) << std::setw(14) << measured * 1e9 / static_cast<double>(ops) << std::setw(14)
+              << percentile(batchNs, 0.50) << std::setw(14) << percentile(batchNs, 0.99) << std::setprecision(2)
+              << std::setw(12) << static_cast<double>(allocated) / static_cast<double>(ops) << "\n";
+}
+
+static void clearInboxes(MemoryTransport& transport) {
+    transport.core.connections.forEach([](MemoryConnection& conn) { conn.inbox.clear(); });
+}
+
+// Seats a member without the join replay and notice, so rooms of 100k
+// can be built in linear time. Such members cannot receive PMs.
+static SlotHandle seat(MemoryTransport& transport, ChatRoom& room, const std::string& username) {
+    SlotHandle handle = transport.core.open();
+    MemoryConnection& conn = *transport.client(handle);
+    conn.framed = true;
+    conn.joined = true;
+    conn.username = username;
+    conn.room = &room;
+    conn.memberIndex = room.addMember(handle);
+    return handle;
+}
+
+static void benchHelloParse() {
+    if (!selected("hello/parse")) return;
+    std::vector<std::string> hellos;
+    for (int i = 0; i < 64; ++i) {
+        hellos.push_back("user" + std::to_string(i * 7919) + ":room-" + std::to_string(i % 10) +
+                         (i % 4 == 0 ? ":" + std::to_string(100000 + i) : ""));
+    }
+    std::string username;
+    std::string roomName;
+    uint64_t lastSeen = 0;
+    measure("hello/parse", 1000, [&](size_t i) {
+        ChatCore<MemoryConnection>::parseHello(hellos[i % hellos.size()], true, username, roomName, lastSeen);
+        sink = sink + roomName.size() + lastSeen;
+    }, [] {});
+}
+
+static void benchPrivateRouting() {
+    if (!selected("pm/route")) return;
+    MemoryTransport transport;
+    std::vector<SlotHandle> users;
+    for (int i = 0; i < 1000; ++i) {
+        users.push_back(transport.connect("user" + std::to_string(i) + ":room-" + std::to_string(i % 10)));
+    }
+    clearInboxes(transport);
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 1000; ++i) payloads.push_back("user" + std::to_string((i * 7) % 1000) + ":are you there?");
+    measure("pm/route", 100, [&](size_t i) {
+        transport.send(users[i * 13 % users.size()], FrameType::Private, payloads[i % payloads.size()]);
+    }, [&] { clearInboxes(transport); });
+}
+
+// Joining replays the room's history (full, at the default 1000
+// messages) and tells the room's 100 members; leaving tells them too.
+static void benchJoinLeave() {
+    MemoryTransport transport;
+    for (int i = 0; i < 100; ++i) transport.connect("member" + std::to_string(i) + ":lobby");
+    for (int i = 0; i < 1000; ++i) transport.send(transport.core.findByUsername("member0")->handle, FrameType::Chat, "warming up the history");
+    clearInboxes(transport);
+
+    const size_t batch = 10;
+    std::vector<SlotHandle> visitors(batch);
+    size_t next = 0;
+    std::vector<std::string> hellos;
+    for (size_t i = 0; i < 1000; ++i) hellos.push_back("visitor" + std::to_string(i) + ":lobby");
+    if (selected("room/join")) {
+        measure("room/join", batch, [&](size_t i) { visitors[i] = transport.connect(hellos[next++ % hellos.size()]); }, [&] {
+            for (SlotHandle visitor : visitors) transport.disconnect(visitor);
+            clearInboxes(transport);
+        });
+    }
+    if (selected("room/leave")) {
+        auto rejoin = [&] {
+            for (size_t i = 0; i < batch; ++i) visitors[i] = transport.connect(hellos[next++ % hellos.size()]);
+            clearInboxes(transport);
+        };
+        rejoin();
+        measure("room/leave", batch, [&](size_t i) { transport.disconnect(visitors[i]); }, rejoin);
+    }
+}
+
+static void benchHistoryAppend() {
+    if (!selected("history/append")) return;
+    ChatRoom room("history", HistoryLimits());
+    std::string payload(64, 'x');
+    measure("history/append", 1000, [&](size_t) { sink = sink + room.addMessage(FrameType::Chat, payload)->sequence; }, [] {});
+}
+
+// Two-word searches of a room holding a million messages. Words are
+// drawn from a 10k vocabulary with a skew, so common words have long
+// lists and rare ones short.
+static void benchHistorySearch() {
+    if (!selected("history/search")) return;
+    HistoryLimits limits;
+    limits.maxMessages = 1000000;
+    limits.maxBytes = size_t(1) << 30;
+    ChatRoom room("history", limits);
+    uint64_t state = 42;
+    auto word = [&state] {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t k = (state >> 33) % 10000;
+        return "w" + std::to_string(k * k / 10000);
+    };
+    std::string text;
+    for (size_t i = 0; i < limits.maxMessages; ++i) {
+        text = "user" + std::to_string(i % 100) + ":";
+        for (int w = 0; w < 8; ++w) text += " " + word();
+        room.addMessage(FrameType::Chat, text);
+    }
+    std::vector<std::string> queries;
+    for (int i = 0; i < 64; ++i) queries.push_back(word() + " " + word());
+    std::vector<SharedMessage> found;
+    measure("history/search", 100, [&](size_t i) {
+        found.clear();
+        room.search(queries[i % queries.size()], ChatCore<MemoryConnection>::SEARCH_RESULTS, found);
+        sink = sink + found.size();
+    }, [] {});
+}
+
+// One chat message from one member, delivered to every other member.
+static void benchBroadcast(size_t members) {
+    std::string name = "broadcast/" + std::to_string(members);
+    if (!selected(name)) return;
+    MemoryTransport transport;
+    ChatRoom& room = transport.core.openRoom(name);
+    std::vector<SlotHandle> handles;
+    for (size_t i = 0; i < members; ++i) handles.push_back(seat(transport, room, "member" + std::to_string(i)));
+    std::string payload(64, 'x');
+    size_t batch = std::max<size_t>(1, 10000 / members);
+    measure(name, batch, [&](size_t) { transport.send(handles[0], FrameType::Chat, payload); },
+            [&] { clearInboxes(transport); });
+}
+
+// A client flooding a room past its rate limit: every message after the
+// first finds the bucket empty and is shed.
+static void benchRateShed() {
+    if (!selected("rate/shed")) return;
+    MemoryTransport transport;
+    transport.core.limits.connection = RateLimit::perSecond(1, 1);
+    transport.core.limits.policy = FloodPolicy::Shed;
+    SlotHandle flooder = transport.connect("flooder:lobby");
+    for (int i = 0; i < 100; ++i) transport.connect("member" + std::to_string(i) + ":lobby");
+    std::string payload(64, 'x');
+    transport.send(flooder, FrameType::Chat, payload);
+    transport.send(flooder, FrameType::Chat, payload);
+    clearInboxes(transport);
+    measure("rate/shed", 1000, [&](size_t) { transport.send(flooder, FrameType::Chat, payload); },
+            [&] { sink = sink + transport.core.stats.shed; });
+}
+
+// The server's timer load: 200k connections, each re-armed 30 s ahead
+// when its timer fires. One operation is one 1 ms tick of the wheel,
+// firing and re-arming about seven timers.
+static void benchTimerChurn() {
+    if (!selected("timer/churn")) return;
+    const uint64_t live = 200000;
+    const uint64_t horizon = 30000;
+    TimerWheel<uint64_t> wheel;
+    for (uint64_t i = 0; i < live; ++i) wheel.schedule(i * 7919 % horizon, i);
+    uint64_t now = 0;
+    measure("timer/churn", 1000, [&](size_t) {
+        wheel.advance(now, [&](uint64_t id) { wheel.schedule(now + horizon + id % 1000, id); });
+        ++now;
+    }, [&] { sink = sink + wheel.size(); });
+}
+
+static void printUsage() {
+    std::cerr << "Usage: chatsphere_microbench [--filter <substring>] [--seconds <per case>]\n";
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc % 2 == 0) {
+            printUsage();
+            return 1;
+        }
+        for (int i = 1; i + 1 < argc; i += 2) {
+            std::string flag = argv[i];
+            if (flag == "--filter") {
+                options.filter = argv[i + 1];
+            } else if (flag == "--seconds") {
+                options.seconds = std::stod(argv[i + 1]);
+            } else {
+                printUsage();
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        printUsage();
+        return 1;
+    }
+
+    std::cout << std::left << std::setw(24) << "case" << std::right << std::setw(12) << "ops" << std::setw(14) << "mean ns/op"
+              << std::setw(14) << "p50 ns/op" << std::setw(14) << "p99 ns/op" << std::setw(12) << "allocs/op" << "\n";
+    benchHelloParse();
+    benchPrivateRouting();
+    benchJoinLeave();
+    benchHistoryAppend();
+    benchHistorySearch();
+    benchBroadcast(10);
+    benchBroadcast(1000);
+    benchBroadcast(100000);
+    benchRateShed();
+    benchTimerChurn();
+    return 0;
+}
@@ -0,0 +1,367 @@
+// chatsphere-replay: drives a traffic capture against a server.
+//
+// Reads a file written by `server --capture`, orders its records by time
+// and plays them back: every captured connection is reopened and sends
+// the same handshake and frames, in the protocol it originally used, at
+// the captured pace scaled by --speed (1 is real time, 10 is ten times
+// faster, max sends each event as soon as the previous one is out).
+// Join storms and busy rooms therefore arrive the way they did in
+// production instead of as a synthetic steady load.
+//
+// Server output is read and discarded so it never backs up. Reports how
+// late events were sent against the schedule, which grows when the
+// replayer or the server cannot keep up, and the achieved event rate.
+//
+// Linux only: it needs epoll to drive thousands of sockets.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include "chat_protocol.h"
+#include "chat_capture.h"
+
+#ifndef __linux__
+#error "chatsphere-replay needs epoll (Linux)."
+#endif
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct ReplayOptions {
+    std::string host = "127.0.0.1";
+    int port = 0;
+    std::string capturePath;
+    // Multiplier on the captured pace; 0 replays as fast as possible.
+    double speed = 1;
+    // How long to keep reading server output after the last event.
+    double drainSeconds = 1;
+};
+
+struct ReplayConnection {
+    int fd = -1;
+    bool legacy = false;
+    // The captured connection closed; close once `out` is sent.
+    bool closing = false;
+    std::string out;
+    size_t outOffset = 0;
+};
+
+struct ReplayStats {
+    unsigned long long events = 0;
+    unsigned long long connections = 0;
+    unsigned long long frames = 0;
+    // Events for connections the server had already closed.
+    unsigned long long skipped = 0;
+    unsigned long long closedByServer = 0;
+    unsigned long long bytesReceived = 0;
+    std::vector<uint64_t> lagNs;
+};
+
+// Loads every complete record of a capture, sorted by time. Records keep
+// pointing into `data`.
+static bool loadCapture(const std::string& path, std::string& data, std::vector<CaptureRecord>& records) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open " << path << ".\n";
+        return false;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    data = contents.str();
+    if (data.size() < sizeof(CAPTURE_MAGIC) || std::memcmp(data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        std::cerr << path << " is not a chatsphere capture.\n";
+        return false;
+    }
+
+    size_t offset = sizeof(CAPTURE_MAGIC);
+    while (offset < data.size()) {
+        CaptureRecord record;
+        size_t size = 0;
+        DecodeStatus status = parseCaptureRecord(data.data() + offset, data.size() - offset, record, size);
+        if (status == DecodeStatus::Error) {
+            std::cerr << "Corrupt record at offset " << offset << "; replaying what precedes it.\n";
+            break;
+        }
+        if (status == DecodeStatus::NeedMore) {
+            std::cerr << "Capture ends in a partial record; ignoring its last " << data.size() - offset << " bytes.\n";
+            break;
+        }
+        records.push_back(record);
+        offset += size;
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const CaptureRecord& a, const CaptureRecord& b) { return a.timeNs < b.timeNs; });
+    return true;
+}
+
+class Replayer {
+private:
+    const ReplayOptions& options;
+    const std::vector<CaptureRecord>& records;
+    std::unordered_map<uint64_t, ReplayConnection> connections;
+    int epollFd;
+
+    void closeConnection(uint64_t id, ReplayConnection& conn) {
+        close(conn.fd);
+        connections.erase(id);
+    }
+
+    // Returns false once the connection has been closed.
+    bool flush(uint64_t id, ReplayConnection& conn) {
+        while (conn.outOffset < conn.out.size()) {
+            ssize_t sent = send(conn.fd, conn.out.data() + conn.outOffset, conn.out.size() - conn.outOffset, MSG_NOSIGNAL);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0) {
+                ++stats.closedByServer;
+                closeConnection(id, conn);
+                return false;
+            }
+            conn.outOffset += static_cast<size_t>(sent);
+        }
+        conn.out.clear();
+        conn.outOffset = 0;
+        if (conn.closing) {
+            closeConnection(id, conn);
+            return false;
+        }
+        return true;
+    }
+
+    void drainInput(uint64_t id, ReplayConnection& conn) {
+        char buffer[65536];
+        while (true) {
+            ssize_t bytes = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (bytes > 0) {
+                stats.bytesReceived += static_cast<unsigned long long>(bytes);
+                continue;
+            }
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (!conn.closing) ++stats.closedByServer;
+            closeConnection(id, conn);
+            return;
+        }
+    }
+
+    bool openConnection(uint64_t id) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            std::cerr << "socket() failed: " << strerror(errno) << " (raise ulimit -n for large captures).\n";
+            return false;
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        addr.sin_addr.s_addr = inet_addr(options.host.c_str());
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS) {
+            std::cerr << "Connect failed: " << strerror(errno) << "\n";
+            close(fd);
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = id;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            return false;
+        }
+        connections[id].fd = fd;
+        ++stats.connections;
+        return true;
+    }
+
+    // Frames go out as their client sent them: binary frames, or one
+    // line each for legacy text clients.
+    void sendFrame(uint64_t id, const CaptureRecord& record) {
+        auto it = connections.find(id);
+        if (it == connections.end() || it->second.closing) {
+            ++stats.skipped;
+            return;
+        }
+        ReplayConnection& conn = it->second;
+        if (record.event == CaptureEvent::Hello) conn.legacy = (record.flags & CAPTURE_LEGACY) != 0;
+        if (conn.legacy) {
+            conn.out.append(record.payload.data(), record.payload.size());
+            conn.out += '\n';
+        } else {
+            appendFrame(conn.out, record.event == CaptureEvent::Hello ? FrameType::Hello : record.type, 0, record.payload);
+        }
+        if (record.event == CaptureEvent::Frame) ++stats.frames;
+        flush(id, conn);
+    }
+
+    bool play(const CaptureRecord& record) {
+        ++stats.events;
+        switch (record.event) {
+        case CaptureEvent::Connect:
+            return openConnection(record.connection);
+        case CaptureEvent::Hello:
+        case CaptureEvent::Frame:
+            sendFrame(record.connection, record);
+            return true;
+        case CaptureEvent::Disconnect: {
+            auto it = connections.find(record.connection);
+            if (it == connections.end()) return true;
+            it->second.closing = true;
+            flush(record.connection, it->second);
+            return true;
+        }
+        }
+        return true;
+    }
+
+    // Reads and writes whatever is ready, waiting at most timeoutMs.
+    void poll(std::vector<epoll_event>& events, int timeoutMs) {
+        int n = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeoutMs);
+        for (int i = 0; i < n; ++i) {
+            auto it = connections.find(events[i].data.u64);
+            if (it == connections.end()) continue;
+            if ((events[i].events & EPOLLOUT) && !flush(it->first, it->second)) continue;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) drainInput(it->first, it->second);
+        }
+    }
+
+public:
+    ReplayStats stats;
+
+    Replayer(const ReplayOptions& opts, const std::vector<CaptureRecord>& recs)
+        : options(opts), records(recs), epollFd(epoll_create1(EPOLL_CLOEXEC)) {
+        stats.lagNs.reserve(records.size());
+    }
+
+    ~Replayer() {
+        for (auto& entry : connections) close(entry.second.fd);
+        close(epollFd);
+    }
+
+    // Returns the seconds taken to send every event, or a negative value
+    // if a connection could not be opened.
+    double run() {
+        std::vector<epoll_event> events(1024);
+        Clock::time_point start = Clock::now();
+        size_t next = 0;
+        uint64_t firstNs = records.empty() ? 0 : records[0].timeNs;
+        while (next < records.size()) {
+            Clock::time_point now = Clock::now();
+            // Bounded so replies keep being read during a burst.
+            for (size_t batch = 0; batch < 256 && next < records.size(); ++batch, ++next) {
+                const CaptureRecord& record = records[next];
+                if (options.speed > 0) {
+                    Clock::time_point due = start + std::chrono::nanoseconds(static_cast<long long>(
+                                                        static_cast<double>(record.timeNs - firstNs) / options.speed));
+                    if (due > now) break;
+                    stats.lagNs.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count()));
+                }
+                if (!play(record)) return -1;
+            }
+            int timeoutMs = 0;
+            if (options.speed > 0 && next < records.size()) {
+                Clock::time_point due = start + std::chrono::nanoseconds(static_cast<long long>(
+                                                    static_cast<double>(records[next].timeNs - firstNs) / options.speed));
+                long long waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(due - Clock::now()).count();
+                timeoutMs = waitNs <= 0 ? 0 : static_cast<int>((waitNs + 999999) / 1000000);
+            }
+            poll(events, timeoutMs);
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        Clock::time_point drainUntil = Clock::now() + std::chrono::milliseconds(static_cast<long long>(options.drainSeconds * 1000));
+        while (!connections.empty() && Clock::now() < drainUntil) {
+            poll(events, 10);
+        }
+        return seconds;
+    }
+};
+
+static double percentileMicros(const std::vector<uint64_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size())));
+    return static_cast<double>(sorted[index]) / 1000.0;
+}
+
+static void printUsage() {
+    std::cerr << "Usage: chatsphere_replay <IP Address> <Port> <capture file> [--speed <multiplier>|max]\n"
+              << "                         [--drain <seconds>]\n";
+}
+
+static bool parseOptions(int argc, char* argv[], ReplayOptions& options) {
+    options.host = argv[1];
+    options.port = std::stoi(argv[2]);
+    options.capturePath = argv[3];
+    for (int i = 4; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--speed") {
+            options.speed = value == "max" ? 0 : std::stod(value);
+            if (value != "max" && options.speed <= 0) return false;
+        } else if (flag == "--drain") {
+            options.drainSeconds = std::stod(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    ReplayOptions options;
+    try {
+        if (argc < 4 || argc % 2 != 0 || !parseOptions(argc, argv, options)) {
+            printUsage();
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        printUsage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string data;
+    std::vector<CaptureRecord> records;
+    if (!loadCapture(options.capturePath, data, records)) return 1;
+    double capturedSeconds = records.empty() ? 0 : static_cast<double>(records.back().timeNs - records.front().timeNs) / 1e9;
+
+    Replayer replayer(options, records);
+    double seconds = replayer.run();
+    if (seconds < 0) return 1;
+
+    ReplayStats& stats = replayer.stats;
+    std::sort(stats.lagNs.begin(), stats.lagNs.end());
+    std::cout << "replayed " << stats.events << " events (" << stats.connections << " connections, " << stats.frames
+              << " frames) spanning " << capturedSeconds << " s in " << seconds << " s";
+    if (options.speed > 0) {
+        std::cout << " at " << options.speed << "x";
+    } else {
+        std::cout << " at max speed";
+    }
+    std::cout << ": " << static_cast<unsigned long long>(static_cast<double>(stats.events) / std::max(seconds, 1e-9)) << " events/s\n";
+    if (options.speed > 0) {
+        std::cout << "schedule lag us: p50 " << percentileMicros(stats.lagNs, 0.50) << ", p99 "
+                  << percentileMicros(stats.lagNs, 0.99) << ", max "
+                  << (stats.lagNs.empty() ? 0.0 : static_cast<double>(stats.lagNs.back()) / 1000.0) << "\n";
+    }
+    std::cout << "received " << stats.bytesReceived << " bytes; " << stats.closedByServer << " connections closed by the server, "
+              << stats.skipped << " events skipped\n";
+    return 0;
+}
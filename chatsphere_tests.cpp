@@ -0,0 +1,736 @@
+// chatsphere-tests: behaviour checks for the server core and its room logs.
+//
+// Clients are driven through MemoryTransport, so the checks need no
+// sockets or event loop. The server's own pieces (output queues, room
+// logs) are reached by including new_server.cpp without its main(). Each
+// case prints one line; the exit status is the number of failed cases.
+
+#define CHATSPHERE_NO_MAIN
+#include "new_server.cpp"
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+static int failures;
+static bool caseFailed;
+
+#define CHECK(condition)                                                                \
+    do {                                                                                \
+        if (!(condition)) {                                                             \
+            std::cout << "    " << __FILE__ << ":" << __LINE__ << ": " #condition "\n"; \
+            caseFailed = true;                                                          \
+        }                                                                               \
+    } while (0)
+
+static void run(const char* name, void (*test)()) {
+    caseFailed = false;
+    try {
+        test();
+    } catch (const std::exception& e) {
+        std::cout << "    threw: " << e.what() << "\n";
+        caseFailed = true;
+    }
+    std::cout << (caseFailed ? "FAIL " : "ok   ") << name << "\n";
+    if (caseFailed) ++failures;
+}
+
+static bool startsWith(std::string_view text, std::string_view prefix) {
+    return text.substr(0, prefix.size()) == prefix;
+}
+
+static size_t countType(const std::vector<SharedMessage>& inbox, FrameType type) {
+    return static_cast<size_t>(std::count_if(inbox.begin(), inbox.end(), [type](const SharedMessage& m) { return m->type == type; }));
+}
+
+// Handshakes, room chat, PMs and leaving, as seen in the inboxes.
+static void testMemoryTransport() {
+    MemoryTransport transport;
+    // Looked up each time: connecting may move every connection.
+    auto inbox = [&transport](SlotHandle client) -> std::vector<SharedMessage>& { return transport.client(client)->inbox; };
+    CHECK(!transport.connect("no room").valid());
+    SlotHandle alice = transport.connect("alice:lobby");
+    CHECK(alice.valid());
+    CHECK(countType(inbox(alice), FrameType::MemberList) == 1);
+
+    SlotHandle bob = transport.connect("bob:lobby");
+    CHECK(!inbox(alice).empty() && inbox(alice).back()->payload() == "bob joined room lobby!");
+    // Bob's replay holds Alice's join; the member list follows it.
+    CHECK(inbox(bob).size() == 2 && inbox(bob)[0]->payload() == "alice joined room lobby!");
+    CHECK(inbox(bob).size() == 2 && startsWith(inbox(bob)[1]->payload(), "Members in room lobby: "));
+
+    inbox(alice).clear();
+    inbox(bob).clear();
+    transport.send(alice, FrameType::Chat, "hi");
+    CHECK(inbox(bob).size() == 1 && inbox(bob)[0]->type == FrameType::Chat && inbox(bob)[0]->payload() == "alice: hi");
+    CHECK(inbox(alice).empty());
+
+    inbox(bob).clear();
+    transport.send(alice, FrameType::Private, "bob:psst");
+    CHECK(inbox(bob).size() == 1 && inbox(bob)[0]->type == FrameType::Private && inbox(bob)[0]->payload() == "alice:psst");
+    CHECK(inbox(alice).size() == 1 && inbox(alice)[0]->payload() == "alice:psst");
+
+    inbox(alice).clear();
+    transport.disconnect(bob);
+    CHECK(transport.client(bob) == nullptr);
+    CHECK(inbox(alice).size() == 1 && inbox(alice)[0]->payload() == "bob left room lobby!");
+}
+
+// Drop-oldest frees at least the excess from the front, never touching a
+// partly written head; coalesce folds the backlog into one notice whose
+// count accumulates until the queue drains.
+static void testSlowConsumerPolicies() {
+    OutputQueue out;
+    out.framed = true;
+    for (int i = 0; i < 10; ++i) out.push(makeMessage(FrameType::Chat, static_cast<uint64_t>(i + 1), "0123456789"));
+    size_t each = out.queuedBytes / 10;
+
+    size_t droppedBytes = 0;
+    CHECK(out.dropOldest(2 * each + 1, droppedBytes) == 3);
+    CHECK(droppedBytes == 3 * each);
+    CHECK(out.pending.size() == 7 && out.queuedBytes == 7 * each);
+    CHECK(out.pending.front().message->sequence == 4);
+
+    out.headOffset = 1;
+    CHECK(out.dropOldest(each, droppedBytes) == 1);
+    CHECK(out.pending.front().message->sequence == 4);
+    CHECK(out.pending[1].message->sequence == 6);
+    out.headOffset = 0;
+
+    CHECK(out.coalesce() == 6);
+    CHECK(out.pending.size() == 1);
+    CHECK(out.pending.front().notice);
+    CHECK(out.pending.front().message->payload() == "[6 messages skipped: connection too slow]");
+    out.push(makeMessage(FrameType::Chat, 20, "0123456789"));
+    out.push(makeMessage(FrameType::Chat, 21, "0123456789"));
+    CHECK(out.coalesce() == 2);
+    CHECK(out.pending.size() == 1);
+    CHECK(out.pending.front().message->payload() == "[8 messages skipped: connection too slow]");
+    CHECK(out.queuedBytes == out.data(out.pending.front()).size());
+}
+
+// Copies `bytes` in the way a recv() into the decoder would.
+static void feed(FrameDecoder& decoder, std::string_view bytes) {
+    std::memcpy(decoder.prepare(bytes.size()), bytes.data(), bytes.size());
+    decoder.commit(bytes.size());
+}
+
+// A frame arriving a byte at a time is only returned once complete, and
+// one larger than the initial buffer is reassembled too.
+static void testFrameDecoderPartial() {
+    std::string wire = encodeFrame(FrameType::Chat, 7, "hello world");
+    FrameDecoder decoder;
+    Frame frame;
+    CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+    for (size_t i = 0; i + 1 < wire.size(); ++i) {
+        feed(decoder, std::string_view(wire).substr(i, 1));
+        CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+    }
+    CHECK(decoder.mode() == FrameDecoder::Mode::Framed);
+    feed(decoder, std::string_view(wire).substr(wire.size() - 1));
+    CHECK(decoder.next(frame) == DecodeStatus::Frame);
+    CHECK(frame.type == FrameType::Chat && frame.sequence == 7 && frame.payload == "hello world");
+    CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+
+    std::string large(10000, 'x');
+    wire = encodeFrame(FrameType::Chat, 8, large);
+    for (size_t i = 0; i < wire.size(); i += 1000) {
+        CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+        feed(decoder, std::string_view(wire).substr(i, 1000));
+    }
+    CHECK(decoder.next(frame) == DecodeStatus::Frame);
+    CHECK(frame.sequence == 8 && frame.payload == large);
+}
+
+// Several frames in one read come out one by one; a trailing partial one
+// waits for its remainder. A bad header is an error.
+static void testFrameDecoderBatched() {
+    std::string three = encodeFrame(FrameType::Chat, 0, "three");
+    std::string wire = encodeFrame(FrameType::Hello, 0, "alice:lobby") + encodeFrame(FrameType::Chat, 0, "one") +
+                       encodeFrame(FrameType::Private, 0, "bob:two") + three.substr(0, 20);
+    FrameDecoder decoder;
+    feed(decoder, wire);
+    Frame frame;
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.type == FrameType::Hello && frame.payload == "alice:lobby");
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.type == FrameType::Chat && frame.payload == "one");
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.type == FrameType::Private && frame.payload == "bob:two");
+    CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+    feed(decoder, std::string_view(three).substr(20));
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.payload == "three");
+
+    std::string badVersion = encodeFrame(FrameType::Chat, 0, "x");
+    badVersion[1] = static_cast<char>(PROTOCOL_VERSION + 1);
+    FrameDecoder rejected;
+    feed(rejected, badVersion);
+    CHECK(rejected.next(frame) == DecodeStatus::Error);
+
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, FrameType::Chat, 0, MAX_FRAME_PAYLOAD + 1);
+    FrameDecoder oversized;
+    feed(oversized, std::string_view(header, sizeof(header)));
+    CHECK(oversized.next(frame) == DecodeStatus::Error);
+}
+
+// Input not starting with the frame magic is read as text lines, CRLF or
+// LF, returned as Chat frames; a line with no end in sight is an error.
+static void testFrameDecoderLegacy() {
+    FrameDecoder decoder;
+    feed(decoder, "alice:lobby\r\nhel");
+    CHECK(decoder.mode() == FrameDecoder::Mode::Legacy);
+    Frame frame;
+    CHECK(decoder.next(frame) == DecodeStatus::Frame);
+    CHECK(frame.type == FrameType::Chat && frame.sequence == 0 && frame.payload == "alice:lobby");
+    CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+    CHECK(decoder.pending() == "hel");
+    feed(decoder, "lo\n\n");
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.payload == "hello");
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.payload.empty());
+    CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+
+    FrameDecoder endless;
+    feed(endless, std::string(MAX_FRAME_PAYLOAD + 1, 'a'));
+    CHECK(endless.next(frame) == DecodeStatus::Error);
+}
+
+// unread() puts back the frame just returned, framed or legacy, and the
+// next call returns it again.
+static void testFrameDecoderUnread() {
+    FrameDecoder decoder;
+    feed(decoder, encodeFrame(FrameType::Chat, 1, "first") + encodeFrame(FrameType::Chat, 2, "second"));
+    Frame frame;
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.sequence == 1);
+    decoder.unread();
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.sequence == 1 && frame.payload == "first");
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.sequence == 2);
+    decoder.unread();
+    CHECK(decoder.next(frame) == DecodeStatus::Frame && frame.sequence == 2 && frame.payload == "second");
+    CHECK(decoder.next(frame) == DecodeStatus::NeedMore);
+
+    FrameDecoder legacy;
+    feed(legacy, "one\ntwo\n");
+    CHECK(legacy.next(frame) == DecodeStatus::Frame && frame.payload == "one");
+    legacy.unread();
+    CHECK(legacy.next(frame) == DecodeStatus::Frame && frame.payload == "one");
+    CHECK(legacy.next(frame) == DecodeStatus::Frame && frame.payload == "two");
+}
+
+#ifndef _WIN32
+static uint64_t lastSequence(const std::vector<SharedMessage>& inbox) {
+    uint64_t last = 0;
+    for (const SharedMessage& message : inbox) last = std::max(last, message->sequence);
+    return last;
+}
+
+// MemoryTransport with the server's room logs attached, as --data-dir does.
+class LoggedTransport : public MemoryTransport {
+public:
+    explicit LoggedTransport(LogStore& s) : store(s) {
+        core.keepEmptyRooms = true;
+    }
+
+    void roomOpened(ChatRoom& room) override {
+        RoomLog& roomLog = store.open(room.name);
+        std::vector<SharedMessage> recovered;
+        uint64_t next = roomLog.recover(core.historyFor(room.name), recovered);
+        room.attachLog(roomLog, next, recovered);
+    }
+
+private:
+    LogStore& store;
+};
+
+static std::string makeTempDir() {
+    char path[] = "/tmp/chatsphere-tests-XXXXXX";
+    if (!mkdtemp(path)) throw std::runtime_error(std::string("mkdtemp: ") + strerror(errno));
+    return path;
+}
+
+static void removeTree(const std::string& path) {
+    std::string command = "rm -rf '" + path + "'";
+    if (system(command.c_str()) != 0) std::cout << "    could not remove " << path << "\n";
+}
+
+// Runs one server lifetime over `dir`: bob sends `count` messages to the
+// lobby. Returns the sequence of the last message bob saw, replayed or new.
+static uint64_t loggedSession(const std::string& dir, size_t segmentBytes, int count, uint64_t& replayedUpTo) {
+    LogStore store(dir, segmentBytes);
+    LoggedTransport transport(store);
+    transport.core.history = HistoryLimits{2, 1 << 20};
+    SlotHandle bob = transport.connect("bob:lobby");
+    // Bob's own join is not echoed to him, so all he holds is the replay.
+    replayedUpTo = lastSequence(transport.client(bob)->inbox);
+    for (int i = 0; i < count; ++i) transport.send(bob, FrameType::Chat, "entry " + std::to_string(i));
+    store.commit();
+    return transport.core.rooms.at("lobby").nextSequence - 1;
+}
+
+// "lobby", hex-encoded as LogStore names its directories.
+static const char LOBBY_DIR[] = "/room-6c6f626279";
+
+static std::string newestSegment(const std::string& dir) {
+    std::string room = dir + LOBBY_DIR;
+    std::vector<std::string> names;
+    DIR* handle = opendir(room.c_str());
+    if (!handle) return std::string();
+    while (dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0) names.push_back(name);
+    }
+    closedir(handle);
+    std::sort(names.begin(), names.end());
+    return names.empty() ? std::string() : room + "/" + names.back();
+}
+
+static off_t fileSize(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+// Sequence numbers keep increasing across restarts, even when the history
+// limit recovers only a couple of records and segments roll every record
+// or two.
+static void testLogRecoverySequence() {
+    std::string dir = makeTempDir();
+    uint64_t replayed = 0;
+    uint64_t first = loggedSession(dir, 64, 5, replayed);
+    CHECK(replayed == 0);
+    CHECK(first == 6);
+    uint64_t second = loggedSession(dir, 64, 5, replayed);
+    CHECK(replayed == first);
+    CHECK(second == first + 6);
+    uint64_t third = loggedSession(dir, 1 << 20, 0, replayed);
+    CHECK(replayed == second);
+    CHECK(third == second + 1);
+    removeTree(dir);
+}
+
+// A torn record at the end of the newest segment is cut off and the room
+// carries on after the last good one.
+static void testLogRecoveryTornTail() {
+    std::string dir = makeTempDir();
+    uint64_t replayed = 0;
+    uint64_t first = loggedSession(dir, 1 << 20, 3, replayed);
+    std::string segment = newestSegment(dir);
+    off_t goodSize = fileSize(segment);
+    CHECK(!segment.empty() && goodSize > 0);
+    int fd = open(segment.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    const char torn[] = {0, 0, 0, 40, 1, 2, 3, 4, 'x'};
+    CHECK(write(fd, torn, sizeof(torn)) == static_cast<ssize_t>(sizeof(torn)));
+    close(fd);
+
+    {
+        LogStore store(dir, 1 << 20);
+        std::vector<SharedMessage> recovered;
+        CHECK(store.open("lobby").recover(HistoryLimits{2, 1 << 20}, recovered) == first + 1);
+        CHECK(recovered.size() == 2 && recovered.back()->sequence == first);
+    }
+    CHECK(fileSize(segment) == goodSize);
+
+    uint64_t second = loggedSession(dir, 1 << 20, 1, replayed);
+    CHECK(replayed == first);
+    CHECK(second == first + 2);
+    uint64_t third = loggedSession(dir, 1 << 20, 0, replayed);
+    CHECK(replayed == second);
+    CHECK(third == second + 1);
+    removeTree(dir);
+}
+
+// A record with a bad checksum in the middle of a segment is skipped on
+// recovery; the good records after it survive and nothing is truncated.
+static void testLogRecoveryCorruptRecord() {
+    std::string dir = makeTempDir();
+    uint64_t replayed = 0;
+    uint64_t first = loggedSession(dir, 1 << 20, 4, replayed);
+    std::string segment = newestSegment(dir);
+    off_t size = fileSize(segment);
+
+    // Walk to the third record and flip the last byte of its payload.
+    int fd = open(segment.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    off_t offset = 0;
+    for (int record = 0; record < 3; ++record) {
+        unsigned char header[RoomLog::RECORD_HEADER_SIZE];
+        CHECK(pread(fd, header, sizeof(header), offset) == static_cast<ssize_t>(sizeof(header)));
+        uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) | (uint32_t(header[2]) << 8) | header[3];
+        offset += static_cast<off_t>(RoomLog::RECORD_HEADER_SIZE + length);
+    }
+    char last;
+    CHECK(pread(fd, &last, 1, offset - 1) == 1);
+    last ^= 0x20;
+    CHECK(pwrite(fd, &last, 1, offset - 1) == 1);
+    close(fd);
+
+    LogStore store(dir, 1 << 20);
+    std::vector<SharedMessage> recovered;
+    CHECK(store.open("lobby").recover(HistoryLimits{100, 1 << 20}, recovered) == first + 1);
+    CHECK(recovered.size() == first - 1);
+    for (const SharedMessage& message : recovered) CHECK(message->sequence != 3);
+    CHECK(!recovered.empty() && recovered.back()->sequence == first);
+    CHECK(fileSize(segment) == size);
+    removeTree(dir);
+}
+
+// A write that fails part-way (here: over RLIMIT_FSIZE) is cut back out of
+// the segment and its records are written once the disk takes them.
+static void testLogWriteFailureRetry() {
+    std::string dir = makeTempDir();
+    void (*previous)(int) = signal(SIGXFSZ, SIG_IGN);
+    rlimit original;
+    getrlimit(RLIMIT_FSIZE, &original);
+    {
+        LogStore store(dir, 1 << 20);
+        RoomLog& log = store.open("lobby");
+        std::vector<SharedMessage> recovered;
+        log.recover(HistoryLimits{100, 1 << 20}, recovered);
+        auto append = [&](uint64_t from, uint64_t to) {
+            for (uint64_t sequence = from; sequence <= to; ++sequence) {
+                log.append(*makeMessage(FrameType::Chat, sequence, "entry " + std::to_string(sequence)));
+            }
+            store.commit();
+        };
+        auto waitFor = [](const std::atomic<unsigned long long>& counter) {
+            for (int i = 0; i < 5000 && counter == 0; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return counter != 0;
+        };
+        append(1, 5);
+        CHECK(waitFor(store.stats.commits));
+        off_t goodSize = fileSize(newestSegment(dir));
+
+        rlimit limited = original;
+        limited.rlim_cur = static_cast<rlim_t>(goodSize + 50);
+        setrlimit(RLIMIT_FSIZE, &limited);
+        append(6, 20);
+        CHECK(waitFor(store.stats.writeFailures));
+        CHECK(fileSize(newestSegment(dir)) == goodSize);
+        setrlimit(RLIMIT_FSIZE, &original);
+        append(21, 22);
+    }
+    setrlimit(RLIMIT_FSIZE, &original);
+    signal(SIGXFSZ, previous);
+
+    LogStore store(dir, 1 << 20);
+    std::vector<SharedMessage> recovered;
+    CHECK(store.open("lobby").recover(HistoryLimits{100, 1 << 20}, recovered) == 23);
+    CHECK(recovered.size() == 22);
+    for (size_t i = 0; i < recovered.size(); ++i) CHECK(recovered[i]->sequence == i + 1);
+    removeTree(dir);
+}
+
+// Only hex-named room directories are logs; anything else under the data
+// directory is skipped. An empty room name, which would be logged as the
+// undecodable "room-", is refused at the handshake.
+static void testLogStoreRooms() {
+    std::string dir = makeTempDir();
+    CHECK(mkdir((dir + LOBBY_DIR).c_str(), 0755) == 0);
+    CHECK(mkdir((dir + "/room-").c_str(), 0755) == 0);
+    CHECK(mkdir((dir + "/room-6c6").c_str(), 0755) == 0);
+    CHECK(mkdir((dir + "/room-zz").c_str(), 0755) == 0);
+    CHECK(mkdir((dir + "/lost+found").c_str(), 0755) == 0);
+    {
+        LogStore store(dir, 1 << 20);
+        std::vector<std::string> rooms = store.rooms();
+        CHECK(rooms.size() == 1 && rooms[0] == "lobby");
+        LoggedTransport transport(store);
+        CHECK(!transport.connect("bob:").valid());
+    }
+    removeTree(dir);
+}
+#endif
+
+// A client resuming from a sequence that has left the history ring is
+// told how much it missed, then gets everything retained; one resuming
+// inside the ring gets only what came after.
+static void testResumeGapNotice() {
+    MemoryTransport transport;
+    transport.core.history = HistoryLimits{5, 1 << 20};
+    SlotHandle alice = transport.connect("alice:lobby");
+    for (int i = 0; i < 20; ++i) transport.send(alice, FrameType::Chat, "message " + std::to_string(i));
+
+    SlotHandle bob = transport.connect("bob:lobby:3");
+    CHECK(bob.valid());
+    const std::vector<SharedMessage>& inbox = transport.client(bob)->inbox;
+    CHECK(inbox.size() == 7);
+    if (inbox.size() != 7) return;
+    CHECK(inbox[0]->type == FrameType::System);
+    uint64_t oldest = inbox[1]->sequence;
+    CHECK(inbox[0]->payload() == "[history gap: " + std::to_string(oldest - 4) + " messages are no longer available]");
+    for (size_t i = 1; i < 6; ++i) CHECK(inbox[i]->sequence == oldest + i - 1);
+
+    uint64_t seen = inbox[4]->sequence;
+    transport.disconnect(bob);
+    SlotHandle carol = transport.connect("carol:lobby:" + std::to_string(seen));
+    const std::vector<SharedMessage>& resumed = transport.client(carol)->inbox;
+    CHECK(!resumed.empty() && resumed[0]->sequence == seen + 1);
+    for (const SharedMessage& message : resumed) CHECK(!startsWith(message->payload(), "[history gap"));
+
+    // At the edge of the ring: resuming just before the oldest retained
+    // message loses nothing; one further back loses exactly one.
+    const MessageRing& ring = transport.core.rooms.at("lobby").messageHistory;
+    SlotHandle dave = transport.connect("dave:lobby:" + std::to_string(ring.oldestSequence() - 1));
+    CHECK(!transport.client(dave)->inbox.empty() && !startsWith(transport.client(dave)->inbox[0]->payload(), "[history gap"));
+    SlotHandle erin = transport.connect("erin:lobby:" + std::to_string(ring.oldestSequence() - 2));
+    CHECK(!transport.client(erin)->inbox.empty() &&
+          transport.client(erin)->inbox[0]->payload() == "[history gap: 1 messages are no longer available]");
+}
+
+// A handle goes stale when its entry is erased and stays stale after the
+// slot is reused: the reuse bumps the generation.
+static void testSlotMapGenerations() {
+    SlotMap<std::string> map;
+    CHECK(map.get(SlotHandle()) == nullptr);
+    SlotHandle a = map.insert();
+    SlotHandle b = map.insert();
+    *map.get(a) = "a";
+    *map.get(b) = "b";
+    map.erase(a);
+    CHECK(map.get(a) == nullptr);
+    CHECK(map.size() == 1);
+
+    SlotHandle c = map.insert();
+    CHECK(c.index == a.index && c != a);
+    *map.get(c) = "c";
+    CHECK(map.get(a) == nullptr);
+    map.erase(a);
+    CHECK(map.get(c) != nullptr && *map.get(c) == "c");
+    CHECK(map.size() == 2);
+    size_t visited = 0;
+    map.forEach([&visited](std::string&) { ++visited; });
+    CHECK(visited == 2);
+}
+
+// The username index follows connections in and out: a PM reaches a user
+// only while they are connected, including one who took a reused slot.
+static void testUsernameIndex() {
+    MemoryTransport transport;
+    SlotHandle alice = transport.connect("alice:lobby");
+    SlotHandle bob = transport.connect("bob:lobby");
+    CHECK(transport.core.findByUsername("bob") == transport.client(bob));
+    transport.disconnect(bob);
+    CHECK(transport.core.findByUsername("bob") == nullptr);
+
+    std::vector<SharedMessage>& inbox = transport.client(alice)->inbox;
+    inbox.clear();
+    transport.send(alice, FrameType::Private, "bob:still there?");
+    CHECK(inbox.size() == 1 && inbox[0]->payload() == "User bob not found.");
+
+    SlotHandle carol = transport.connect("carol:lobby");
+    CHECK(carol.index == bob.index && transport.client(bob) == nullptr);
+    CHECK(transport.core.findByUsername("carol") == transport.client(carol));
+}
+
+// Timers at every level, and past the wheel's span, fire once each, in
+// deadline order, on the first advance() whose tick reaches them, however
+// big the steps; nextDeadline() never overshoots a pending timer. A timer
+// scheduled from a callback fires too.
+static void testTimerWheelCascade() {
+    const uint64_t span = uint64_t(1) << TimerWheel<size_t>::SPAN_BITS;
+    std::vector<uint64_t> deadlines = {0, 1, 63, 64, 65, 200, 4095, 4096, 4097, 70000, 262143, 262144, 300000,
+                                       span - 1, span, span + 5, 2 * span + 17};
+    size_t scheduled = deadlines.size();
+    TimerWheel<size_t> wheel;
+    for (size_t i = deadlines.size(); i-- > 0;) wheel.schedule(deadlines[i], i);
+    CHECK(wheel.size() == deadlines.size());
+
+    struct Firing {
+        size_t timer;
+        // The advance() that fired it went from tick `from` to `to`.
+        uint64_t from;
+        uint64_t to;
+    };
+    std::vector<Firing> fired;
+    std::vector<bool> done(deadlines.size() + 1, false);
+    const uint64_t steps[] = {1, 7, 63, 64, 65, 4096, 100003, 1 << 20};
+    uint64_t from = 0;
+    uint64_t to = 0;
+    for (size_t i = 0; wheel.size() > 0 && to < 3 * span; ++i) {
+        uint64_t earliest = UINT64_MAX;
+        for (size_t k = 0; k < deadlines.size(); ++k) {
+            if (!done[k]) earliest = std::min(earliest, std::max(deadlines[k], to));
+        }
+        CHECK(wheel.nextDeadline() <= earliest);
+        wheel.advance(to, [&](size_t timer) {
+            fired.push_back(Firing{timer, from, to});
+            done[timer] = true;
+            if (timer == 5) {
+                deadlines.push_back(to + 500);
+                wheel.schedule(to + 500, deadlines.size() - 1);
+            }
+        });
+        from = to;
+        to += steps[i % (sizeof(steps) / sizeof(steps[0]))];
+    }
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.nextDeadline() == UINT64_MAX);
+    CHECK(deadlines.size() == scheduled + 1);
+    CHECK(fired.size() == deadlines.size());
+    uint64_t last = 0;
+    for (const Firing& f : fired) {
+        uint64_t deadline = deadlines[f.timer];
+        // The very first advance() covers tick 0 itself.
+        CHECK(deadline <= f.to && (deadline > f.from || f.to == 0));
+        CHECK(deadline >= last);
+        last = deadline;
+    }
+}
+
+// Timers are cancelled the way the server does it: the entry names a
+// slot-map handle and the owner's current deadline, and whatever no
+// longer matches when it fires is ignored.
+static void testTimerWheelCancel() {
+    SlotMap<uint64_t> owners;
+    TimerWheel<SlotHandle> wheel;
+    auto arm = [&](SlotHandle owner, uint64_t due) {
+        *owners.get(owner) = due;
+        wheel.schedule(due, owner);
+    };
+    SlotHandle a = owners.insert();
+    SlotHandle b = owners.insert();
+    SlotHandle c = owners.insert();
+    arm(a, 100);
+    arm(b, 100);
+    arm(c, 5000);
+    // Cancelled: a's slot goes away, and is reused by d.
+    owners.erase(a);
+    SlotHandle d = owners.insert();
+    arm(d, 120);
+    // Moved earlier; the entry at 100 is now stale.
+    arm(b, 50);
+
+    std::vector<std::pair<SlotHandle, uint64_t>> fired;
+    for (uint64_t now = 0; now <= 6000; now += 10) {
+        wheel.advance(now, [&](SlotHandle owner) {
+            uint64_t* due = owners.get(owner);
+            if (!due || *due > now) return;
+            *due = UINT64_MAX;
+            fired.emplace_back(owner, now);
+        });
+    }
+    CHECK(fired.size() == 3);
+    if (fired.size() != 3) return;
+    CHECK(fired[0].first == b && fired[0].second == 50);
+    CHECK(fired[1].first == d && fired[1].second == 120);
+    CHECK(fired[2].first == c && fired[2].second == 5000);
+    CHECK(wheel.size() == 0);
+}
+
+// Over the connection limit, a transport that cannot hold input sheds
+// and tells the sender once per burst.
+static void testRateLimitShed() {
+    MemoryTransport transport;
+    transport.core.limits.connection = RateLimit::perSecond(1, 2);
+    transport.core.limits.policy = FloodPolicy::Shed;
+    SlotHandle alice = transport.connect("alice:lobby");
+    SlotHandle bob = transport.connect("bob:lobby");
+    transport.client(alice)->inbox.clear();
+    transport.client(bob)->inbox.clear();
+
+    for (int i = 0; i < 5; ++i) transport.send(alice, FrameType::Chat, "flood");
+    CHECK(countType(transport.client(bob)->inbox, FrameType::Chat) == 2);
+    CHECK(transport.core.stats.shed == 3);
+    const std::vector<SharedMessage>& notices = transport.client(alice)->inbox;
+    CHECK(notices.size() == 1);
+    CHECK(!notices.empty() && notices[0]->payload() == "You are sending too fast; messages are being dropped.");
+}
+
+// Under Defer, a frame over the limit is held until both buckets have a
+// token; nothing is charged or delivered meanwhile.
+static void testRateLimitDefer() {
+    typedef ChatCore<MemoryConnection>::Clock Clock;
+    MemoryTransport transport;
+    transport.core.limits.connection = RateLimit::perSecond(10, 1);
+    transport.core.limits.room = RateLimit::perSecond(1, 2);
+    transport.core.limits.policy = FloodPolicy::Defer;
+    SlotHandle alice = transport.connect("alice:lobby");
+    MemoryConnection& conn = *transport.client(alice);
+    conn.inbox.clear();
+
+    Frame frame{FrameType::Chat, 0, "hello"};
+    Clock::time_point now = Clock::now();
+    Clock::time_point retryAt;
+    CHECK(transport.core.admit(conn, frame, now, true, retryAt) == Admission::Accepted);
+    CHECK(transport.core.admit(conn, frame, now, true, retryAt) == Admission::Deferred);
+    // The connection bucket refills in 100 ms; the room allows a burst of 2.
+    CHECK(retryAt > now && retryAt <= now + std::chrono::milliseconds(100));
+    CHECK(transport.core.admit(conn, frame, retryAt, true, retryAt) == Admission::Accepted);
+    Clock::time_point later = retryAt;
+    CHECK(transport.core.admit(conn, frame, later, true, retryAt) == Admission::Deferred);
+    // Now the room bucket is the one that is empty.
+    CHECK(retryAt - later > std::chrono::milliseconds(500));
+    CHECK(transport.core.admit(conn, frame, later, false, retryAt) == Admission::Shed);
+    CHECK(transport.core.stats.deferred == 2);
+    CHECK(transport.core.stats.shed == 1);
+    CHECK(conn.inbox.size() == 1);
+}
+
+// The search index forgets whatever the history ring evicts, by message
+// count and by bytes.
+static void testHistoryEvictionVsSearch() {
+    MemoryTransport transport;
+    transport.core.history = HistoryLimits{3, 1 << 20};
+    SlotHandle alice = transport.connect("alice:lobby");
+    SlotHandle bob = transport.connect("bob:lobby");
+    transport.send(alice, FrameType::Chat, "apple pie");
+    transport.send(alice, FrameType::Chat, "apple tart");
+    for (int i = 0; i < 5; ++i) transport.send(alice, FrameType::Chat, "banana " + std::to_string(i));
+
+    std::vector<SharedMessage>& inbox = transport.client(bob)->inbox;
+    inbox.clear();
+    transport.send(bob, FrameType::Search, "apple");
+    CHECK(inbox.size() == 1);
+    CHECK(!inbox.empty() && inbox[0]->payload() == "No messages in the history of lobby match \"apple\".");
+
+    inbox.clear();
+    transport.send(bob, FrameType::Search, "banana");
+    CHECK(inbox.size() == 4);
+    CHECK(!inbox.empty() && inbox[0]->payload() == "3 messages matching \"banana\":");
+    CHECK(countType(inbox, FrameType::Search) == 3);
+    CHECK(inbox.size() == 4 && inbox[3]->payload() == "alice: banana 4");
+
+    // The index itself no longer holds what was evicted.
+    const ChatRoom& lobby = transport.core.rooms.at("lobby");
+    std::vector<uint64_t> sequences;
+    lobby.searchIndex.search("apple", ChatCore<MemoryConnection>::SEARCH_RESULTS, sequences);
+    CHECK(sequences.empty());
+    lobby.searchIndex.search("banana", ChatCore<MemoryConnection>::SEARCH_RESULTS, sequences);
+    CHECK(sequences.size() == 3);
+    for (uint64_t sequence : sequences) CHECK(sequence >= lobby.messageHistory.oldestSequence());
+
+    MemoryTransport small;
+    small.core.history = HistoryLimits{100, 200};
+    SlotHandle carol = small.connect("carol:lobby");
+    small.send(carol, FrameType::Chat, "cherry " + std::string(150, 'x'));
+    small.send(carol, FrameType::Chat, "damson " + std::string(150, 'x'));
+    std::vector<SharedMessage>& results = small.client(carol)->inbox;
+    results.clear();
+    small.send(carol, FrameType::Search, "cherry");
+    CHECK(results.size() == 1 && countType(results, FrameType::Search) == 0);
+    results.clear();
+    small.send(carol, FrameType::Search, "damson");
+    CHECK(countType(results, FrameType::Search) == 1);
+}
+
+int main() {
+    run("memory transport", testMemoryTransport);
+    run("slow consumer policies", testSlowConsumerPolicies);
+    run("frame decoder partial", testFrameDecoderPartial);
+    run("frame decoder batched", testFrameDecoderBatched);
+    run("frame decoder legacy", testFrameDecoderLegacy);
+    run("frame decoder unread", testFrameDecoderUnread);
+#ifndef _WIN32
+    run("log recovery sequence", testLogRecoverySequence);
+    run("log recovery torn tail", testLogRecoveryTornTail);
+    run("log recovery corrupt record", testLogRecoveryCorruptRecord);
+    run("log write failure retry", testLogWriteFailureRetry);
+    run("log store rooms", testLogStoreRooms);
+#endif
+    run("resume gap notice", testResumeGapNotice);
+    run("slot map generations", testSlotMapGenerations);
+    run("username index", testUsernameIndex);
+    run("timer wheel cascade", testTimerWheelCascade);
+    run("timer wheel cancel", testTimerWheelCancel);
+    run("rate limit shed", testRateLimitShed);
+    run("rate limit defer", testRateLimitDefer);
+    run("history eviction vs search", testHistoryEvictionVsSearch);
+    std::cout << (failures == 0 ? "All tests passed.\n" : std::to_string(failures) + " failed.\n");
+    return failures;
+}
@@ -3,11 +3,13 @@
 #include <vector>
 #include <cstring>
 #include <chrono>
-#include <sstream>
-#include <iomanip>
+#include <string_view>
+#include <ctime>
 #include <algorithm>
 #include <unordered_map>
 
+#include "chat_protocol.h"
+
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -21,16 +23,24 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sys/select.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <signal.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
 #define closesocket close
+#define WSAGetLastError() errno
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CHAT_SSE2 1
 #endif
 
 // ANSI color codes
@@ -44,21 +54,292 @@
 #define ANSI_ITALIC "\033[3m"
 #define ANSI_UNDERLINE "\033[4m"
 
+// Index of the first '*' or '_' in `text` at or after `pos`, or its size.
+// Both start markup; everything before them is copied through as is.
+static size_t findMarkup(std::string_view text, size_t pos) {
+#ifdef CHAT_SSE2
+    const __m128i star = _mm_set1_epi8('*');
+    const __m128i underscore = _mm_set1_epi8('_');
+    for (; pos + 16 <= text.size(); pos += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, star), _mm_cmpeq_epi8(bytes, underscore))) != 0) break;
+    }
+#endif
+    for (; pos < text.size(); ++pos) {
+        if (text[pos] == '*' || text[pos] == '_') return pos;
+    }
+    return text.size();
+}
+
+// Bytes in [data, data + size) that start a UTF-8 character, i.e. that
+// are not continuation bytes (10xxxxxx).
+static size_t countCharacters(const char* data, size_t size) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef CHAT_SSE2
+    // As signed bytes, continuations are exactly those below 0xC0 (-64).
+    // Per-lane tallies go up to 255 before they are summed.
+    const __m128i limit = _mm_set1_epi8(-64);
+    while (size - i >= 16) {
+        size_t blocks = std::min<size_t>((size - i) / 16, 255);
+        __m128i tally = _mm_setzero_si128();
+        for (size_t block = 0; block < blocks; ++block, i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            tally = _mm_sub_epi8(tally, _mm_cmplt_epi8(bytes, limit));
+        }
+        __m128i sums = _mm_sad_epu8(tally, _mm_setzero_si128());
+        count += blocks * 16 - static_cast<size_t>(_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4));
+    }
+#endif
+    for (; i < size; ++i) {
+        count += (static_cast<unsigned char>(data[i]) & 0xC0) != 0x80;
+    }
+    return count;
+}
+
+// Terminal columns taken by `s`: escape sequences (up to their 'm') take
+// none and each UTF-8 character one.
+static size_t displayWidth(std::string_view s) {
+    size_t width = 0;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        const char* escape = static_cast<const char*>(std::memchr(s.data() + pos, '\033', s.size() - pos));
+        size_t end = escape ? static_cast<size_t>(escape - s.data()) : s.size();
+        width += countCharacters(s.data() + pos, end - pos);
+        if (!escape) break;
+        const char* last = static_cast<const char*>(std::memchr(escape, 'm', s.size() - end));
+        if (!last) break;
+        pos = static_cast<size_t>(last - s.data()) + 1;
+    }
+    return width;
+}
+
 // Message struct to track type and metadata
 struct Message {
-    enum class Type { Sent, Received, System, PrivateSent, PrivateReceived };
+    // A SearchResult's timestamp holds "#<sequence>" instead: the server
+    // only says where in the room's history the match is.
+    enum class Type { Sent, Received, System, PrivateSent, PrivateReceived, SearchResult };
     Type type;
     std::string content;
     std::string timestamp;
     std::string sender;
+    // How the message is drawn, built the first time it is shown: the
+    // ANSI line and its width in columns. `wraps` holds the byte offsets
+    // at which the line continues on a new row when `wrapWidth` columns
+    // wide; only a resize makes them stale.
+    std::string line;
+    size_t width = 0;
+    int wrapWidth = 0;
+    std::vector<uint32_t> wraps;
+
+    Message(Type t, std::string_view c, std::string ts, std::string_view s = std::string_view())
+        : type(t), content(c), timestamp(std::move(ts)), sender(s) {}
+};
+
+#ifndef _WIN32
+// Set by SIGWINCH; the client reads the new terminal size on its next pass.
+static volatile sig_atomic_t terminalResized = 0;
+
+static void onTerminalResized(int) {
+    terminalResized = 1;
+}
+#endif
+
+// The terminal as a grid of cells, double-buffered. Each frame is drawn
+// into the back buffer; present() compares it with the front buffer (what
+// the terminal shows) and sends only the cells that changed, as one write.
+class Screen {
+public:
+    int width() const { return columns; }
+    int height() const { return rows; }
+
+    // Sizes both buffers; the next present() clears the terminal, whose
+    // contents the resize has scrambled, and draws every cell.
+    void resize(int width, int height) {
+        columns = width;
+        rows = height;
+        back.assign(static_cast<size_t>(columns) * rows, Cell());
+        front = back;
+        cleared = false;
+    }
+
+    void clear() {
+        std::fill(back.begin(), back.end(), Cell());
+    }
+
+    // Draws `text` at `row`, from column `col` (both 1-based), taking its
+    // SGR escapes as styles and clipping it at the edges. A UTF-8
+    // character fills one cell and control characters show as spaces.
+    // Returns the style in effect after the text, for a line continued
+    // on the next row; `style` is the one it starts in.
+    uint8_t put(int row, int col, std::string_view text, uint8_t style = 0) {
+        Cell* line = row >= 1 && row <= rows ? &back[static_cast<size_t>(row - 1) * columns] : nullptr;
+        Cell* cell = nullptr;
+        size_t length = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c == '\033') {
+                i = applyEscape(text, i, style);
+            } else if ((c & 0xC0) == 0x80) {
+                if (cell && length < sizeof(cell->glyph)) cell->glyph[length++] = static_cast<char>(c);
+            } else if (!line || col < 1 || col > columns) {
+                cell = nullptr;
+                ++col;
+            } else {
+                cell = &line[col++ - 1];
+                *cell = Cell();
+                cell->glyph[0] = c < 0x20 || c == 0x7F ? ' ' : static_cast<char>(c);
+                cell->style = style;
+                length = 1;
+            }
+        }
+        return style;
+    }
+
+    // Sends the difference between the buffers, then makes the front
+    // buffer match. Writes nothing when no cell changed.
+    void present() {
+        frame.clear();
+        uint8_t style = UNKNOWN_STYLE;
+        if (!cleared) {
+            frame += "\033[0m\033[2J";
+            style = 0;
+            cleared = true;
+        }
+        for (int row = 0; row < rows; ++row) {
+            Cell* next = &back[static_cast<size_t>(row) * columns];
+            Cell* shown = &front[static_cast<size_t>(row) * columns];
+            int blankFrom = columns;
+            while (blankFrom > 0 && next[blankFrom - 1] == Cell()) --blankFrom;
+            int cursor = -1;
+            for (int col = 0; col < columns; ++col) {
+                if (next[col] == shown[col]) continue;
+                if (col >= blankFrom) {
+                    // The rest of the row is blank: erase it in one go.
+                    moveTo(row, col, cursor, next, style);
+                    if (style != 0) appendStyle(style = 0);
+                    frame += "\033[K";
+                    std::fill(shown + col, shown + columns, Cell());
+                    break;
+                }
+                moveTo(row, col, cursor, next, style);
+                appendCell(next[col], style);
+                shown[col] = next[col];
+                cursor = col + 1;
+            }
+        }
+        if (frame.empty()) return;
+        if (style != 0) frame += "\033[0m";
+        writeOut(frame);
+    }
+
+private:
+    static constexpr uint8_t BOLD = 0x10;
+    static constexpr uint8_t ITALIC = 0x20;
+    static constexpr uint8_t UNDERLINE = 0x40;
+    // Low four bits: 0 for the default colour, else the SGR colour - 29.
+    static constexpr uint8_t COLOR_MASK = 0x0F;
+    static constexpr uint8_t UNKNOWN_STYLE = 0xFF;
+
+    struct Cell {
+        char glyph[4] = {' ', 0, 0, 0};
+        uint8_t style = 0;
+
+        bool operator==(const Cell& other) const {
+            return style == other.style && std::memcmp(glyph, other.glyph, sizeof(glyph)) == 0;
+        }
+    };
+
+    int columns = 0;
+    int rows = 0;
+    std::vector<Cell> back;
+    std::vector<Cell> front;
+    bool cleared = false;
+    // Escape sequences of the frame being presented; keeps its capacity.
+    std::string frame;
+
+    // Applies the escape starting at text[start] to `style` and returns the
+    // index of its final byte. Only SGR (ending in 'm') changes the style.
+    static size_t applyEscape(std::string_view text, size_t start, uint8_t& style) {
+        size_t i = start + 1;
+        if (i >= text.size() || text[i] != '[') return std::min(i, text.size() - 1);
+        int parameter = 0;
+        for (++i; i < text.size(); ++i) {
+            char c = text[i];
+            if (c >= '0' && c <= '9') {
+                parameter = std::min(parameter * 10 + (c - '0'), 1000);
+                continue;
+            }
+            if (c != ';' && c != 'm' && (c < 0x40 || c > 0x7E)) continue;
+            if (c != ';' && c != 'm') return i;
+            if (parameter == 0) style = 0;
+            else if (parameter == 1) style |= BOLD;
+            else if (parameter == 3) style |= ITALIC;
+            else if (parameter == 4) style |= UNDERLINE;
+            else if (parameter >= 30 && parameter <= 37) style = static_cast<uint8_t>((style & ~COLOR_MASK) | (parameter - 29));
+            else if (parameter == 39) style &= ~COLOR_MASK;
+            parameter = 0;
+            if (c == 'm') return i;
+        }
+        return text.size() - 1;
+    }
+
+    void appendStyle(uint8_t style) {
+        frame += "\033[0";
+        if (style & BOLD) frame += ";1";
+        if (style & ITALIC) frame += ";3";
+        if (style & UNDERLINE) frame += ";4";
+        if (style & COLOR_MASK) {
+            frame += ";3";
+            frame += static_cast<char>('0' + (style & COLOR_MASK) - 1);
+        }
+        frame += 'm';
+    }
+
+    void appendCell(const Cell& cell, uint8_t& style) {
+        if (cell.style != style) appendStyle(style = cell.style);
+        frame.append(cell.glyph, strnlen(cell.glyph, sizeof(cell.glyph)));
+    }
+
+    // Brings the cursor, last left at column `cursor` of this row (-1 if
+    // elsewhere), to `col`. A short gap of unchanged cells is cheaper to
+    // write again than to jump over.
+    void moveTo(int row, int col, int cursor, const Cell* next, uint8_t& style) {
+        if (cursor == col) return;
+        if (cursor >= 0 && col > cursor && col - cursor <= 4) {
+            for (int skipped = cursor; skipped < col; ++skipped) appendCell(next[skipped], style);
+            return;
+        }
+        frame += "\033[";
+        frame += std::to_string(row + 1);
+        frame += ';';
+        frame += std::to_string(col + 1);
+        frame += 'H';
+    }
 
-    Message(Type t, const std::string& c, const std::string& ts, const std::string& s = "")
-        : type(t), content(c), timestamp(ts), sender(s) {}
+    static void writeOut(const std::string& data) {
+#ifdef _WIN32
+        std::cout.write(data.data(), static_cast<std::streamsize>(data.size()));
+        std::cout.flush();
+#else
+        std::cout.flush();
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t written = write(STDOUT_FILENO, data.data() + offset, data.size() - offset);
+            if (written > 0) {
+                offset += static_cast<size_t>(written);
+            } else if (written < 0 && errno != EINTR) {
+                return;
+            }
+        }
+#endif
+    }
 };
 
 class ChatClient {
 private:
     std::unordered_map<std::string, std::string> userColors;
+    std::string colorKey;
     std::vector<std::string> availableColors = {
         ANSI_CYAN, ANSI_YELLOW, ANSI_MAGENTA, ANSI_BLUE
     };
@@ -71,8 +352,29 @@ private:
     int terminalWidth;
     int terminalHeight;
     size_t scrollOffset;
-    size_t lastRenderedMessageCount;
-    std::string lastInput;
+    Screen screen;
+    // Set when something on screen changed; run() redraws at most once per
+    // FRAME_INTERVAL, so a burst of messages costs one frame, not one each.
+    bool dirty = true;
+    std::chrono::steady_clock::time_point nextFrameAt;
+    static constexpr std::chrono::milliseconds FRAME_INTERVAL{33};
+    FrameDecoder decoder;
+    // Outgoing frames are assembled here; it keeps its capacity, so
+    // sending does not allocate.
+    std::string outgoing;
+    uint64_t outgoingSequence = 0;
+    // A TCP address, or on POSIX systems the server's Unix socket.
+    sockaddr_storage serverAddr{};
+    socklen_t serverAddrLength = 0;
+    // Last room sequence received; sent in the Hello when reconnecting so
+    // the server only replays what we missed.
+    uint64_t lastSequence = 0;
+    // Set while a resumed join's replay is arriving (it ends with the
+    // member list); our own messages in it were already shown when sent.
+    bool replaying = false;
+    bool connecting = false;
+    int reconnectDelayMs = 0;
+    std::chrono::steady_clock::time_point reconnectAt;
 
     void showWelcomeAnimation() {
         std::cout << "\033[?25l";
@@ -160,175 +462,393 @@ private:
         std::cout << "\033[?25h";
     }
 
-    void sendToServer(const std::string& message) {
-        send(clientSocket, message.c_str(), static_cast<int>(message.length()), 0);
+    // The socket is non-blocking after the handshake, so keep writing until
+    // the whole frame is out instead of dropping a short write.
+    void sendToServer(std::string_view message) {
+        size_t offset = 0;
+        while (offset < message.length()) {
+            int sent = send(clientSocket, message.data() + offset, static_cast<int>(message.length() - offset), 0);
+            if (sent > 0) {
+                offset += sent;
+                continue;
+            }
+#ifdef _WIN32
+            bool wouldBlock = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+            bool wouldBlock = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+            if (!wouldBlock) return;
+            fd_set write_fds;
+            FD_ZERO(&write_fds);
+            FD_SET(clientSocket, &write_fds);
+            select(clientSocket + 1, nullptr, &write_fds, nullptr, nullptr);
+        }
+    }
+
+    // Sends a frame whose payload is the concatenation of `pieces`.
+    bool sendFrame(FrameType type, std::initializer_list<std::string_view> pieces) {
+        if (clientSocket == INVALID_SOCKET || connecting) {
+            messages.emplace_back(Message::Type::System, "Not connected: message not sent.", getTimestamp());
+            return false;
+        }
+        outgoing.clear();
+        appendFrame(outgoing, type, ++outgoingSequence, pieces);
+        sendToServer(outgoing);
+        return true;
+    }
+
+    bool setNonBlocking(SOCKET socket) {
+#ifdef _WIN32
+        u_long mode = 1;
+        return ioctlsocket(socket, FIONBIO, &mode) != SOCKET_ERROR;
+#else
+        int flags = fcntl(socket, F_GETFL, 0);
+        return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) >= 0;
+#endif
+    }
+
+    void connectionLost() {
+        closesocket(clientSocket);
+        clientSocket = INVALID_SOCKET;
+        connecting = false;
+        reconnectDelayMs = 250;
+        reconnectAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(reconnectDelayMs);
+        messages.emplace_back(Message::Type::System, "Connection lost. Reconnecting...", getTimestamp());
+    }
+
+    // Exponential backoff with jitter, so a room full of clients dropped
+    // by the same outage does not reconnect in lockstep.
+    void scheduleReconnect() {
+        if (clientSocket != INVALID_SOCKET) {
+            closesocket(clientSocket);
+            clientSocket = INVALID_SOCKET;
+        }
+        connecting = false;
+        reconnectDelayMs = std::min(reconnectDelayMs * 2, 8000);
+        int delay = reconnectDelayMs / 2 + rand() % (reconnectDelayMs / 2 + 1);
+        reconnectAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+    }
+
+    // Starts a non-blocking connect once the backoff has elapsed; run()
+    // finishes it when the socket turns writable.
+    void startReconnect() {
+        if (std::chrono::steady_clock::now() < reconnectAt) return;
+        clientSocket = socket(serverAddr.ss_family, SOCK_STREAM, 0);
+        if (clientSocket == INVALID_SOCKET || !setNonBlocking(clientSocket)) {
+            scheduleReconnect();
+            return;
+        }
+        if (connect(clientSocket, reinterpret_cast<sockaddr*>(&serverAddr), serverAddrLength) == SOCKET_ERROR) {
+#ifdef _WIN32
+            bool inProgress = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+            bool inProgress = errno == EINPROGRESS;
+#endif
+            if (!inProgress) {
+                scheduleReconnect();
+                return;
+            }
+        }
+        connecting = true;
+    }
+
+    void finishReconnect() {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(clientSocket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length) != 0 || error != 0) {
+            scheduleReconnect();
+            return;
+        }
+        connecting = false;
+        reconnectDelayMs = 0;
+        decoder = FrameDecoder();
+        replaying = lastSequence > 0;
+        std::string hello = username + ":" + room;
+        if (lastSequence > 0) hello += ":" + std::to_string(lastSequence);
+        sendFrame(FrameType::Hello, {hello});
+        messages.emplace_back(Message::Type::System, "Reconnected.", getTimestamp());
+    }
+
+    void assignColor(std::string_view sender) {
+        // Looked up through a reused key, as the map is keyed by std::string.
+        colorKey.assign(sender.data(), sender.size());
+        if (userColors.find(colorKey) == userColors.end() && colorKey != username) {
+            size_t colorIndex = std::hash<std::string_view>{}(sender) % availableColors.size();
+            userColors[colorKey] = availableColors[colorIndex];
+        }
+    }
+
+    // Parses views into the decoder's buffer; the only copies made are
+    // the strings the new Message keeps.
+    void handleFrame(const Frame& frame) {
+        // A search hit's sequence is an old message's, not our position.
+        if (frame.sequence > 0 && frame.type != FrameType::Search) lastSequence = frame.sequence;
+        if (frame.type == FrameType::MemberList) replaying = false;
+        std::string_view payload = frame.payload;
+        if (frame.type == FrameType::Ping) {
+            // The server's heartbeat; unanswered, it drops us as idle.
+            sendFrame(FrameType::Pong, {payload});
+        } else if (frame.type == FrameType::Pong) {
+            return;
+        } else if (frame.type == FrameType::Private) {
+            size_t senderEnd = payload.find(':');
+            if (senderEnd == std::string_view::npos) return;
+            std::string_view sender = payload.substr(0, senderEnd);
+            assignColor(sender);
+            messages.emplace_back(Message::Type::PrivateReceived, payload.substr(senderEnd + 1), getTimestamp(), sender);
+        } else if (frame.type == FrameType::Search) {
+            size_t senderEnd = payload.find(':');
+            if (senderEnd == std::string_view::npos) return;
+            std::string_view sender = payload.substr(0, senderEnd);
+            std::string_view content = payload.substr(senderEnd + 1);
+            if (!content.empty() && content[0] == ' ') content.remove_prefix(1);
+            assignColor(sender);
+            messages.emplace_back(Message::Type::SearchResult, content, "#" + std::to_string(frame.sequence), sender);
+        } else if (frame.type == FrameType::Chat) {
+            size_t senderEnd = payload.find(':');
+            if (senderEnd == std::string_view::npos) return;
+            std::string_view sender = payload.substr(0, senderEnd);
+            std::string_view content = payload.substr(senderEnd + 1);
+            if (!content.empty() && content[0] == ' ') content.remove_prefix(1);
+            assignColor(sender);
+            if (sender == username) {
+                if (replaying) return;
+                messages.emplace_back(Message::Type::Sent, content, getTimestamp(), sender);
+            } else {
+                messages.emplace_back(Message::Type::Received, content, getTimestamp(), sender);
+            }
+        } else {
+            messages.emplace_back(Message::Type::System, payload, getTimestamp());
+        }
     }
 
     std::string getTimestamp() {
         auto now = std::chrono::system_clock::now();
         std::time_t current_time = std::chrono::system_clock::to_time_t(now);
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&current_time), "%Y-%m-%d %H:%M:%S");
-        return ss.str();
+        char formatted[32];
+        size_t length = std::strftime(formatted, sizeof(formatted), "%Y-%m-%d %H:%M:%S", std::localtime(&current_time));
+        return std::string(formatted, length);
     }
 
     void getTerminalSize() {
 #ifdef _WIN32
         CONSOLE_SCREEN_BUFFER_INFO csbi;
-        GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-        terminalWidth = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-        terminalHeight = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+        if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
+            terminalWidth = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+            terminalHeight = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+        }
 #else
-        struct winsize w;
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-        terminalWidth = w.ws_col;
-        terminalHeight = w.ws_row;
+        struct winsize w{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
+            terminalWidth = w.ws_col;
+            terminalHeight = w.ws_row;
+        }
 #endif
         terminalWidth = std::max(80, terminalWidth);
         terminalHeight = std::max(24, terminalHeight);
     }
 
-    void moveCursor(int row, int col) {
-        std::cout << "\033[" << row << ";" << col << "H";
+    // Re-reads the terminal size, which POSIX systems only do after a
+    // SIGWINCH; Windows has no such signal, so it asks every loop pass.
+    void updateTerminalSize() {
+        getTerminalSize();
+        if (terminalWidth != screen.width() || terminalHeight != screen.height()) {
+            screen.resize(terminalWidth, terminalHeight);
+            dirty = true;
+        }
     }
 
-    void clearLine(int row) {
-        moveCursor(row, 1);
-        std::cout << "\033[K";
+    void moveCursor(int row, int col) {
+        std::cout << "\033[" << row << ";" << col << "H";
     }
 
-    std::string formatMessage(const std::string& content) {
-        std::string result;
+    // Appends `content` to `out` with its **bold**, *italic* and
+    // __underline__ spans turned into ANSI styles. Text between markup is
+    // found with a vector scan and copied in one piece.
+    static void formatMessage(std::string_view content, std::string& out) {
         size_t pos = 0;
-        while (pos < content.length()) {
-            if (pos + 1 < content.length() && content[pos] == '*' && content[pos + 1] == '*') {
+        while (pos < content.size()) {
+            size_t mark = findMarkup(content, pos);
+            out.append(content.data() + pos, mark - pos);
+            if (mark == content.size()) break;
+            pos = mark;
+            if (pos + 1 < content.size() && content[pos] == '*' && content[pos + 1] == '*') {
                 size_t end = content.find("**", pos + 2);
-                if (end != std::string::npos) {
-                    result += ANSI_BOLD + content.substr(pos + 2, end - pos - 2) + ANSI_RESET;
+                if (end != std::string_view::npos) {
+                    out += ANSI_BOLD;
+                    out.append(content.data() + pos + 2, end - pos - 2);
+                    out += ANSI_RESET;
                     pos = end + 2;
                     continue;
                 }
             } else if (content[pos] == '*') {
                 size_t end = content.find('*', pos + 1);
-                if (end != std::string::npos) {
-                    result += ANSI_ITALIC + content.substr(pos + 1, end - pos - 1) + ANSI_RESET;
+                if (end != std::string_view::npos) {
+                    out += ANSI_ITALIC;
+                    out.append(content.data() + pos + 1, end - pos - 1);
+                    out += ANSI_RESET;
                     pos = end + 1;
                     continue;
                 }
-            } else if (pos + 1 < content.length() && content[pos] == '_' && content[pos + 1] == '_') {
+            } else if (pos + 1 < content.size() && content[pos] == '_' && content[pos + 1] == '_') {
                 size_t end = content.find("__", pos + 2);
-                if (end != std::string::npos) {
-                    result += ANSI_UNDERLINE + content.substr(pos + 2, end - pos - 2) + ANSI_RESET;
+                if (end != std::string_view::npos) {
+                    out += ANSI_UNDERLINE;
+                    out.append(content.data() + pos + 2, end - pos - 2);
+                    out += ANSI_RESET;
                     pos = end + 2;
                     continue;
                 }
             }
-            result += content[pos];
+            out += content[pos];
             ++pos;
         }
-        return result;
     }
 
-    void render() {
-        getTerminalSize();
-        int messageAreaHeight = terminalHeight - 3;
-    
-        static int lastWidth = 0;
-        if (lastWidth != terminalWidth || lastRenderedMessageCount == 0) {
-            clearLine(1);
-            std::string header = "Room: " + room + " | User: " + username;
-            int headerPos = std::max(1, (terminalWidth - static_cast<int>(header.length())) / 2);
-            moveCursor(1, headerPos);
-            std::cout << ANSI_BLUE << ANSI_BOLD << header << ANSI_RESET;
-            lastWidth = terminalWidth;
-        }
-    
-        size_t maxMessages = std::min(static_cast<size_t>(messageAreaHeight), messages.size());
-        size_t startIdx;
-        if (scrollOffset == 0) {
-            startIdx = messages.size() >= maxMessages ? messages.size() - maxMessages : 0;
-        } else {
-            startIdx = messages.size() >= maxMessages 
-                ? std::max(static_cast<size_t>(0), messages.size() - maxMessages - scrollOffset)
-                : 0;
-        }
-    
-        for (int row = 2; row < terminalHeight - 1; ++row) {
-            clearLine(row);
-        }
-    
-        auto visibleLength = [](const std::string& s) {
-            size_t len = 0;
-            bool inEscape = false;
-            for (char c : s) {
-                if (c == '\033') {
-                    inEscape = true;
-                } else if (inEscape) {
-                    if (c == 'm') {
-                        inEscape = false;
-                    }
+    // Builds the message's line and width; the sender's colour is looked
+    // up here, once, not on every frame.
+    void renderLine(Message& msg) {
+        std::string_view content = msg.content;
+        if (!content.empty() && content.back() == '\n') {
+            content.remove_suffix(1);
+        }
+        std::string_view color = ANSI_RESET;
+        auto known = userColors.find(msg.sender);
+        if (known != userColors.end()) color = known->second;
+
+        std::string& line = msg.line;
+        line.reserve(msg.timestamp.size() + msg.sender.size() + content.size() + 32);
+        line += '[';
+        line += msg.timestamp;
+        line += "] ";
+        switch (msg.type) {
+        case Message::Type::Sent:
+            line += ANSI_GREEN "You: ";
+            break;
+        case Message::Type::Received:
+        case Message::Type::SearchResult:
+            line += color;
+            line += msg.sender;
+            line += ": ";
+            break;
+        case Message::Type::PrivateSent:
+            line += ANSI_GREEN "(PM to ";
+            line += msg.sender;
+            line += "): ";
+            break;
+        case Message::Type::PrivateReceived:
+            line += color;
+            line += "(PM from ";
+            line += msg.sender;
+            line += "): ";
+            break;
+        case Message::Type::System:
+            break;
+        }
+        formatMessage(content, line);
+        if (msg.type != Message::Type::System) line += ANSI_RESET;
+        msg.width = displayWidth(line);
+    }
+
+    // Finds where the message's line breaks to fit `columns`, after the
+    // last space on a row when there is one.
+    static void wrapLine(Message& msg, int columns) {
+        msg.wraps.clear();
+        msg.wrapWidth = columns;
+        size_t limit = static_cast<size_t>(columns);
+        if (msg.width <= limit) return;
+        const std::string& line = msg.line;
+        size_t rowStart = 0;
+        size_t used = 0;
+        size_t breakAt = 0;
+        size_t usedAtBreak = 0;
+        for (size_t i = 0; i < line.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(line[i]);
+            if (c == '\033') {
+                size_t last = line.find('m', i);
+                if (last == std::string::npos) break;
+                i = last;
+                continue;
+            }
+            if ((c & 0xC0) == 0x80) continue;
+            if (used == limit) {
+                if (breakAt > rowStart) {
+                    rowStart = breakAt;
+                    used -= usedAtBreak;
                 } else {
-                    len++;
+                    rowStart = i;
+                    used = 0;
                 }
+                msg.wraps.push_back(static_cast<uint32_t>(rowStart));
             }
-            return len;
-        };
-    
+            ++used;
+            if (c == ' ') {
+                breakAt = i + 1;
+                usedAtBreak = used;
+            }
+        }
+    }
+
+    // Draws the frame into the screen's back buffer and presents it; only
+    // the cells that differ from the last frame reach the terminal. Each
+    // message is formatted once, on first showing, and rewrapped only
+    // after a resize.
+    void render() {
+        int messageAreaHeight = terminalHeight - 3;
+        screen.clear();
+
+        std::string header = "Room: " + room + " | User: " + username;
+        int headerPos = std::max(1, (terminalWidth - static_cast<int>(header.length())) / 2);
+        screen.put(1, headerPos, ANSI_BLUE ANSI_BOLD + header);
+
+        // Scrolling stops at the oldest message.
+        size_t maxMessages = std::min(static_cast<size_t>(messageAreaHeight), messages.size());
+        scrollOffset = std::min(scrollOffset, messages.size() - maxMessages);
+
         int row = terminalHeight - 2;
-        for (size_t i = std::min(messages.size(), startIdx + maxMessages); i > startIdx && row >= 2; --i) {
-            const auto& msg = messages[i - 1];
-            std::string displayText;
-            std::string content = msg.content;
-            if (content.back() == '\n') {
-                content.pop_back();
+        for (size_t i = messages.size() - scrollOffset; i > 0 && row >= 2; --i) {
+            Message& msg = messages[i - 1];
+            if (msg.line.empty()) renderLine(msg);
+            // One column is kept free, as right-aligned lines always had.
+            if (msg.wrapWidth != terminalWidth - 1) wrapLine(msg, terminalWidth - 1);
+
+            int col = 1;
+            if (msg.wraps.empty()) {
+                int width = static_cast<int>(msg.width);
+                if (msg.type == Message::Type::Sent || msg.type == Message::Type::PrivateSent) {
+                    col = std::max(1, terminalWidth - width - 1);
+                } else if (msg.type == Message::Type::System) {
+                    col = std::max(1, (terminalWidth - width) / 2);
+                }
             }
-    
-            if (msg.type == Message::Type::Sent) {
-                displayText = "[" + msg.timestamp + "] " + ANSI_GREEN + "You: " + formatMessage(content) + ANSI_RESET;
-                int visibleLen = visibleLength(displayText);
-                int pos = std::max(1, terminalWidth - visibleLen - 1);
-                moveCursor(row, pos);
-                std::cout << displayText;
-            } else if (msg.type == Message::Type::Received) {
-                std::string userColor = userColors.find(msg.sender) != userColors.end() ? userColors[msg.sender] : ANSI_RESET;
-                displayText = "[" + msg.timestamp + "] " + userColor + msg.sender + ": " + formatMessage(content) + ANSI_RESET;
-                moveCursor(row, 1);
-                std::cout << displayText;
-            } else if (msg.type == Message::Type::PrivateSent) {
-                displayText = "[" + msg.timestamp + "] " + ANSI_GREEN + "(PM to " + msg.sender + "): " + formatMessage(content) + ANSI_RESET;
-                int visibleLen = visibleLength(displayText);
-                int pos = std::max(1, terminalWidth - visibleLen - 1);
-                moveCursor(row, pos);
-                std::cout << displayText;
-            } else if (msg.type == Message::Type::PrivateReceived) {
-                std::string userColor = userColors.find(msg.sender) != userColors.end() ? userColors[msg.sender] : ANSI_RESET;
-                displayText = "[" + msg.timestamp + "] " + userColor + "(PM from " + msg.sender + "): " + formatMessage(content) + ANSI_RESET;
-                moveCursor(row, 1);
-                std::cout << displayText;
-            } else { // System
-                displayText = "[" + msg.timestamp + "] " + formatMessage(content);
-                int visibleLen = visibleLength(displayText);
-                int pos = std::max(1, (terminalWidth - visibleLen) / 2);
-                moveCursor(row, pos);
-                std::cout << displayText;
+            // Rows above the message area are skipped, but still carry
+            // their style to the rows below.
+            int top = row - static_cast<int>(msg.wraps.size());
+            uint8_t style = 0;
+            size_t begin = 0;
+            for (size_t piece = 0; piece <= msg.wraps.size(); ++piece) {
+                size_t end = piece < msg.wraps.size() ? msg.wraps[piece] : msg.line.size();
+                int target = top + static_cast<int>(piece);
+                style = screen.put(target >= 2 ? target : 0, col, std::string_view(msg.line).substr(begin, end - begin), style);
+                begin = end;
             }
-            --row;
-        }
-    
-        if (currentInput != lastInput || lastRenderedMessageCount == 0) {
-            clearLine(terminalHeight);
-            moveCursor(terminalHeight, 1);
-            std::cout << ANSI_MAGENTA << "->: " << ANSI_RESET << currentInput;
-            lastInput = currentInput;
+            row = top - 1;
         }
-    
-        lastRenderedMessageCount = messages.size();
-        std::cout.flush();
+
+        // The prompt shows the end of an input too long for the line.
+        std::string_view input = currentInput;
+        size_t inputWidth = static_cast<size_t>(terminalWidth) - 5;
+        if (input.size() > inputWidth) input.remove_prefix(input.size() - inputWidth);
+        screen.put(terminalHeight, 1, ANSI_MAGENTA "->: " ANSI_RESET);
+        screen.put(terminalHeight, 5, input);
+
+        screen.present();
     }
 
 public:
-    ChatClient(const std::string& serverIP, int port, const std::string& user, const std::string& rm)
-    : username(user), room(rm), running(true), terminalWidth(80), terminalHeight(24), scrollOffset(0), lastRenderedMessageCount(0) {
+    // A port of 0 takes `server` as the path of the server's Unix socket.
+    ChatClient(const std::string& server, int port, const std::string& user, const std::string& rm)
+    : username(user), room(rm), running(true), terminalWidth(80), terminalHeight(24), scrollOffset(0) {
 #ifdef _WIN32
         HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
         DWORD dwMode = 0;
@@ -342,51 +862,54 @@ public:
         }
 #endif
 
-        clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (clientSocket == INVALID_SOCKET) {
-            throw std::runtime_error("Socket creation failed.");
+#ifndef _WIN32
+        if (port == 0) {
+            sockaddr_un& local = reinterpret_cast<sockaddr_un&>(serverAddr);
+            if (server.size() >= sizeof(local.sun_path)) {
+                throw std::runtime_error("Unix socket path too long: " + server);
+            }
+            local.sun_family = AF_UNIX;
+            memcpy(local.sun_path, server.c_str(), server.size() + 1);
+            serverAddrLength = sizeof(local);
+        } else
+#endif
+        {
+            sockaddr_in& remote = reinterpret_cast<sockaddr_in&>(serverAddr);
+            remote.sin_family = AF_INET;
+            remote.sin_port = htons(port);
+            remote.sin_addr.s_addr = inet_addr(server.c_str());
+            if (remote.sin_addr.s_addr == INADDR_NONE) {
+                throw std::runtime_error("Invalid IP address: " + server);
+            }
+            serverAddrLength = sizeof(remote);
         }
 
-        sockaddr_in serverAddr{};
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(port);
-        serverAddr.sin_addr.s_addr = inet_addr(serverIP.c_str());
-        if (serverAddr.sin_addr.s_addr == INADDR_NONE) {
-            closesocket(clientSocket);
-            throw std::runtime_error("Invalid IP address: " + serverIP);
+        clientSocket = socket(serverAddr.ss_family, SOCK_STREAM, 0);
+        if (clientSocket == INVALID_SOCKET) {
+            throw std::runtime_error("Socket creation failed.");
         }
 
-        if (connect(clientSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
+        if (connect(clientSocket, reinterpret_cast<sockaddr*>(&serverAddr), serverAddrLength) == SOCKET_ERROR) {
             std::string error = "Connection failed: ";
             error += errno ? strerror(errno) : std::to_string(WSAGetLastError());
             closesocket(clientSocket);
             throw std::runtime_error(error);
         }
 
-        std::string initMsg = username + ":" + room;
-        sendToServer(initMsg);
+        sendFrame(FrameType::Hello, {username, ":", room});
 
         showWelcomeAnimation();
 
-#ifdef _WIN32
-        u_long mode = 1;
-        if (ioctlsocket(clientSocket, FIONBIO, &mode) == SOCKET_ERROR) {
-            closesocket(clientSocket);
-            throw std::runtime_error("Failed to set non-blocking mode: " + std::to_string(WSAGetLastError()));
-        }
-#else
-        int flags = fcntl(clientSocket, F_GETFL, 0);
-        if (fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        if (!setNonBlocking(clientSocket)) {
             closesocket(clientSocket);
-            throw std::runtime_error("Failed to set non-blocking mode: " + std::string(strerror(errno)));
+            throw std::runtime_error("Failed to set non-blocking mode: " + (errno ? std::string(strerror(errno)) : std::to_string(WSAGetLastError())));
         }
-#endif
 
         std::cout << "\033[2J\033[H";
     }    
 
     ~ChatClient() {
-        closesocket(clientSocket);
+        if (clientSocket != INVALID_SOCKET) closesocket(clientSocket);
 #ifdef _WIN32
         WSACleanup();
 #endif
@@ -394,9 +917,10 @@ public:
 
     void run() {
         std::cout << "\033[?25l";
-        render();
+        updateTerminalSize();
 
         fd_set read_fds;
+        fd_set write_fds;
         struct timeval tv;
 
 #ifndef _WIN32
@@ -405,83 +929,97 @@ public:
         newt = oldt;
         newt.c_lflag &= ~(ICANON | ECHO);
         tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+
+        struct sigaction resize{};
+        resize.sa_handler = onTerminalResized;
+        sigemptyset(&resize.sa_mask);
+        sigaction(SIGWINCH, &resize, nullptr);
 #endif
 
         while (running) {
-            FD_ZERO(&read_fds);
-            FD_SET(clientSocket, &read_fds);
+            if (clientSocket == INVALID_SOCKET) startReconnect();
 
-            tv.tv_sec = 0;
-            tv.tv_usec = 100000;
-
-            int result = select(clientSocket + 1, &read_fds, nullptr, nullptr, &tv);
-            if (result == SOCKET_ERROR) {
-                std::cerr << "Select failed: " << (errno ? strerror(errno) : std::to_string(WSAGetLastError())) << "\n";
-                running = false;
-                break;
+#ifdef _WIN32
+            updateTerminalSize();
+#else
+            if (terminalResized) {
+                terminalResized = 0;
+                updateTerminalSize();
+            }
+#endif
+            auto now = std::chrono::steady_clock::now();
+            if (dirty && now >= nextFrameAt) {
+                render();
+                dirty = false;
+                nextFrameAt = now + FRAME_INTERVAL;
             }
 
-            if (result > 0 && FD_ISSET(clientSocket, &read_fds)) {
-                char buffer[1024];
-                memset(buffer, 0, sizeof(buffer));
-                int bytes = recv(clientSocket, buffer, sizeof(buffer), 0);
-                if (bytes <= 0) {
-                    messages.emplace_back(Message::Type::System, "Disconnected from server.", getTimestamp());
+            // With a frame held back, wake in time to draw it.
+            auto wait = std::chrono::microseconds(100000);
+            if (dirty) wait = std::min(wait, std::chrono::duration_cast<std::chrono::microseconds>(nextFrameAt - now));
+            tv.tv_sec = 0;
+            tv.tv_usec = static_cast<long>(wait.count());
+
+            int result = 0;
+            FD_ZERO(&read_fds);
+            FD_ZERO(&write_fds);
+#ifndef _WIN32
+            // Keystrokes wake the loop too, so the read below never blocks
+            // and the socket is serviced while the user is not typing.
+            FD_SET(STDIN_FILENO, &read_fds);
+#endif
+            if (clientSocket == INVALID_SOCKET) {
+                // Waiting out the reconnect backoff; keep the input responsive.
+#ifdef _WIN32
+                Sleep(100);
+#else
+                select(STDIN_FILENO + 1, &read_fds, nullptr, nullptr, &tv);
+#endif
+            } else {
+                FD_SET(clientSocket, connecting ? &write_fds : &read_fds);
+#ifdef _WIN32
+                int highest = 0;  // ignored by Winsock
+#else
+                int highest = std::max<int>(clientSocket, STDIN_FILENO);
+#endif
+                result = select(highest + 1, &read_fds, &write_fds, nullptr, &tv);
+#ifndef _WIN32
+                // SIGWINCH interrupts the wait; the next pass handles it.
+                if (result == SOCKET_ERROR && errno == EINTR) continue;
+#endif
+                if (result == SOCKET_ERROR) {
+                    std::cerr << "Select failed: " << (errno ? strerror(errno) : std::to_string(WSAGetLastError())) << "\n";
                     running = false;
-                    render();
                     break;
                 }
-                std::string received(buffer, bytes);
-                std::string sender = "";
-                std::string content = received;
-
-                // Handle private messages
-                if (received.find("[PM]") == 0) {
-                    size_t senderEnd = received.find(':', 4);
-                    if (senderEnd != std::string::npos) {
-                        sender = received.substr(4, senderEnd - 4);
-                        content = received.substr(senderEnd + 1);
-                        if (content.back() == '\n') content.pop_back();
-                        if (userColors.find(sender) == userColors.end()) {
-                            size_t colorIndex = std::hash<std::string>{}(sender) % availableColors.size();
-                            userColors[sender] = availableColors[colorIndex];
-                        }
-                        messages.emplace_back(Message::Type::PrivateReceived, content, getTimestamp(), sender);
-                    }
-                }
-                // Check for join/leave messages
-                else if (received.find(" joined ") != std::string::npos || received.find(" left ") != std::string::npos) {
-                    size_t colon_pos = received.find(':');
-                    if (colon_pos != std::string::npos) {
-                        sender = received.substr(0, colon_pos);
-                        if (userColors.find(sender) == userColors.end() && sender != username) {
-                            size_t colorIndex = std::hash<std::string>{}(sender) % availableColors.size();
-                            userColors[sender] = availableColors[colorIndex];
-                        }
-                    }
-                    messages.emplace_back(Message::Type::System, received, getTimestamp());
+            }
+
+            if (result > 0 && connecting && FD_ISSET(clientSocket, &write_fds)) {
+                finishReconnect();
+                dirty = true;
+            } else if (result > 0 && FD_ISSET(clientSocket, &read_fds)) {
+                // One recv may hold several frames or only part of one;
+                // the decoder reassembles them across reads.
+                char* buffer = decoder.prepare(4096);
+                int bytes = recv(clientSocket, buffer, static_cast<int>(decoder.capacity()), 0);
+                if (bytes <= 0) {
+                    connectionLost();
+                    dirty = true;
+                    continue;
                 }
-                // Handle regular messages
-                else if (received.find(':') != std::string::npos && 
-                         received.find("Members in room") == std::string::npos) {
-                    sender = received.substr(0, received.find(':'));
-                    content = received.substr(received.find(':') + 1);
-                    if (content.back() == '\n') content.pop_back();
-                    if (userColors.find(sender) == userColors.end() && sender != username) {
-                        size_t colorIndex = std::hash<std::string>{}(sender) % availableColors.size();
-                        userColors[sender] = availableColors[colorIndex];
-                    }
-                    if (sender == username) {
-                        messages.emplace_back(Message::Type::Sent, content, getTimestamp(), sender);
-                    } else {
-                        messages.emplace_back(Message::Type::Received, content, getTimestamp(), sender);
-                    }
+                decoder.commit(bytes);
+                Frame frame;
+                FrameDecoder::Status status;
+                while ((status = decoder.next(frame)) == FrameDecoder::Status::Frame) {
+                    handleFrame(frame);
                 }
-                else {
-                    messages.emplace_back(Message::Type::System, received, getTimestamp());
+                if (status == FrameDecoder::Status::Error) {
+                    messages.emplace_back(Message::Type::System, "Protocol error from server.", getTimestamp());
+                    running = false;
+                    break;
                 }
                 scrollOffset = 0;
-                render();
+                dirty = true;
             }
 
 #ifdef _WIN32
@@ -491,24 +1029,30 @@ public:
                     if (currentInput == "exit") {
                         running = false;
                     } else if (!currentInput.empty()) {
-                        if (currentInput[0] == '@') {
+                        if (currentInput.compare(0, 8, "/search ") == 0) {
+                            if (sendFrame(FrameType::Search, {std::string_view(currentInput).substr(8)})) {
+                                currentInput.clear();
+                            }
+                            scrollOffset = 0;
+                        } else if (currentInput[0] == '@') {
                             size_t firstSpace = currentInput.find(' ');
                             if (firstSpace != std::string::npos) {
-                                std::string targetUser = currentInput.substr(1, firstSpace - 1);
-                                std::string pmContent = currentInput.substr(firstSpace + 1);
+                                std::string_view input = currentInput;
+                                std::string_view targetUser = input.substr(1, firstSpace - 1);
+                                std::string_view pmContent = input.substr(firstSpace + 1);
                                 if (!pmContent.empty()) {
-                                    std::string message = "[PM]" + username + ":" + targetUser + ":" + pmContent + "\n";
-                                    sendToServer(message);
-                                    messages.emplace_back(Message::Type::PrivateSent, pmContent, getTimestamp(), targetUser);
-                                    currentInput.clear();
+                                    if (sendFrame(FrameType::Private, {targetUser, ":", pmContent})) {
+                                        messages.emplace_back(Message::Type::PrivateSent, pmContent, getTimestamp(), targetUser);
+                                        currentInput.clear();
+                                    }
                                     scrollOffset = 0;
                                 }
                             }
                         } else {
-                            std::string message = username + ": " + currentInput + "\n";
-                            sendToServer(message);
-                            messages.emplace_back(Message::Type::Sent, currentInput, getTimestamp());
-                            currentInput.clear();
+                            if (sendFrame(FrameType::Chat, {currentInput})) {
+                                messages.emplace_back(Message::Type::Sent, currentInput, getTimestamp());
+                                currentInput.clear();
+                            }
                             scrollOffset = 0;
                         }
                     }
@@ -531,33 +1075,39 @@ public:
                 } else if (ch >= 32 && ch <= 126) {
                     currentInput += ch;
                 }
-                render();
+                dirty = true;
             }
 #else
             char ch;
-            if (read(STDIN_FILENO, &ch, 1) > 0) {
+            if (FD_ISSET(STDIN_FILENO, &read_fds) && read(STDIN_FILENO, &ch, 1) > 0) {
                 if (ch == '\n') {
                     if (currentInput == "exit") {
                         running = false;
                     } else if (!currentInput.empty()) {
-                        if (currentInput[0] == '@') {
+                        if (currentInput.compare(0, 8, "/search ") == 0) {
+                            if (sendFrame(FrameType::Search, {std::string_view(currentInput).substr(8)})) {
+                                currentInput.clear();
+                            }
+                            scrollOffset = 0;
+                        } else if (currentInput[0] == '@') {
                             size_t firstSpace = currentInput.find(' ');
                             if (firstSpace != std::string::npos) {
-                                std::string targetUser = currentInput.substr(1, firstSpace - 1);
-                                std::string pmContent = currentInput.substr(firstSpace + 1);
+                                std::string_view input = currentInput;
+                                std::string_view targetUser = input.substr(1, firstSpace - 1);
+                                std::string_view pmContent = input.substr(firstSpace + 1);
                                 if (!pmContent.empty()) {
-                                    std::string message = "[PM]" + username + ":" + targetUser + ":" + pmContent + "\n";
-                                    sendToServer(message);
-                                    messages.emplace_back(Message::Type::PrivateSent, pmContent, getTimestamp(), targetUser);
-                                    currentInput.clear();
+                                    if (sendFrame(FrameType::Private, {targetUser, ":", pmContent})) {
+                                        messages.emplace_back(Message::Type::PrivateSent, pmContent, getTimestamp(), targetUser);
+                                        currentInput.clear();
+                                    }
                                     scrollOffset = 0;
                                 }
                             }
                         } else {
-                            std::string message = username + ": " + currentInput + "\n";
-                            sendToServer(message);
-                            messages.emplace_back(Message::Type::Sent, currentInput, getTimestamp());
-                            currentInput.clear();
+                            if (sendFrame(FrameType::Chat, {currentInput})) {
+                                messages.emplace_back(Message::Type::Sent, currentInput, getTimestamp());
+                                currentInput.clear();
+                            }
                             scrollOffset = 0;
                         }
                     }
@@ -575,7 +1125,7 @@ public:
                 } else if (ch >= 32 && ch <= 126) {
                     currentInput += ch;
                 }
-                render();
+                dirty = true;
             }
 #endif
         }
@@ -589,10 +1139,18 @@ public:
 };
 
 int main(int argc, char* argv[]) {
+#ifdef _WIN32
     if (argc != 4) {
         std::cerr << "Usage: client <IP Address> <Port> <Room>\n";
         return 1;
     }
+#else
+    if (argc != 4 && argc != 3) {
+        std::cerr << "Usage: client <IP Address> <Port> <Room>\n"
+                  << "       client <Unix socket path> <Room>\n";
+        return 1;
+    }
+#endif
 
 #ifdef _WIN32
     WSADATA wsa;
@@ -602,9 +1160,9 @@ int main(int argc, char* argv[]) {
     }
 #endif
 
-    std::string serverIP = argv[1];
-    int port = std::stoi(argv[2]);
-    std::string room = argv[3];
+    std::string server = argv[1];
+    int port = argc == 4 ? std::stoi(argv[2]) : 0;
+    std::string room = argv[argc - 1];
 
     std::string username;
     std::cout << "Enter your name: ";
@@ -615,7 +1173,7 @@ int main(int argc, char* argv[]) {
     }
 
     try {
-        ChatClient client(serverIP, port, username, room);
+        ChatClient client(server, port, username, room);
         client.run();
     } catch (const std::exception& e) {
         std::cerr << e.what() << "\n";
@@ -1,8 +1,29 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <array>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <type_traits>
+
+#include "chat_protocol.h"
+#include "chat_core.h"
+#include "chat_capture.h"
+#include "chat_timer.h"
+#include "chat_ring.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -10,100 +31,3578 @@
 #include <windows.h>
 #pragma comment(lib, "ws2_32.lib")
 #else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <sys/select.h>
-#include <errno.h>
-#define SOCKET int
-#define INVALID_SOCKET -1
-#define SOCKET_ERROR -1
-#define closesocket close
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#ifdef IORING_RECV_MULTISHOT
+#define CHAT_HAVE_IO_URING 1
+#endif
+#endif
+#define SOCKET int
+#define INVALID_SOCKET -1
+#define SOCKET_ERROR -1
+#define closesocket close
+#define WSAGetLastError() errno
+#endif
+
+static bool setNonBlocking(SOCKET socket, bool enabled = true) {
+#ifdef _WIN32
+    u_long mode = enabled ? 1 : 0;
+    return ioctlsocket(socket, FIONBIO, &mode) != SOCKET_ERROR;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0) return false;
+    flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(socket, F_SETFL, flags) >= 0;
+#endif
+}
+
+static bool socketWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static bool socketInterrupted() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEINTR;
+#else
+    return errno == EINTR;
+#endif
+}
+
+// Set from SIGINT/SIGTERM; every shard's event loop exits and buffered
+// room log records are committed before the process ends.
+static std::atomic<bool> shutdownRequested(false);
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+static const char* logLevelName(LogLevel level) {
+    switch (level) {
+    case LogLevel::Debug: return "DEBUG";
+    case LogLevel::Info: return "INFO";
+    case LogLevel::Warn: return "WARN";
+    case LogLevel::Error: return "ERROR";
+    }
+    return "?";
+}
+
+// Asynchronous logger. Event loops format a line straight into a slot of
+// a fixed ring (Vyukov's bounded queue: one CAS claims a slot, one store
+// publishes it) and a background thread writes the lines out in batches,
+// Debug/Info to stdout and Warn/Error to stderr. When the ring is full
+// the line is dropped and counted instead of waiting for the writer; the
+// count is reported once there is room again. Lines are truncated to
+// LINE_BYTES.
+class Logger {
+public:
+    static constexpr size_t CAPACITY = 8192;
+    static constexpr size_t LINE_BYTES = 256;
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        int64_t timeMs;
+        LogLevel level;
+        uint8_t shard;
+        bool truncated;
+        uint16_t length;
+        char text[LINE_BYTES];
+    };
+
+    Logger() : slots(new Slot[CAPACITY]) {
+        for (size_t i = 0; i < CAPACITY; ++i) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~Logger() {
+        stop();
+    }
+
+    void configure(LogLevel minimum, bool showShards) {
+        threshold = minimum;
+        shardField = showShards;
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= threshold;
+    }
+
+    void start() {
+        writer = std::thread(&Logger::writeLoop, this);
+    }
+
+    // Writes out everything logged so far and joins the writer.
+    void stop() {
+        if (!writer.joinable()) return;
+        stopping = true;
+        writer.join();
+    }
+
+    // Returns a slot to format into, or nullptr if the ring is full.
+    Slot* claim(LogLevel level, size_t& position) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (CAPACITY - 1)];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    position = pos;
+                    slot.timeMs = nowMs();
+                    slot.level = level;
+                    slot.shard = logShard;
+                    slot.truncated = false;
+                    slot.length = 0;
+                    return &slot;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(Slot* slot, size_t position) {
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    // Shard of the calling thread, shown on each line with --threads.
+    static thread_local uint8_t logShard;
+
+private:
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> enqueuePos{0};
+    size_t dequeuePos = 0;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> stopping{false};
+    LogLevel threshold = LogLevel::Info;
+    bool shardField = false;
+    std::thread writer;
+
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void appendPrefix(int64_t timeMs, LogLevel level, unsigned shard, std::string& out) const {
+        time_t seconds = static_cast<time_t>(timeMs / 1000);
+        tm parts;
+#ifdef _WIN32
+        gmtime_s(&parts, &seconds);
+#else
+        gmtime_r(&seconds, &parts);
+#endif
+        char prefix[64];
+        int length = snprintf(prefix, sizeof(prefix), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %-5s ", parts.tm_year + 1900,
+                              parts.tm_mon + 1, parts.tm_mday, parts.tm_hour, parts.tm_min, parts.tm_sec,
+                              static_cast<int>(timeMs % 1000), logLevelName(level));
+        out.append(prefix, static_cast<size_t>(length));
+        if (shardField) {
+            length = snprintf(prefix, sizeof(prefix), "shard=%u ", shard);
+            out.append(prefix, static_cast<size_t>(length));
+        }
+    }
+
+    void format(const Slot& slot, std::string& out) const {
+        appendPrefix(slot.timeMs, slot.level, slot.shard, out);
+        out.append(slot.text, slot.length);
+        if (slot.truncated) out += "...";
+        out += '\n';
+    }
+
+    // Moves every published line into the two batches; returns how many.
+    size_t drain(std::string& out, std::string& err) {
+        size_t count = 0;
+        while (true) {
+            Slot& slot = slots[dequeuePos & (CAPACITY - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) break;
+            format(slot, slot.level >= LogLevel::Warn ? err : out);
+            slot.sequence.store(dequeuePos + CAPACITY, std::memory_order_release);
+            ++dequeuePos;
+            ++count;
+        }
+        return count;
+    }
+
+    static void writeAll(FILE* stream, std::string& batch) {
+        if (batch.empty()) return;
+        fwrite(batch.data(), 1, batch.size(), stream);
+        fflush(stream);
+        batch.clear();
+    }
+
+    void writeLoop() {
+        std::string out, err;
+        while (true) {
+            bool finishing = stopping.load();
+            size_t count = drain(out, err);
+            uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+            if (lost > 0) {
+                appendPrefix(nowMs(), LogLevel::Warn, 0, err);
+                err += "Logger dropped " + std::to_string(lost) + " lines: ring full.\n";
+            }
+            writeAll(stdout, out);
+            writeAll(stderr, err);
+            if (count == 0) {
+                if (finishing) return;
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        }
+    }
+};
+
+thread_local uint8_t Logger::logShard = 0;
+
+static Logger logger;
+
+// Formats one log line in place in a claimed ring slot and publishes it
+// when destroyed; streams into a dropped line are no-ops.
+class LogLine {
+public:
+    explicit LogLine(LogLevel level) : slot(logger.claim(level, position)) {}
+
+    ~LogLine() {
+        if (slot) logger.publish(slot, position);
+    }
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    LogLine& operator<<(std::string_view text) {
+        if (!slot) return *this;
+        size_t room = Logger::LINE_BYTES - slot->length;
+        if (text.size() > room) {
+            text = text.substr(0, room);
+            slot->truncated = true;
+        }
+        std::memcpy(slot->text + slot->length, text.data(), text.size());
+        slot->length = static_cast<uint16_t>(slot->length + text.size());
+        return *this;
+    }
+
+    LogLine& operator<<(const char* text) { return *this << std::string_view(text); }
+    LogLine& operator<<(const std::string& text) { return *this << std::string_view(text); }
+    LogLine& operator<<(char c) { return *this << std::string_view(&c, 1); }
+
+    template <typename T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+    LogLine& operator<<(T value) {
+        char digits[32];
+        int length = std::is_floating_point<T>::value
+                         ? snprintf(digits, sizeof(digits), "%g", static_cast<double>(value))
+                         : std::is_signed<T>::value
+                               ? snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value))
+                               : snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(value));
+        return *this << std::string_view(digits, static_cast<size_t>(length));
+    }
+
+private:
+    size_t position = 0;
+    Logger::Slot* slot;
+};
+
+// Streams are only evaluated when the level is enabled:
+//   LOG(Info) << user << " connected.";
+#define LOG(level) if (!logger.enabled(LogLevel::level)) {} else LogLine(LogLevel::level)
+
+// Readiness notification for a single socket, as reported by a Poller.
+// Completion backends do the I/O themselves and report what they did.
+struct PollEvent {
+    enum class Kind { Ready, Accepted, Received, Sent };
+
+    SOCKET socket;
+    bool readable;
+    bool writable;
+    Kind kind = Kind::Ready;
+    // Accepted: the new connection on listener `socket`.
+    SOCKET accepted = INVALID_SOCKET;
+    // Received: the bytes read, valid until the next wait(); a result of 0
+    // means EOF or a receive error. Sent: bytes written, or -1 on error.
+    const char* data = nullptr;
+    long result = 0;
+};
+
+// One buffer of an asynchronous send. `owner` keeps the bytes alive until
+// the send completes, even if the connection is closed first.
+struct SendBuffer {
+    const char* data;
+    size_t length;
+    std::shared_ptr<const void> owner;
+};
+
+// Event engine behind ChatServer::run. Sockets are registered once and
+// must be non-blocking: callers drain a readable socket until it would
+// block, so both level- and edge-triggered backends behave the same.
+class Poller {
+public:
+    virtual ~Poller() {}
+    virtual const char* name() const = 0;
+    virtual bool add(SOCKET socket) = 0;
+    virtual void remove(SOCKET socket) = 0;
+    // Called when a socket's output queue starts or stops waiting for room
+    // in the kernel send buffer.
+    virtual void watchWritable(SOCKET socket, bool enabled) = 0;
+    // Called when the server stops or resumes reading a socket whose input
+    // it is holding back. Only level-triggered backends need to act, or
+    // they would report the socket readable on every wait.
+    virtual void watchReadable(SOCKET, bool) {}
+    // Blocks until at least one socket is ready; timeoutMs < 0 waits forever.
+    virtual int wait(std::vector<PollEvent>& events, int timeoutMs) = 0;
+    // True for backends that accept, receive and send on the caller's
+    // behalf (io_uring). They report Accepted/Received/Sent events instead
+    // of readiness, and output goes through submitSend() instead of writev.
+    virtual bool completesIo() const { return false; }
+    // Queues one gathered send; a Sent event reports how much was written.
+    virtual bool submitSend(SOCKET, const std::vector<SendBuffer>&) { return false; }
+};
+
+// Portable fallback. Rebuilds an fd_set per wait, so cost is O(sockets)
+// and the socket count is capped by FD_SETSIZE.
+class SelectPoller : public Poller {
+private:
+    std::vector<SOCKET> sockets;
+    std::vector<SOCKET> writeSockets;
+    std::vector<SOCKET> heldSockets;
+
+    static void erase(std::vector<SOCKET>& list, SOCKET socket) {
+        for (auto it = list.begin(); it != list.end(); ++it) {
+            if (*it == socket) {
+                *it = list.back();
+                list.pop_back();
+                break;
+            }
+        }
+    }
+
+public:
+    const char* name() const override { return "select"; }
+
+    bool add(SOCKET socket) override {
+#ifdef _WIN32
+        if (sockets.size() >= FD_SETSIZE) return false;
+#else
+        if (socket >= FD_SETSIZE) return false;
+#endif
+        sockets.push_back(socket);
+        return true;
+    }
+
+    void remove(SOCKET socket) override {
+        erase(sockets, socket);
+        erase(writeSockets, socket);
+        erase(heldSockets, socket);
+    }
+
+    void watchWritable(SOCKET socket, bool enabled) override {
+        erase(writeSockets, socket);
+        if (enabled) writeSockets.push_back(socket);
+    }
+
+    void watchReadable(SOCKET socket, bool enabled) override {
+        erase(heldSockets, socket);
+        if (!enabled) heldSockets.push_back(socket);
+    }
+
+    int wait(std::vector<PollEvent>& events, int timeoutMs) override {
+        events.clear();
+        fd_set read_fds;
+        fd_set write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        SOCKET max_fd = 0;
+        for (SOCKET s : sockets) {
+            FD_SET(s, &read_fds);
+            if (s > max_fd) max_fd = s;
+        }
+        for (SOCKET s : heldSockets) {
+            FD_CLR(s, &read_fds);
+        }
+        for (SOCKET s : writeSockets) {
+            FD_SET(s, &write_fds);
+        }
+
+        struct timeval tv;
+        struct timeval* timeout = nullptr;
+        if (timeoutMs >= 0) {
+            tv.tv_sec = timeoutMs / 1000;
+            tv.tv_usec = (timeoutMs % 1000) * 1000;
+            timeout = &tv;
+        }
+
+        int result = select(static_cast<int>(max_fd) + 1, &read_fds, &write_fds, nullptr, timeout);
+        if (result == SOCKET_ERROR) {
+            return socketInterrupted() ? 0 : -1;
+        }
+        for (SOCKET s : sockets) {
+            bool readable = FD_ISSET(s, &read_fds) != 0;
+            bool writable = FD_ISSET(s, &write_fds) != 0;
+            if (readable || writable) {
+                events.push_back({s, readable, writable});
+            }
+        }
+        return static_cast<int>(events.size());
+    }
+};
+
+#ifdef __linux__
+// Edge-triggered epoll backend: sockets are registered once and each wait
+// costs O(ready sockets), independent of how many idle connections exist.
+// EPOLLOUT is part of the registration, so the kernel reports writability
+// only after a send hit EAGAIN and watchWritable needs no syscall.
+class EpollPoller : public Poller {
+private:
+    int epollFd;
+    std::vector<epoll_event> ready;
+
+public:
+    EpollPoller() : epollFd(epoll_create1(EPOLL_CLOEXEC)), ready(256) {
+        if (epollFd < 0) {
+            throw std::runtime_error("epoll_create1 failed: " + std::string(strerror(errno)));
+        }
+    }
+
+    ~EpollPoller() override {
+        close(epollFd);
+    }
+
+    const char* name() const override { return "epoll"; }
+
+    bool add(SOCKET socket) override {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = socket;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &ev) == 0;
+    }
+
+    void remove(SOCKET socket) override {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+    }
+
+    void watchWritable(SOCKET, bool) override {}
+
+    int wait(std::vector<PollEvent>& events, int timeoutMs) override {
+        events.clear();
+        int n = epoll_wait(epollFd, ready.data(), static_cast<int>(ready.size()), timeoutMs);
+        if (n < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            const epoll_event& ev = ready[i];
+            bool readable = (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+            bool writable = (ev.events & EPOLLOUT) != 0;
+            events.push_back({ev.data.fd, readable, writable});
+        }
+        // Grow the batch when it fills up so bursts are drained in fewer waits.
+        if (n == static_cast<int>(ready.size())) {
+            ready.resize(ready.size() * 2);
+        }
+        return n;
+    }
+};
+
+#ifdef CHAT_HAVE_IO_URING
+// io_uring backend. A multishot accept stays armed on the listener and a
+// multishot recv on every connection, filling buffers from a provided
+// buffer group, and sends are SENDMSG submissions. Nothing enters
+// the kernel until the next wait(): everything queued while handling one
+// batch of events - a busy room's whole fan-out included - goes in with a
+// single io_uring_enter. Requires Linux 6.0 (multishot recv); older
+// kernels make the constructor throw and createPoller falls back to epoll.
+class UringPoller : public Poller {
+private:
+    enum Operation : uint64_t { OpAccept = 1, OpRecv = 2, OpSend = 3, OpCancel = 4, OpProvide = 5, OpPoll = 6 };
+
+    static constexpr unsigned RING_ENTRIES = 4096;
+    static constexpr unsigned BUFFER_COUNT = 4096;
+    static constexpr unsigned BUFFER_SIZE = 16384;
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    struct PendingSend {
+        msghdr message{};
+        std::vector<iovec> iov;
+        std::vector<std::shared_ptr<const void>> owners;
+    };
+
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned sqLocalTail = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    std::vector<char> bufferMemory;
+    // Buffers handed out by the last wait(), returned to the kernel by the next.
+    std::vector<uint16_t> lentBuffers;
+    // Recvs that ran out of buffers (by user_data), re-armed once some come back.
+    std::vector<uint64_t> starved;
+
+    // Per-fd generation, bumped by remove(), so completions for a closed
+    // socket are not mistaken for a new one that reuses its number.
+    std::vector<uint32_t> generations;
+    // The multishot request armed on each fd: accept, recv or poll.
+    std::vector<Operation> armed;
+    std::unordered_map<uint64_t, std::unique_ptr<PendingSend>> sends;
+
+    static std::string errorText(const char* what) {
+        return std::string(what) + " failed: " + strerror(errno);
+    }
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, arg, argSize));
+    }
+
+    uint32_t generation(int fd) {
+        if (static_cast<size_t>(fd) >= generations.size()) {
+            generations.resize(fd + 1, 0);
+            armed.resize(fd + 1, OpRecv);
+        }
+        return generations[fd];
+    }
+
+    uint64_t userData(Operation op, int fd) {
+        return (static_cast<uint64_t>(op) << 56) | (static_cast<uint64_t>(generation(fd) & 0xFFFFFF) << 32) |
+               static_cast<uint32_t>(fd);
+    }
+
+    unsigned unsubmitted() const {
+        return sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    io_uring_sqe* nextSqe() {
+        if (unsubmitted() == sqEntries) {
+            __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+            enter(unsubmitted(), 0, 0, nullptr, 0);
+        }
+        io_uring_sqe* sqe = &sqes[sqLocalTail & sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++sqLocalTail;
+        return sqe;
+    }
+
+    void armAccept(int fd) {
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = userData(OpAccept, fd);
+    }
+
+    // Readiness for fds that are not sockets, such as a shard's eventfd.
+    void armPoll(int fd) {
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = userData(OpPoll, fd);
+    }
+
+    void armRecv(int fd) {
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = userData(OpRecv, fd);
+    }
+
+    // Hands buffers [first, first + count) to the kernel's buffer group.
+    void provideBuffers(uint16_t first, unsigned count) {
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(bufferMemory.data() + static_cast<size_t>(first) * BUFFER_SIZE);
+        sqe->len = BUFFER_SIZE;
+        sqe->off = first;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = static_cast<uint64_t>(OpProvide) << 56;
+    }
+
+    // Returns last round's buffers in as few requests as possible: one
+    // PROVIDE_BUFFERS per run of consecutive ids.
+    void recycleBuffers() {
+        std::sort(lentBuffers.begin(), lentBuffers.end());
+        size_t start = 0;
+        for (size_t i = 1; i <= lentBuffers.size(); ++i) {
+            if (i == lentBuffers.size() || lentBuffers[i] != lentBuffers[i - 1] + 1) {
+                provideBuffers(lentBuffers[start], static_cast<unsigned>(i - start));
+                start = i;
+            }
+        }
+        lentBuffers.clear();
+        for (uint64_t data : starved) {
+            int fd = static_cast<int>(data & 0xFFFFFFFF);
+            if (data == userData(OpRecv, fd)) armRecv(fd);
+        }
+        starved.clear();
+    }
+
+    void handleCompletion(const io_uring_cqe& cqe, std::vector<PollEvent>& events) {
+        Operation op = static_cast<Operation>(cqe.user_data >> 56);
+        int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+        bool current = op != OpCancel && ((cqe.user_data >> 32) & 0xFFFFFF) == (generation(fd) & 0xFFFFFF);
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        PollEvent event{fd, false, false};
+
+        switch (op) {
+        case OpAccept:
+            if (!current) {
+                if (cqe.res >= 0) close(cqe.res);
+                return;
+            }
+            if (cqe.res >= 0) {
+                event.kind = PollEvent::Kind::Accepted;
+                event.accepted = cqe.res;
+                events.push_back(event);
+            }
+            if (!more) armAccept(fd);
+            return;
+        case OpRecv:
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                lentBuffers.push_back(id);
+                event.data = bufferMemory.data() + static_cast<size_t>(id) * BUFFER_SIZE;
+            }
+            if (!current || cqe.res == -ECANCELED) return;
+            if (cqe.res == -ENOBUFS) {
+                // Every buffer is lent out; re-arm once they come back.
+                starved.push_back(cqe.user_data);
+                return;
+            }
+            event.kind = PollEvent::Kind::Received;
+            event.result = cqe.res > 0 ? cqe.res : 0;
+            events.push_back(event);
+            if (cqe.res > 0 && !more) armRecv(fd);
+            return;
+        case OpSend:
+            sends.erase(cqe.user_data);
+            if (!current) return;
+            event.kind = PollEvent::Kind::Sent;
+            event.result = cqe.res >= 0 ? cqe.res : -1;
+            events.push_back(event);
+            return;
+        case OpPoll:
+            if (!current || cqe.res < 0) return;
+            event.readable = true;
+            events.push_back(event);
+            if (!more) armPoll(fd);
+            return;
+        case OpCancel:
+        case OpProvide:
+            return;
+        }
+    }
+
+    void release() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+public:
+    UringPoller() {
+        utsname info;
+        int major = 0;
+        int minor = 0;
+        if (uname(&info) != 0 || sscanf(info.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+            throw std::runtime_error("io_uring backend needs Linux 6.0 or newer");
+        }
+
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+        params.cq_entries = RING_ENTRIES * 4;
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+        if (ringFd < 0) throw std::runtime_error(errorText("io_uring_setup"));
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+            release();
+            throw std::runtime_error("io_uring lacks required features");
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = sqRing;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            std::string error = errorText("io_uring mmap");
+            release();
+            throw std::runtime_error(error);
+        }
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        unsigned* sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; ++i) sqArray[i] = i;
+        sqLocalTail = *sqTail;
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        bufferMemory.resize(static_cast<size_t>(BUFFER_COUNT) * BUFFER_SIZE);
+        provideBuffers(0, BUFFER_COUNT);
+    }
+
+    ~UringPoller() override {
+        release();
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    bool completesIo() const override { return true; }
+
+    bool add(SOCKET socket) override {
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+        generation(socket);
+        if (getsockopt(socket, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) != 0) {
+            armed[socket] = OpPoll;
+            armPoll(socket);
+        } else if (listening) {
+            armed[socket] = OpAccept;
+            armAccept(socket);
+        } else {
+            armed[socket] = OpRecv;
+            armRecv(socket);
+        }
+        return true;
+    }
+
+    // Cancels the socket's multishot request. Completions already on their
+    // way are dropped by the generation check.
+    void remove(SOCKET socket) override {
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = userData(armed[socket], socket);
+        sqe->user_data = static_cast<uint64_t>(OpCancel) << 56;
+        ++generations[socket];
+    }
+
+    void watchWritable(SOCKET, bool) override {}
+
+    bool submitSend(SOCKET socket, const std::vector<SendBuffer>& buffers) override {
+        std::unique_ptr<PendingSend> send(new PendingSend());
+        send->iov.reserve(buffers.size());
+        send->owners.reserve(buffers.size());
+        for (const auto& buffer : buffers) {
+            send->iov.push_back({const_cast<char*>(buffer.data), buffer.length});
+            send->owners.push_back(buffer.owner);
+        }
+        send->message.msg_iov = send->iov.data();
+        send->message.msg_iovlen = send->iov.size();
+
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = socket;
+        sqe->addr = reinterpret_cast<uint64_t>(&send->message);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData(OpSend, socket);
+        sends[sqe->user_data] = std::move(send);
+        return true;
+    }
+
+    int wait(std::vector<PollEvent>& events, int timeoutMs) override {
+        events.clear();
+        recycleBuffers();
+
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        bool ready = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) != *cqHead;
+        unsigned minComplete = ready || timeoutMs == 0 ? 0 : 1;
+        int result;
+        if (timeoutMs > 0) {
+            __kernel_timespec timeout{};
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+            io_uring_getevents_arg arg{};
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+            result = enter(unsubmitted(), minComplete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        } else {
+            result = enter(unsubmitted(), minComplete, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+        if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+            return -1;
+        }
+
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            handleCompletion(cqes[head & cqMask], events);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return static_cast<int>(events.size());
+    }
+};
+#endif
+#endif
+
+static std::unique_ptr<Poller> createPoller(const std::string& backend) {
+    if (backend != "select" && backend != "epoll" && backend != "io_uring") {
+        throw std::runtime_error("Unknown event backend: " + backend);
+    }
+#ifdef CHAT_HAVE_IO_URING
+    if (backend == "io_uring") {
+        try {
+            return std::unique_ptr<Poller>(new UringPoller());
+        } catch (const std::exception& e) {
+            LOG(Warn) << e.what() << ", falling back to epoll.";
+        }
+    }
+#endif
+#ifdef __linux__
+    if (backend != "select") {
+        try {
+            return std::unique_ptr<Poller>(new EpollPoller());
+        } catch (const std::exception& e) {
+            LOG(Warn) << e.what() << ", falling back to select.";
+        }
+    }
+#endif
+    return std::unique_ptr<Poller>(new SelectPoller());
+}
+
+// Lock-free multi-producer, single-consumer queue (Vyukov's linked list
+// with a stub node). push() is one atomic exchange and is safe from
+// any thread; pop() is only called by the owning thread. A push that is
+// still linking its node may be missed by a concurrent pop(); the
+// producer's wakeup that follows makes the consumer look again.
+template <typename T>
+class Mailbox {
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+    std::atomic<Node*> head;
+    Node* tail;
+
+public:
+    Mailbox() : head(new Node()), tail(head.load()) {}
+
+    ~Mailbox() {
+        while (tail) {
+            Node* next = tail->next.load();
+            delete tail;
+            tail = next;
+        }
+    }
+
+    void push(T value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T& out) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+enum class SlowConsumerPolicy { DropOldest, Coalesce, Disconnect };
+
+// How many times each slow-consumer policy has fired since startup.
+struct SlowConsumerStats {
+    unsigned long long droppedMessages = 0;
+    unsigned long long droppedBytes = 0;
+    unsigned long long coalescedMessages = 0;
+    unsigned long long disconnects = 0;
+};
+
+// Per-shard counters. Only the shard's own event loop touches them, so
+// counting is a plain increment; the admin thread gets a copy through
+// the shard's mailbox. Routing counters live in the core's CoreStats.
+struct ServerStats {
+    uint64_t connectionsAccepted = 0;
+    uint64_t connectionsClosed = 0;
+    uint64_t messagesOut = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    // writev/WSASend calls and io_uring sends to clients.
+    uint64_t writeCalls = 0;
+    // Time spent handling one poller wait's worth of events.
+    Histogram loopIterationNs;
+};
+
+// FIFO on a power-of-two ring that keeps its capacity when it drains.
+// std::deque frees and reallocates a block every few dozen entries, which
+// would put an allocation back on the send path of every connection.
+template <typename T>
+class RingQueue {
+public:
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    T& operator[](size_t index) { return slots[(head + index) & (slots.size() - 1)]; }
+    const T& operator[](size_t index) const { return slots[(head + index) & (slots.size() - 1)]; }
+    T& front() { return (*this)[0]; }
+    T& back() { return (*this)[count - 1]; }
+
+    void push_back(T value) {
+        if (count == slots.size()) grow();
+        (*this)[count] = std::move(value);
+        ++count;
+    }
+
+    void pop_front() {
+        front() = T();
+        head = (head + 1) & (slots.size() - 1);
+        --count;
+    }
+
+    void pop_back() {
+        back() = T();
+        --count;
+    }
+
+    // Removes `n` entries starting at position `first`; the `first`
+    // entries before them move up to close the gap.
+    void erase(size_t first, size_t n) {
+        if (n == 0) return;
+        for (size_t i = first; i-- > 0;) (*this)[i + n] = std::move((*this)[i]);
+        for (size_t i = 0; i < n; ++i) (*this)[i] = T();
+        head = (head + n) & (slots.size() - 1);
+        count -= n;
+    }
+
+private:
+    std::vector<T> slots;
+    size_t head = 0;
+    size_t count = 0;
+
+    void grow() {
+        std::vector<T> larger(std::max<size_t>(8, slots.size() * 2));
+        for (size_t i = 0; i < count; ++i) larger[i] = std::move((*this)[i]);
+        slots.swap(larger);
+        head = 0;
+    }
+};
+
+#ifdef __linux__
+// Holds TCP_CORK on a socket while in scope, so a run of writes leaves as
+// full segments rather than ending each one with a short packet.
+class SocketCork {
+public:
+    SocketCork(SOCKET s, bool enable) : socket(s), active(enable) {
+        if (active) set(1);
+    }
+    ~SocketCork() {
+        if (active) set(0);
+    }
+
+private:
+    SOCKET socket;
+    bool active;
+
+    void set(int value) { setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)); }
+};
+#endif
+
+// Messages waiting to be written to one client, held by reference. They
+// are kept whole so a policy can discard them without splitting a frame;
+// headOffset tracks how much of the front one the kernel has accepted.
+class OutputQueue {
+public:
+    struct Entry {
+        SharedMessage message;
+        bool notice;
+    };
+
+    RingQueue<Entry> pending;
+    size_t headOffset = 0;
+    size_t queuedBytes = 0;
+    size_t skipped = 0;
+    // Messages at the front referenced by an asynchronous send in flight.
+    size_t inFlight = 0;
+    bool framed = false;
+    bool waitingWritable = false;
+    bool closing = false;
+    // On the shard's list of queues to write at the end of the loop
+    // iteration.
+    bool flushScheduled = false;
+
+    bool empty() const { return pending.empty(); }
+
+    std::string_view data(const Entry& entry) const {
+        return entry.message->wire(framed);
+    }
+
+    void push(const SharedMessage& message) {
+        pending.push_back({message, false});
+        queuedBytes += data(pending.back()).size();
+    }
+
+    // Messages that a policy may not discard: a partially written head, or
+    // everything an asynchronous send is still reading.
+    size_t pinned() const {
+        return std::max(inFlight, static_cast<size_t>(headOffset > 0 ? 1 : 0));
+    }
+
+    // Discards whole messages from the front until at least `bytes` are
+    // freed. Pinned messages are never touched.
+    size_t dropOldest(size_t bytes, size_t& droppedBytes) {
+        size_t first = pinned();
+        size_t dropped = 0;
+        droppedBytes = 0;
+        while (first + dropped < pending.size() && droppedBytes < bytes) {
+            size_t size = data(pending[first + dropped]).size();
+            droppedBytes += size;
+            queuedBytes -= size;
+            ++dropped;
+        }
+        pending.erase(first, dropped);
+        return dropped;
+    }
+
+    // Replaces every unsent message with a single notice saying how many
+    // were skipped since the queue last drained.
+    size_t coalesce() {
+        size_t first = pinned();
+        size_t folded = 0;
+        while (pending.size() > first) {
+            const Entry& entry = pending.back();
+            if (!entry.notice) ++folded;
+            queuedBytes -= data(entry).size();
+            pending.pop_back();
+        }
+        skipped += folded;
+        pending.push_back({makeMessage(FrameType::System, 0, "[" + std::to_string(skipped) + " messages skipped: connection too slow]"), true});
+        queuedBytes += data(pending.back()).size();
+        return folded;
+    }
+
+    // Writes as much as the socket accepts, gathering up to 1024 messages
+    // (Linux's IOV_MAX) per syscall; `writes` counts the syscalls. Returns
+    // false on a fatal socket error.
+    bool flush(SOCKET socket, uint64_t& writes) {
+        const size_t maxBatch = 1024;
+#ifdef __linux__
+        SocketCork cork(socket, pending.size() > maxBatch);
+#endif
+        while (!pending.empty()) {
+#ifdef _WIN32
+            WSABUF buffers[maxBatch];
+#else
+            struct iovec buffers[maxBatch];
+#endif
+            size_t count = 0;
+            for (; count < pending.size() && count < maxBatch; ++count) {
+                size_t offset = count == 0 ? headOffset : 0;
+                std::string_view bytes = data(pending[count]);
+#ifdef _WIN32
+                buffers[count].buf = const_cast<char*>(bytes.data() + offset);
+                buffers[count].len = static_cast<ULONG>(bytes.size() - offset);
+#else
+                buffers[count].iov_base = const_cast<char*>(bytes.data() + offset);
+                buffers[count].iov_len = bytes.size() - offset;
+#endif
+            }
+
+#ifdef _WIN32
+            DWORD sent = 0;
+            ++writes;
+            int result = WSASend(socket, buffers, static_cast<DWORD>(count), &sent, 0, nullptr, nullptr);
+            if (result == SOCKET_ERROR) {
+                return socketWouldBlock();
+            }
+            size_t written = sent;
+#else
+            ++writes;
+            ssize_t result = writev(socket, buffers, static_cast<int>(count));
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                return socketWouldBlock();
+            }
+            size_t written = static_cast<size_t>(result);
+#endif
+            consume(written);
+        }
+        return true;
+    }
+
+#ifdef __linux__
+    // Copies as much as the ring has room for, gathered like the writev
+    // above. Returns false if the client corrupted the ring.
+    bool flush(SharedRing& ring) {
+        const size_t maxBatch = 1024;
+        while (!pending.empty()) {
+            struct iovec buffers[maxBatch];
+            size_t count = 0;
+            size_t length = 0;
+            for (; count < pending.size() && count < maxBatch; ++count) {
+                size_t offset = count == 0 ? headOffset : 0;
+                std::string_view bytes = data(pending[count]);
+                buffers[count].iov_base = const_cast<char*>(bytes.data() + offset);
+                buffers[count].iov_len = bytes.size() - offset;
+                length += buffers[count].iov_len;
+            }
+            long written = ring.writev(buffers, count);
+            if (written < 0) return false;
+            consume(static_cast<size_t>(written));
+            if (static_cast<size_t>(written) < length) break;
+        }
+        return true;
+    }
+#endif
+
+    // Describes up to maxBatch queued messages for Poller::submitSend and
+    // pins them until complete() is called.
+    void gather(std::vector<SendBuffer>& buffers, size_t maxBatch) {
+        buffers.clear();
+        for (size_t i = 0; i < pending.size() && buffers.size() < maxBatch; ++i) {
+            size_t offset = buffers.empty() ? headOffset : 0;
+            std::string_view bytes = data(pending[i]);
+            buffers.push_back({bytes.data() + offset, bytes.size() - offset, pending[i].message});
+        }
+        inFlight = buffers.size();
+    }
+
+    void complete(size_t written) {
+        inFlight = 0;
+        consume(written);
+    }
+
+private:
+    void consume(size_t written) {
+        queuedBytes -= written;
+        while (written > 0) {
+            size_t remaining = data(pending.front()).size() - headOffset;
+            if (written < remaining) {
+                headOffset += written;
+                break;
+            }
+            written -= remaining;
+            headOffset = 0;
+            pending.pop_front();
+        }
+        if (pending.empty()) skipped = 0;
+    }
+};
+
+// Cumulative room log counters, reported periodically and at startup.
+struct LogStats {
+    unsigned long long records = 0;
+    unsigned long long payloadBytes = 0;
+    // Counted by the syncer thread.
+    std::atomic<unsigned long long> bytesWritten{0};
+    std::atomic<unsigned long long> commits{0};
+    std::atomic<unsigned long long> writeFailures{0};
+    unsigned long long recoveredRooms = 0;
+    unsigned long long recoveredMessages = 0;
+    unsigned long long bytesMapped = 0;
+    double recoveryMs = 0;
+
+    // Bytes that reached the log per byte of chat payload.
+    double writeAmplification() const {
+        return payloadBytes ? static_cast<double>(bytesWritten.load()) / payloadBytes : 0.0;
+    }
+};
+
+static uint32_t crc32(const char* data, size_t length) {
+    // Shards append concurrently; a function-local static is initialized
+    // exactly once, race-free.
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> entries{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+#ifndef _WIN32
+// Append-only log of one room's messages, split into segments named after
+// the first sequence number they hold. Each record is
+//
+//   length(4) crc32(4) frame(length)
+//
+// where frame is the message's encoded ChatMessage::frame, so recovery
+// reuses the wire decoder. Appends are buffered; LogStore::commit hands
+// the buffers to its syncer thread, which issues one write and one
+// fdatasync per room, so the event loop never waits on the disk.
+class RoomLog : public MessageJournal {
+public:
+    static const size_t RECORD_HEADER_SIZE = 8;
+
+    RoomLog(const std::string& dir, size_t segmentLimit, LogStats& s, std::vector<RoomLog*>& dirty)
+        : directory(dir), segmentBytes(segmentLimit), stats(s), dirtyLogs(dirty) {}
+
+    // LogStore has committed and stopped its syncer by now; anything still
+    // here is what a failing disk never took.
+    ~RoomLog() {
+        if (!unsynced.empty()) {
+            LOG(Error) << "Room log records in " << directory << " were lost: the last write failed.";
+        }
+        for (SyncBuffer& buffer : unsynced) {
+            if (buffer.closeAfter) close(buffer.fd);
+        }
+        if (fd >= 0) close(fd);
+    }
+
+    void append(const ChatMessage& message) {
+        if (disabled) return;
+        if (fd < 0 || segmentSize >= segmentBytes) {
+            rollSegment(message.sequence);
+        }
+        if (!awaitingCommit) {
+            awaitingCommit = true;
+            dirtyLogs.push_back(this);
+        }
+        char header[RECORD_HEADER_SIZE];
+        uint32_t length = static_cast<uint32_t>(message.frame.size());
+        uint32_t crc = crc32(message.frame.data(), message.frame.size());
+        for (int i = 0; i < 4; ++i) {
+            header[i] = static_cast<char>((length >> (24 - 8 * i)) & 0xFF);
+            header[4 + i] = static_cast<char>((crc >> (24 - 8 * i)) & 0xFF);
+        }
+        pending.append(header, RECORD_HEADER_SIZE);
+        pending.append(message.frame.data(), message.frame.size());
+        segmentSize += RECORD_HEADER_SIZE + message.frame.size();
+        ++stats.records;
+        stats.payloadBytes += message.payload().size();
+    }
+
+    // Records handed from the event loop to the syncer: a segment's fd and
+    // the bytes to append to it, closed once written if it has rolled over.
+    struct SyncBuffer {
+        int fd;
+        std::string data;
+        bool closeAfter;
+    };
+
+    // Called by LogStore::commit, under its lock, for each log on its dirty
+    // list: moves the rolled-over segments and the buffered records to the
+    // syncer's side. No I/O.
+    void handOff() {
+        awaitingCommit = false;
+        for (SyncBuffer& buffer : retired) unsynced.push_back(std::move(buffer));
+        retired.clear();
+        if (fd < 0 || pending.empty()) return;
+        if (!unsynced.empty() && unsynced.back().fd == fd && !unsynced.back().closeAfter) {
+            unsynced.back().data += pending;
+            pending.clear();
+        } else {
+            unsynced.push_back({fd, std::move(pending), false});
+            pending.clear();
+        }
+    }
+
+    // Syncer thread: writes and syncs `buffers`, taken from unsynced, in
+    // order, closing rolled-over segments once they are done. Stops at the
+    // first failure, so records reach the disk in order. Returns how many
+    // buffers were done; the caller gives the rest back to retry.
+    size_t sync(std::vector<SyncBuffer>& buffers) {
+        size_t done = 0;
+        for (; done < buffers.size() && writeOut(buffers[done].fd, buffers[done].data); ++done) {
+            if (buffers[done].closeAfter) close(buffers[done].fd);
+        }
+        return done;
+    }
+
+    // Guarded by the LogStore's lock.
+    std::vector<SyncBuffer> unsynced;
+    bool queuedForSync = false;
+
+    // Replays the newest records into `out`, oldest first, reading only as
+    // many segments (newest first, via mmap) as the history limits need.
+    // A torn record at the end of the newest segment is truncated away.
+    // Returns the sequence number to continue from.
+    uint64_t recover(const HistoryLimits& limits, std::vector<SharedMessage>& out) {
+        std::vector<std::string> segments = listSegments();
+        std::vector<std::vector<SharedMessage>> chunks;
+        size_t messages = 0;
+        size_t bytes = 0;
+        uint64_t nextSequence = 1;
+        for (size_t i = segments.size(); i-- > 0;) {
+            bool newest = i + 1 == segments.size();
+            std::vector<SharedMessage> chunk;
+            uint64_t lastSequence = 0;
+            bool full = false;
+            size_t validLength = readSegment(directory + "/" + segments[i], newest, limits.maxMessages - messages,
+                                             limits.maxBytes - bytes, chunk, lastSequence, full);
+            if (newest) {
+                currentSegment = segments[i];
+                segmentSize = validLength;
+                nextSequence = std::max(static_cast<uint64_t>(std::strtoull(segments[i].c_str(), nullptr, 10)), lastSequence + 1);
+            }
+            for (const auto& message : chunk) bytes += message->frame.size();
+            messages += chunk.size();
+            chunks.push_back(std::move(chunk));
+            if (full || messages >= limits.maxMessages) break;
+        }
+        for (size_t i = chunks.size(); i-- > 0;) {
+            out.insert(out.end(), chunks[i].begin(), chunks[i].end());
+        }
+        if (!currentSegment.empty()) {
+            fd = open((directory + "/" + currentSegment).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        }
+        return nextSequence;
+    }
+
+private:
+    std::string directory;
+    size_t segmentBytes;
+    LogStats& stats;
+    std::vector<RoomLog*>& dirtyLogs;
+    bool awaitingCommit = false;
+    // Syncer thread only: a write or sync is failing; logged once until
+    // one succeeds.
+    bool failing = false;
+    // A failed write could not be cut back out of its segment, so nothing
+    // more is appended behind it. Set by the syncer.
+    std::atomic<bool> disabled{false};
+    int fd = -1;
+    std::string currentSegment;
+    size_t segmentSize = 0;
+    std::string pending;
+    // Segments rolled over since the last commit, with their records still
+    // buffered; the syncer writes, syncs and closes them.
+    std::vector<SyncBuffer> retired;
+
+    // Appends `data`, which holds whole records, and syncs it. On failure
+    // (ENOSPC, EIO) the segment is cut back to where it ended, so later
+    // appends never land behind a partial record, and `data` is kept for
+    // the next commit. If even that fails the log is disabled.
+    bool writeOut(int target, std::string& data) {
+        if (data.empty()) return true;
+        if (disabled) {
+            data.clear();
+            return true;
+        }
+        off_t start = lseek(target, 0, SEEK_END);
+        const char* failed = start < 0 ? "seek" : nullptr;
+        size_t offset = 0;
+        while (!failed && offset < data.size()) {
+            ssize_t written = write(target, data.data() + offset, data.size() - offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                failed = "write";
+                break;
+            }
+            offset += static_cast<size_t>(written);
+        }
+        if (!failed && fdatasync(target) != 0) failed = "sync";
+        if (failed) {
+            int error = errno;
+            ++stats.writeFailures;
+            if (start < 0 || ftruncate(target, start) != 0) {
+                LOG(Error) << "Room log " << failed << " failed in " << directory << ": " << strerror(error)
+                           << "; cannot cut the segment back to its last whole record, so the room is no longer logged.";
+                disabled = true;
+                data.clear();
+                return true;
+            }
+            if (!failing) {
+                LOG(Error) << "Room log " << failed << " failed in " << directory << ": " << strerror(error)
+                           << "; keeping " << data.size() << " bytes to retry.";
+            }
+            failing = true;
+            return false;
+        }
+        if (failing) {
+            LOG(Info) << "Room log writes in " << directory << " succeed again.";
+        }
+        failing = false;
+        stats.bytesWritten += data.size();
+        data.clear();
+        return true;
+    }
+
+    std::vector<std::string> listSegments() const {
+        std::vector<std::string> segments;
+        DIR* dir = opendir(directory.c_str());
+        if (!dir) return segments;
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0) {
+                segments.push_back(name);
+            }
+        }
+        closedir(dir);
+        // Names are zero-padded sequence numbers, so lexical order is log order.
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Maps one segment and materializes only the newest records that fit
+    // in the remaining budget: a first pass walks record lengths, then just
+    // that tail is checksummed and decoded. The newest segment is checked
+    // in full instead, so `lastSequence` is its last good record's whatever
+    // the budget. Corrupt records are skipped; only bad records at the very
+    // end of the newest segment are a torn write, truncated away. Returns
+    // the segment's valid length. `full` is set when the budget stopped the
+    // read.
+    size_t readSegment(const std::string& path, bool newest, size_t maxMessages, size_t maxBytes,
+                       std::vector<SharedMessage>& out, uint64_t& lastSequence, bool& full) {
+        full = false;
+        int segmentFd = open(path.c_str(), newest ? O_RDWR : O_RDONLY);
+        if (segmentFd < 0) return 0;
+        struct stat info;
+        if (fstat(segmentFd, &info) != 0 || info.st_size == 0) {
+            close(segmentFd);
+            return 0;
+        }
+        size_t size = static_cast<size_t>(info.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, segmentFd, 0);
+        if (mapped == MAP_FAILED) {
+            close(segmentFd);
+            return 0;
+        }
+        stats.bytesMapped += size;
+        const char* data = static_cast<const char*>(mapped);
+
+        auto readU32 = [data](size_t offset) {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(data + offset);
+            return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        };
+        auto decode = [&](size_t offset, Frame& frame) {
+            const char* frameBytes = data + offset + RECORD_HEADER_SIZE;
+            uint32_t length = readU32(offset);
+            size_t frameSize = 0;
+            return crc32(frameBytes, length) == readU32(offset + 4) &&
+                   parseFrame(frameBytes, length, frame, frameSize) == DecodeStatus::Frame && frameSize == length;
+        };
+
+        std::vector<size_t> offsets;
+        size_t offset = 0;
+        while (offset + RECORD_HEADER_SIZE <= size) {
+            uint32_t length = readU32(offset);
+            if (length < FRAME_HEADER_SIZE || offset + RECORD_HEADER_SIZE + length > size) break;
+            offsets.push_back(offset);
+            offset += RECORD_HEADER_SIZE + length;
+        }
+        size_t validEnd = offset;
+        size_t skipped = 0;
+
+        if (newest) {
+            std::vector<size_t> good;
+            good.reserve(offsets.size());
+            for (size_t record : offsets) {
+                Frame frame;
+                if (!decode(record, frame)) continue;
+                good.push_back(record);
+                lastSequence = std::max(lastSequence, frame.sequence);
+            }
+            size_t goodEnd = good.empty() ? 0 : good.back() + RECORD_HEADER_SIZE + readU32(good.back());
+            validEnd = std::min(validEnd, goodEnd);
+            for (size_t record : offsets) skipped += record < goodEnd;
+            skipped -= good.size();
+            offsets.swap(good);
+        }
+
+        std::vector<SharedMessage> tail;
+        size_t bytes = 0;
+        size_t k = offsets.size();
+        for (; k > 0 && tail.size() < maxMessages; --k) {
+            size_t length = readU32(offsets[k - 1]);
+            if (bytes + length > maxBytes) break;
+            Frame frame;
+            if (!decode(offsets[k - 1], frame)) {
+                ++skipped;
+                continue;
+            }
+            bytes += length;
+            tail.push_back(makeMessage(frame.type, frame.sequence, frame.payload));
+        }
+        full = k > 0;
+        out.insert(out.end(), tail.rbegin(), tail.rend());
+        munmap(mapped, size);
+
+        if (skipped > 0) {
+            LOG(Warn) << "Skipped " << skipped << " corrupt record(s) in " << path << ".";
+        }
+        if (validEnd < size && newest) {
+            LOG(Warn) << "Truncating torn record at offset " << validEnd << " in " << path << ".";
+            if (ftruncate(segmentFd, static_cast<off_t>(validEnd)) != 0) {
+                LOG(Error) << "Truncate failed: " << strerror(errno);
+            }
+        }
+        close(segmentFd);
+        return validEnd;
+    }
+
+    void rollSegment(uint64_t firstSequence) {
+        if (fd >= 0) {
+            retired.push_back({fd, std::move(pending), true});
+            pending.clear();
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.log", static_cast<unsigned long long>(firstSequence));
+        currentSegment = name;
+        segmentSize = 0;
+        fd = open((directory + "/" + currentSegment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            LOG(Error) << "Cannot open room log segment " << directory << "/" << currentSegment << ": " << strerror(errno);
+        }
+    }
+};
+
+// Owns the per-room logs under --data-dir. Each room lives in a directory
+// named after the hex encoding of its name, so any room name is safe.
+class LogStore {
+public:
+    // Failed writes are retried this often, even if the room goes quiet.
+    static constexpr int RETRY_MS = 1000;
+
+    LogStore(const std::string& dir, size_t segmentLimit) : directory(dir), segmentBytes(segmentLimit) {
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Cannot create data directory " + directory + ": " + strerror(errno));
+        }
+        syncer = std::thread(&LogStore::syncLoop, this);
+    }
+
+    // Commits what is buffered and waits for the syncer to write it.
+    ~LogStore() {
+        commit();
+        {
+            std::lock_guard<std::mutex> lock(syncMutex);
+            stopping = true;
+        }
+        syncWake.notify_one();
+        syncer.join();
+    }
+
+    RoomLog& open(const std::string& room) {
+        auto it = logs.find(room);
+        if (it == logs.end()) {
+            std::string path = directory + "/room-" + hexEncode(room);
+            mkdir(path.c_str(), 0755);
+            it = logs.emplace(room, std::unique_ptr<RoomLog>(new RoomLog(path, segmentBytes, stats, dirtyLogs))).first;
+        }
+        return *it->second;
+    }
+
+    // Names of every room that has a log on disk.
+    std::vector<std::string> rooms() const {
+        std::vector<std::string> names;
+        DIR* dir = opendir(directory.c_str());
+        if (!dir) return names;
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 5, "room-") != 0) continue;
+            std::string room;
+            if (hexDecode(name.substr(5), room)) {
+                names.push_back(room);
+            } else {
+                LOG(Warn) << "Ignoring " << directory << "/" << name << ": not a room log directory.";
+            }
+        }
+        closedir(dir);
+        return names;
+    }
+
+    // Group commit: hands every dirty log's buffered records to the syncer
+    // thread, which does one write and one fdatasync per room.
+    void commit() {
+        if (dirtyLogs.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(syncMutex);
+            for (RoomLog* log : dirtyLogs) {
+                log->handOff();
+                if (!log->queuedForSync) {
+                    log->queuedForSync = true;
+                    syncQueue.push_back(log);
+                }
+            }
+        }
+        dirtyLogs.clear();
+        syncWake.notify_one();
+    }
+
+    bool dirty() const {
+        return !dirtyLogs.empty();
+    }
+
+    LogStats stats;
+
+private:
+    std::string directory;
+    size_t segmentBytes;
+    std::map<std::string, std::unique_ptr<RoomLog>> logs;
+    // Logs with records appended since the last commit.
+    std::vector<RoomLog*> dirtyLogs;
+    // Logs with records handed to the syncer, and the syncer itself.
+    std::mutex syncMutex;
+    std::condition_variable syncWake;
+    std::vector<RoomLog*> syncQueue;
+    bool stopping = false;
+    std::thread syncer;
+
+    // Writes out whatever commit() hands over. A log whose write failed
+    // keeps its records at the front of its queue and is retried every
+    // RETRY_MS; at shutdown it gets one last try.
+    void syncLoop() {
+        std::vector<RoomLog*> batch;
+        std::vector<RoomLog*> retrying;
+        std::vector<std::vector<RoomLog::SyncBuffer>> work;
+        std::unique_lock<std::mutex> lock(syncMutex);
+        while (true) {
+            if (syncQueue.empty() && !stopping) {
+                if (retrying.empty()) {
+                    syncWake.wait(lock);
+                } else {
+                    syncWake.wait_for(lock, std::chrono::milliseconds(RETRY_MS));
+                }
+            }
+            bool finishing = stopping;
+            batch.swap(syncQueue);
+            for (RoomLog* log : retrying) {
+                if (!log->queuedForSync) batch.push_back(log);
+            }
+            retrying.clear();
+            work.resize(batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                batch[i]->queuedForSync = false;
+                work[i].swap(batch[i]->unsynced);
+            }
+            lock.unlock();
+
+            for (size_t i = 0; i < batch.size(); ++i) {
+                std::vector<RoomLog::SyncBuffer>& buffers = work[i];
+                size_t done = batch[i]->sync(buffers);
+                if (done == buffers.size()) {
+                    if (!buffers.empty()) ++stats.commits;
+                    buffers.clear();
+                    continue;
+                }
+                buffers.erase(buffers.begin(), buffers.begin() + static_cast<std::ptrdiff_t>(done));
+                retrying.push_back(batch[i]);
+            }
+
+            lock.lock();
+            // Failed buffers go back in front of whatever was handed over
+            // meanwhile.
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (work[i].empty()) continue;
+                std::vector<RoomLog::SyncBuffer>& queued = batch[i]->unsynced;
+                queued.insert(queued.begin(), std::make_move_iterator(work[i].begin()), std::make_move_iterator(work[i].end()));
+                work[i].clear();
+            }
+            batch.clear();
+            if (finishing && syncQueue.empty()) return;
+        }
+    }
+
+    static std::string hexEncode(const std::string& value) {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : value) {
+            out += digits[c >> 4];
+            out += digits[c & 0xF];
+        }
+        return out;
+    }
+
+    // Reverses hexEncode; false unless `value` is one of its outputs.
+    static bool hexDecode(const std::string& value, std::string& out) {
+        auto digit = [](char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            return -1;
+        };
+        if (value.empty() || value.size() % 2 != 0) return false;
+        out.clear();
+        for (size_t i = 0; i < value.size(); i += 2) {
+            int high = digit(value[i]);
+            int low = digit(value[i + 1]);
+            if (high < 0 || low < 0) return false;
+            out += static_cast<char>(high << 4 | low);
+        }
+        return true;
+    }
+};
+#else
+// Windows build: persistence needs mmap and fdatasync, so --data-dir is
+// rejected and rooms stay memory-only.
+class RoomLog : public MessageJournal {
+public:
+    void append(const ChatMessage&) override {}
+    uint64_t recover(const HistoryLimits&, std::vector<SharedMessage>&) { return 1; }
+};
+
+class LogStore {
+public:
+    LogStore(const std::string&, size_t) {
+        throw std::runtime_error("--data-dir is not supported on Windows.");
+    }
+    RoomLog& open(const std::string&) { return log; }
+    std::vector<std::string> rooms() const { return std::vector<std::string>(); }
+    void commit() {}
+    bool dirty() const { return false; }
+    LogStats stats;
+
+private:
+    RoomLog log;
+};
+#endif
+
+// Records inbound traffic for chatsphere_replay (--capture). Each shard
+// appends records to its own batch and submits it once per loop
+// iteration; a background thread writes the batches out, so event loops
+// never wait on the file. Batches beyond MAX_QUEUED_BYTES of unwritten
+// data are dropped and reported rather than letting memory grow.
+class TrafficCapture {
+public:
+    static constexpr size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+    explicit TrafficCapture(const std::string& path) : file(fopen(path.c_str(), "wb")), start(Clock::now()) {
+        if (!file) {
+            throw std::runtime_error("Cannot open capture file " + path + ": " + strerror(errno));
+        }
+        fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), file);
+    }
+
+    ~TrafficCapture() {
+        stop();
+        fclose(file);
+    }
+
+    void startWriter() {
+        writer = std::thread(&TrafficCapture::writeLoop, this);
+    }
+
+    // Writes out every submitted batch and joins the writer.
+    void stop() {
+        if (!writer.joinable()) return;
+        stopping = true;
+        writer.join();
+    }
+
+    uint64_t newConnectionId() {
+        return nextConnection.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record(std::string& batch, CaptureEvent event, uint64_t connection, FrameType type = FrameType::Chat,
+                uint8_t flags = 0, std::string_view payload = std::string_view()) const {
+        CaptureRecord record;
+        record.event = event;
+        record.type = type;
+        record.flags = flags;
+        record.timeNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+        record.connection = connection;
+        record.payload = payload;
+        appendCaptureRecord(batch, record);
+    }
+
+    // Hands a shard's batch to the writer and leaves it empty.
+    void submit(std::string& batch) {
+        if (batch.empty()) return;
+        if (queuedBytes.fetch_add(batch.size(), std::memory_order_relaxed) + batch.size() > MAX_QUEUED_BYTES) {
+            queuedBytes.fetch_sub(batch.size(), std::memory_order_relaxed);
+            droppedBytes.fetch_add(batch.size(), std::memory_order_relaxed);
+            batch.clear();
+            return;
+        }
+        batches.push(std::move(batch));
+        batch.clear();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    FILE* file;
+    Clock::time_point start;
+    std::atomic<uint64_t> nextConnection{1};
+    Mailbox<std::string> batches;
+    std::atomic<size_t> queuedBytes{0};
+    std::atomic<uint64_t> droppedBytes{0};
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+
+    void writeLoop() {
+        std::string batch;
+        while (true) {
+            bool finishing = stopping.load();
+            bool wrote = false;
+            while (batches.pop(batch)) {
+                fwrite(batch.data(), 1, batch.size(), file);
+                queuedBytes.fetch_sub(batch.size(), std::memory_order_relaxed);
+                wrote = true;
+            }
+            uint64_t lost = droppedBytes.exchange(0, std::memory_order_relaxed);
+            if (lost > 0) {
+                LOG(Warn) << "Capture dropped " << lost << " bytes of records: writer is behind.";
+            }
+            if (wrote) {
+                fflush(file);
+            } else {
+                if (finishing) return;
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+    }
+};
+
+// Everything the server keeps for one accepted socket, from accept()
+// until close. Connections live in the server's slot map; once the
+// handshake completes the connection joins a room, which refers back to
+// it by handle.
+struct Connection : Session {
+    SOCKET socket = INVALID_SOCKET;
+    sockaddr_in address{};
+    // Accepted on the --unix-socket listener; `address` is unset.
+    bool local = false;
+#ifdef __linux__
+    // Set once a local client has moved to shared-memory rings; the socket
+    // then only tells us when it hangs up.
+    std::unique_ptr<SharedRing> ring;
+#endif
+    FrameDecoder decoder;
+    OutputQueue output;
+    // Names the connection in the --capture file; follows it across shards.
+    uint64_t captureId = 0;
+    // When anything last arrived, and when we last pinged the client.
+    std::chrono::steady_clock::time_point lastHeard;
+    std::chrono::steady_clock::time_point lastPing;
+    // Tick of the earliest entry this connection has in the shard's timer
+    // wheel; UINT64_MAX when it has none.
+    uint64_t timerDue = UINT64_MAX;
+    // Not read until its rate limit has a token again (--flood-policy defer).
+    bool inputHeld = false;
+    // On the shard's ready list: it used up its turn with input left.
+    bool inputReady = false;
+};
+
+struct RoomSnapshot {
+    std::string name;
+    size_t members = 0;
+    size_t history = 0;
+    RoomStats stats;
+};
+
+// One shard's metrics at the moment it handled a scrape.
+struct ShardSnapshot {
+    ServerStats stats;
+    CoreStats core;
+    SlowConsumerStats slowConsumers;
+    size_t connections = 0;
+    size_t queuedBytes = 0;
+    size_t maxQueuedBytes = 0;
+    std::vector<RoomSnapshot> rooms;
+};
+
+// One admin scrape. Each shard fills in its own entry from its own
+// thread; the last one to finish completes `done`.
+struct MetricsRequest {
+    std::vector<ShardSnapshot> shards;
+    std::atomic<size_t> remaining{0};
+    std::promise<void> done;
+};
+
+// Work one reactor shard posts to another's mailbox.
+struct ShardMessage {
+    enum class Kind {
+        Handoff,        // a connection whose room lives on the receiving shard
+        PrivateMessage, // deliver `payload` to `target` if connected here
+        PrivateResult,  // reply to PrivateMessage: whether it was delivered
+        Metrics,        // fill in this shard's entry of `metrics`
+        // From the federation, about traffic on other nodes:
+        PeerRoomMessage, // `payload`, of type `type`, was sent to `room`
+        PeerPresence,    // `payload` (a username) joined `room` if `present`, else left it
+        PeerPrivate,     // deliver `payload` to `target` if connected here; no reply
+    };
+    Kind kind = Kind::Handoff;
+    std::unique_ptr<Connection> connection;
+    std::shared_ptr<MetricsRequest> metrics;
+    // The handshake the handed-off connection sent.
+    std::string hello;
+    size_t origin = 0;
+    uint64_t relayId = 0;
+    std::string target;
+    std::string payload;
+    bool delivered = false;
+    std::string room;
+    FrameType type = FrameType::Chat;
+    bool present = false;
+};
+
+struct ServerOptions {
+#ifdef __linux__
+    std::string backend = "epoll";
+#else
+    std::string backend = "select";
+#endif
+    // Unsent bytes a client may accumulate before the slow-consumer policy fires.
+    size_t highWaterBytes = 1024 * 1024;
+    SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DropOldest;
+    HistoryLimits history;
+    // Per-room overrides of the history limits, keyed by room name.
+    std::map<std::string, HistoryLimits> roomHistory;
+    // Room logs are kept here when set; empty keeps rooms in memory only.
+    std::string dataDir;
+    // Group-commit window: appended records are fsynced at most this late.
+    int fsyncIntervalMs = 20;
+    size_t segmentBytes = 16 * 1024 * 1024;
+    // Reactor shards, each with its own thread, SO_REUSEPORT listener and
+    // event loop. More than one is Linux only.
+    size_t threads = 1;
+    LogLevel logLevel = LogLevel::Info;
+    // Prometheus metrics are served on 127.0.0.1 at this port; 0 disables.
+    int adminPort = 0;
+    // Chat and PM lines are logged one in this many; other events always.
+    size_t logSampleEvery = 1;
+    // Inbound traffic is recorded here for chatsphere_replay when set.
+    std::string capturePath;
+    // Output queued while handling a poller wait's events is written once,
+    // after the last of them, unless the oldest unwritten message has
+    // waited this long; 0 writes every message as soon as it is queued.
+    int flushDelayUs = 1000;
+    // A framed client silent for this long is sent a Ping; 0 disables.
+    int heartbeatSeconds = 30;
+    // A framed client silent for this long is disconnected; 0 disables.
+    // Legacy text clients cannot answer pings and are exempt.
+    int idleTimeoutSeconds = 90;
+    // Per-connection and per-room message rates; unlimited by default.
+    RateLimits rateLimits;
+    // Federation: this node's name on peer links, the port peers dial
+    // (0 accepts none) and the peers this node dials, as host:port.
+    std::string nodeName;
+    int peerPort = 0;
+    std::vector<std::string> peers;
+    // Same-host clients may also connect here, and move to shared-memory
+    // rings; empty disables. Not on Windows.
+    std::string unixSocket;
+
+    bool federated() const { return peerPort != 0 || !peers.empty(); }
+};
+
+// The shard that owns a room; every node with the same --threads agrees.
+static size_t roomShard(const std::string& roomName, size_t threads) {
+    return std::hash<std::string>{}(roomName) % threads;
+}
+
+class ChatServer;
+
+
+// Links this server to other ChatSphere servers (--peer, --peer-port) so
+// that a room can have members on any of them. The peers form a full
+// mesh and traffic takes one hop: a node forwards what its own clients do
+// in a room, chat and join/leave notices, once over each link whose peer
+// has members in that room, and the peer fans it out to its own clients
+// without passing it on. Each node also tells every peer which of its
+// users are in which room; the copy of that directory kept per link makes
+// member lists span nodes and lets a PM reach a user on any node.
+// History stays per node: what a room's history holds on one node is what
+// was said there, plus what peers forwarded while it had members.
+//
+// The federation has its own thread and select() loop and meets the
+// shards only through mailboxes. Shards submit their frames once per
+// loop iteration, traffic from peers goes to the shard that owns the
+// room, and each link's output is written once per iteration.
+class Federation {
+public:
+    explicit Federation(const ServerOptions& opts) : options(opts) {
+        if (options.peerPort != 0) {
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+            if (listener == INVALID_SOCKET) throw std::runtime_error("Peer socket creation failed.");
+            int one = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<uint16_t>(options.peerPort));
+            address.sin_addr.s_addr = INADDR_ANY;
+            if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+                listen(listener, 16) == SOCKET_ERROR || !setNonBlocking(listener) || !poller.add(listener)) {
+                std::string error = "Peer bind failed: ";
+                error += errno ? strerror(errno) : std::to_string(WSAGetLastError());
+                closesocket(listener);
+                throw std::runtime_error(error);
+            }
+        }
+#ifdef __linux__
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd < 0 || !poller.add(wakeFd)) {
+            if (listener != INVALID_SOCKET) closesocket(listener);
+            throw std::runtime_error("Failed to create federation wakeup eventfd.");
+        }
+#endif
+        for (const std::string& address : options.peers) {
+            links.emplace_back(new Link());
+            links.back()->address = address;
+        }
+    }
+
+    ~Federation() {
+        for (auto& link : links) {
+            if (link->socket != INVALID_SOCKET) closesocket(link->socket);
+        }
+        if (wakeFd != INVALID_SOCKET) closesocket(wakeFd);
+        if (listener != INVALID_SOCKET) closesocket(listener);
+    }
+
+    // Gives the federation the shard list, indexed by shard number.
+    void joinShards(const std::vector<ChatServer*>& group) {
+        shards = group;
+    }
+
+    // Hands over a shard's frames and leaves the batch empty: UserUp,
+    // UserDown, RoomChat and RoomNotice about its clients, and PeerPrivate
+    // lookups whose sequence is the shard's relay id. Safe from any thread.
+    void submit(size_t shard, std::string& batch) {
+        if (batch.empty()) return;
+        ShardBatch entry;
+        entry.shard = shard;
+        entry.frames = std::move(batch);
+        batch.clear();
+        mailbox.push(std::move(entry));
+        if (!wakePending.exchange(true)) wake();
+    }
+
+    // Interrupts the federation's wait. Safe from any thread.
+    void wake() {
+#ifdef __linux__
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            // The counter is already non-zero, so the loop will wake.
+        }
+#endif
+    }
+
+    void run() {
+        LOG(Info) << "Federating as " << options.nodeName
+                  << (options.peerPort != 0 ? ", accepting peers on port " + std::to_string(options.peerPort) : "") << ".";
+        std::vector<PollEvent> events;
+        while (!shutdownRequested) {
+            redial(Clock::now());
+            if (poller.wait(events, nextTimeoutMs(Clock::now())) < 0) {
+                LOG(Error) << "Federation poll failed: " << (errno ? strerror(errno) : std::to_string(WSAGetLastError()));
+                break;
+            }
+            for (const auto& event : events) {
+                if (event.socket == listener) {
+                    acceptPeers();
+                    continue;
+                }
+                if (event.socket == wakeFd) continue;
+                Link* link = findLink(event.socket);
+                if (!link) continue;
+                if (link->connecting) {
+                    finishConnect(*link);
+                    continue;
+                }
+                if (event.writable) flush(*link);
+                if (event.readable && link->socket != INVALID_SOCKET) readLink(*link);
+            }
+            drainMailbox();
+            for (auto& link : links) {
+                if (linked(*link)) flush(*link);
+            }
+            // Accepted links that dropped are gone for good; dialed ones wait
+            // for their retry.
+            links.erase(std::remove_if(links.begin(), links.end(),
+                                       [](const std::unique_ptr<Link>& link) {
+                                           return link->socket == INVALID_SOCKET && link->address.empty();
+                                       }),
+                        links.end());
+        }
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static constexpr int RETRY_MS = 1000;
+    static constexpr size_t READ_CHUNK = 64 * 1024;
+    // A link whose peer stops reading is dropped past this much unsent output.
+    static constexpr size_t MAX_LINK_BACKLOG = 64 * 1024 * 1024;
+#ifndef __linux__
+    // How long submitted frames can wait with no wakeup fd.
+    static constexpr int SUBMIT_POLL_MS = 20;
+#endif
+
+    struct Link {
+        SOCKET socket = INVALID_SOCKET;
+        // host:port for a link this node dials, redialled whenever it
+        // drops; empty for one it accepted.
+        std::string address;
+        // The peer's node name, from its PeerHello.
+        std::string name;
+        bool connecting = false;
+        bool greeted = false;
+        // A failure to dial was logged; later ones are not, until it links.
+        bool unreachable = false;
+        FrameDecoder decoder;
+        std::string output;
+        size_t outputOffset = 0;
+        bool waitingWritable = false;
+        // The peer's users with their rooms, and its member count per room.
+        std::unordered_multimap<std::string, std::string> users;
+        std::unordered_map<std::string, size_t> rooms;
+        Clock::time_point retryAt;
+    };
+
+    struct ShardBatch {
+        size_t shard = 0;
+        std::string frames;
+    };
+
+    // A user connected to one of this node's shards.
+    struct LocalUser {
+        std::string room;
+        size_t shard;
+    };
+
+    ServerOptions options;
+    SelectPoller poller;
+    SOCKET listener = INVALID_SOCKET;
+    SOCKET wakeFd = INVALID_SOCKET;
+    // Set by the first submit after a wakeup, so a burst costs one write.
+    std::atomic<bool> wakePending{false};
+    Mailbox<ShardBatch> mailbox;
+    std::vector<ChatServer*> shards;
+    std::vector<std::unique_ptr<Link>> links;
+    // This node's half of the directory, sent to each peer as it links.
+    std::unordered_multimap<std::string, LocalUser> localUsers;
+
+    // Defined after ChatServer.
+    void toShard(size_t shard, ShardMessage message);
+
+    static bool linked(const Link& link) {
+        return link.socket != INVALID_SOCKET && !link.connecting;
+    }
+
+    static bool connectPending() {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EINPROGRESS;
+#endif
+    }
+
+    Link* findLink(SOCKET socket) {
+        for (auto& link : links) {
+            if (link->socket == socket) return link.get();
+        }
+        return nullptr;
+    }
+
+    int nextTimeoutMs(Clock::time_point now) const {
+        long long timeout = -1;
+        for (const auto& link : links) {
+            if (link->socket != INVALID_SOCKET || link->address.empty()) continue;
+            long long wait = std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(link->retryAt - now).count());
+            timeout = timeout < 0 ? wait : std::min(timeout, wait);
+        }
+#ifndef __linux__
+        timeout = timeout < 0 ? SUBMIT_POLL_MS : std::min(timeout, static_cast<long long>(SUBMIT_POLL_MS));
+#endif
+        return static_cast<int>(timeout);
+    }
+
+    void redial(Clock::time_point now) {
+        for (auto& link : links) {
+            if (link->socket == INVALID_SOCKET && !link->address.empty() && link->retryAt <= now) dial(*link);
+        }
+    }
+
+    // Starts a non-blocking connect; the link is up once it is writable.
+    void dial(Link& link) {
+        size_t colon = link.address.rfind(':');
+        std::string host = link.address.substr(0, colon);
+        std::string port = link.address.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* resolved = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &resolved) != 0 || !resolved) {
+            retryLater(link, "cannot resolve the address");
+            return;
+        }
+        SOCKET peer = socket(AF_INET, SOCK_STREAM, 0);
+        if (peer == INVALID_SOCKET || !setNonBlocking(peer)) {
+            if (peer != INVALID_SOCKET) closesocket(peer);
+            freeaddrinfo(resolved);
+            retryLater(link, "socket creation failed");
+            return;
+        }
+        int result = connect(peer, resolved->ai_addr, static_cast<int>(resolved->ai_addrlen));
+        freeaddrinfo(resolved);
+        if (result == SOCKET_ERROR && !connectPending()) {
+            std::string reason = errno ? strerror(errno) : std::to_string(WSAGetLastError());
+            closesocket(peer);
+            retryLater(link, reason);
+            return;
+        }
+        if (!attach(link, peer)) return;
+        if (result == SOCKET_ERROR) {
+            link.connecting = true;
+            poller.watchWritable(peer, true);
+        } else {
+            established(link);
+        }
+    }
+
+    void finishConnect(Link& link) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(link.socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length);
+        if (error != 0) {
+            dropLink(link, strerror(error));
+            return;
+        }
+        link.connecting = false;
+        poller.watchWritable(link.socket, false);
+        established(link);
+    }
+
+    void acceptPeers() {
+        while (true) {
+            SOCKET peer = accept(listener, nullptr, nullptr);
+            if (peer == INVALID_SOCKET) return;
+            if (!setNonBlocking(peer)) {
+                closesocket(peer);
+                continue;
+            }
+            links.emplace_back(new Link());
+            if (attach(*links.back(), peer)) established(*links.back());
+        }
+    }
+
+    // Gives a link a fresh socket, with nothing left over from before.
+    bool attach(Link& link, SOCKET peer) {
+        int one = 1;
+        setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+        if (!poller.add(peer)) {
+            closesocket(peer);
+            retryLater(link, "too many sockets for select()");
+            return false;
+        }
+        link.socket = peer;
+        link.decoder = FrameDecoder();
+        link.output.clear();
+        link.outputOffset = 0;
+        return true;
+    }
+
+    // Both sides open with their name and their half of the directory.
+    void established(Link& link) {
+        appendFrame(link.output, FrameType::PeerHello, 0, options.nodeName);
+        for (const auto& user : localUsers) {
+            appendFrame(link.output, FrameType::UserUp, 0, {user.first, ":", user.second.room});
+        }
+        flush(link);
+    }
+
+    void retryLater(Link& link, const std::string& reason) {
+        if (!link.address.empty() && !link.unreachable) {
+            LOG(Warn) << "Cannot link to peer " << link.address << ": " << reason << "; retrying every "
+                      << RETRY_MS / 1000 << " s.";
+            link.unreachable = true;
+        }
+        link.retryAt = Clock::now() + std::chrono::milliseconds(RETRY_MS);
+    }
+
+    // Closes a link and withdraws the peer's users from this node. A
+    // dialed link is retried; clearing its address first forgets it.
+    void dropLink(Link& link, const std::string& reason) {
+        if (link.greeted) {
+            LOG(Warn) << "Lost peer " << link.name << ": " << reason << ".";
+            link.unreachable = true;
+        } else if (link.address.empty()) {
+            LOG(Debug) << "Dropped a peer link before its hello: " << reason << ".";
+        }
+        poller.remove(link.socket);
+        closesocket(link.socket);
+        link.socket = INVALID_SOCKET;
+        link.connecting = false;
+        link.greeted = false;
+        link.waitingWritable = false;
+        for (const auto& user : link.users) {
+            postPresence(user.second, user.first, false);
+        }
+        link.users.clear();
+        link.rooms.clear();
+        retryLater(link, reason);
+    }
+
+    void readLink(Link& link) {
+        while (link.socket != INVALID_SOCKET) {
+            char* space = link.decoder.prepare(READ_CHUNK);
+            int bytes = recv(link.socket, space, static_cast<int>(link.decoder.capacity()), 0);
+            if (bytes > 0) {
+                link.decoder.commit(static_cast<size_t>(bytes));
+                if (!decodeFrames(link)) return;
+            } else if (bytes < 0 && socketInterrupted()) {
+                continue;
+            } else if (bytes < 0 && socketWouldBlock()) {
+                return;
+            } else {
+                dropLink(link, bytes == 0 ? "connection closed" : "read failed");
+                return;
+            }
+        }
+    }
+
+    // Returns false once the link has been dropped.
+    bool decodeFrames(Link& link) {
+        if (link.decoder.mode() != FrameDecoder::Mode::Framed) {
+            dropLink(link, "not a ChatSphere peer");
+            return false;
+        }
+        Frame frame;
+        FrameDecoder::Status status;
+        while ((status = link.decoder.next(frame)) == FrameDecoder::Status::Frame) {
+            if (!handlePeerFrame(link, frame)) return false;
+        }
+        if (status == FrameDecoder::Status::Error) {
+            dropLink(link, "malformed frame");
+            return false;
+        }
+        return true;
+    }
+
+    bool greet(Link& link, std::string_view name) {
+        if (name.empty() || name == options.nodeName) {
+            LOG(Warn) << "Peer link " << (link.address.empty() ? "from " : "to ") << (link.address.empty() ? "a peer" : link.address)
+                      << " came back to this node; dropping it.";
+            link.address.clear();
+            dropLink(link, "loop");
+            return false;
+        }
+        for (auto& other : links) {
+            if (other.get() == &link || !other->greeted || other->name != name) continue;
+            // Both peers dialed each other, or one twice. Both ends must
+            // keep the same connection: the one the lower name dialed.
+            bool dialedHere = !link.address.empty();
+            bool keepNew = dialedHere != !other->address.empty() && dialedHere == (options.nodeName < name);
+            Link& loser = keepNew ? *other : link;
+            LOG(Warn) << "Two links to peer " << name << "; closing one. Configure --peer on one side only.";
+            loser.address.clear();
+            dropLink(loser, "duplicate link");
+            if (!keepNew) return false;
+            break;
+        }
+        link.greeted = true;
+        link.unreachable = false;
+        link.name.assign(name.data(), name.size());
+        LOG(Info) << "Linked to peer " << link.name << (link.address.empty() ? "" : " at " + link.address) << ".";
+        return true;
+    }
+
+    // A frame from a peer. Returns false once the link has been dropped.
+    bool handlePeerFrame(Link& link, const Frame& frame) {
+        std::string_view payload = frame.payload;
+        if (!link.greeted) {
+            if (frame.type == FrameType::PeerHello) return greet(link, payload);
+            dropLink(link, "expected a PeerHello");
+            return false;
+        }
+        switch (frame.type) {
+        case FrameType::UserUp:
+        case FrameType::UserDown: {
+            size_t colon = payload.find(':');
+            if (colon == std::string_view::npos) break;
+            std::string username(payload.substr(0, colon));
+            std::string room(payload.substr(colon + 1));
+            if (frame.type == FrameType::UserUp) {
+                link.users.emplace(username, room);
+                ++link.rooms[room];
+            } else {
+                auto range = link.users.equal_range(username);
+                auto it = std::find_if(range.first, range.second, [&room](const auto& user) { return user.second == room; });
+                if (it == range.second) break;
+                link.users.erase(it);
+                if (--link.rooms[room] == 0) link.rooms.erase(room);
+            }
+            postPresence(room, username, frame.type == FrameType::UserUp);
+            break;
+        }
+        case FrameType::RoomChat:
+        case FrameType::RoomNotice: {
+            size_t newline = payload.find('\n');
+            if (newline == std::string_view::npos) break;
+            ShardMessage message;
+            message.kind = ShardMessage::Kind::PeerRoomMessage;
+            message.room.assign(payload.data(), newline);
+            message.type = frame.type == FrameType::RoomChat ? FrameType::Chat : FrameType::System;
+            message.payload.assign(payload.substr(newline + 1));
+            size_t owner = roomShard(message.room, shards.size());
+            toShard(owner, std::move(message));
+            break;
+        }
+        case FrameType::PeerPrivate: {
+            size_t colon = payload.find(':');
+            if (colon == std::string_view::npos) break;
+            auto user = localUsers.find(std::string(payload.substr(0, colon)));
+            // Gone since the peer's lookup; the PM is lost.
+            if (user == localUsers.end()) break;
+            ShardMessage message;
+            message.kind = ShardMessage::Kind::PeerPrivate;
+            message.target = user->first;
+            message.payload.assign(payload.substr(colon + 1));
+            toShard(user->second.shard, std::move(message));
+            break;
+        }
+        default:
+            // From a newer peer; nothing here knows what to do with it.
+            break;
+        }
+        return true;
+    }
+
+    void postPresence(const std::string& room, const std::string& username, bool present) {
+        ShardMessage message;
+        message.kind = ShardMessage::Kind::PeerPresence;
+        message.room = room;
+        message.payload = username;
+        message.present = present;
+        toShard(roomShard(room, shards.size()), std::move(message));
+    }
+
+    void drainMailbox() {
+#ifdef __linux__
+        uint64_t count;
+        if (read(wakeFd, &count, sizeof(count)) < 0) {
+            // Nothing to clear; the queue is still checked below.
+        }
+#endif
+        wakePending = false;
+        ShardBatch batch;
+        while (mailbox.pop(batch)) {
+            const char* data = batch.frames.data();
+            size_t available = batch.frames.size();
+            Frame frame;
+            size_t size = 0;
+            while (parseFrame(data, available, frame, size) == DecodeStatus::Frame) {
+                handleLocalFrame(batch.shard, frame, std::string_view(data, size));
+                data += size;
+                available -= size;
+            }
+        }
+    }
+
+    // A frame from one of this node's shards. Directory changes go to
+    // every link, room traffic only to peers with members in the room;
+    // both are forwarded as they were encoded.
+    void handleLocalFrame(size_t shard, const Frame& frame, std::string_view encoded) {
+        std::string_view payload = frame.payload;
+        switch (frame.type) {
+        case FrameType::UserUp:
+        case FrameType::UserDown: {
+            size_t colon = payload.find(':');
+            std::string username(payload.substr(0, colon));
+            std::string_view room = payload.substr(colon + 1);
+            if (frame.type == FrameType::UserUp) {
+                localUsers.emplace(username, LocalUser{std::string(room), shard});
+            } else {
+                auto range = localUsers.equal_range(username);
+                auto it = std::find_if(range.first, range.second, [&](const auto& user) {
+                    return user.second.room == room && user.second.shard == shard;
+                });
+                if (it != range.second) localUsers.erase(it);
+            }
+            for (auto& link : links) {
+                if (linked(*link)) link->output.append(encoded.data(), encoded.size());
+            }
+            break;
+        }
+        case FrameType::RoomChat:
+        case FrameType::RoomNotice: {
+            std::string room(payload.substr(0, payload.find('\n')));
+            for (auto& link : links) {
+                if (link->greeted && link->rooms.count(room)) link->output.append(encoded.data(), encoded.size());
+            }
+            break;
+        }
+        case FrameType::PeerPrivate: {
+            std::string target(payload.substr(0, payload.find(':')));
+            ShardMessage reply;
+            reply.kind = ShardMessage::Kind::PrivateResult;
+            reply.relayId = frame.sequence;
+            for (auto& link : links) {
+                if (link->greeted && link->users.count(target)) {
+                    appendFrame(link->output, FrameType::PeerPrivate, 0, payload);
+                    reply.delivered = true;
+                    break;
+                }
+            }
+            toShard(shard, std::move(reply));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void flush(Link& link) {
+        while (link.outputOffset < link.output.size()) {
+            size_t remaining = std::min<size_t>(link.output.size() - link.outputOffset, 1 << 30);
+            int sent = send(link.socket, link.output.data() + link.outputOffset, static_cast<int>(remaining), 0);
+            if (sent > 0) {
+                link.outputOffset += static_cast<size_t>(sent);
+            } else if (sent < 0 && socketInterrupted()) {
+                continue;
+            } else if (sent < 0 && socketWouldBlock()) {
+                break;
+            } else {
+                dropLink(link, "write failed");
+                return;
+            }
+        }
+        if (link.outputOffset == link.output.size()) {
+            link.output.clear();
+            link.outputOffset = 0;
+        } else if (link.output.size() - link.outputOffset > MAX_LINK_BACKLOG) {
+            dropLink(link, "peer stopped reading");
+            return;
+        } else if (link.outputOffset > link.output.size() / 2) {
+            link.output.erase(0, link.outputOffset);
+            link.outputOffset = 0;
+        }
+        bool waiting = !link.output.empty();
+        if (waiting != link.waitingWritable) {
+            poller.watchWritable(link.socket, waiting);
+            link.waitingWritable = waiting;
+        }
+    }
+};
+
+// One reactor shard. With --threads N there are N of these, one per
+// thread, each accepting on its own SO_REUSEPORT listener. Rooms are
+// pinned to shards by hash: a connection that arrives on the wrong shard
+// is handed to the room's owner after its handshake, and a PM for a user
+// on another shard is relayed through the shards' mailboxes. Apart from
+// the mailboxes nothing is shared, so the shards take no locks.
+//
+// Rooms, history and routing live in the shard's ChatCore; ChatServer is
+// its socket transport, turning reads into frames for the core and the
+// core's deliveries into output queues.
+class ChatServer : public ChatTransport<Connection> {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // A PM whose target was not on this shard, waiting for the others.
+    struct PendingRelay {
+        SlotHandle sender;
+        size_t outstanding;
+        bool delivered;
+        std::string target;
+        std::string content;
+    };
+
+    static constexpr size_t MAX_HANDSHAKE_BYTES = 512;
+    static constexpr size_t FLUSH_BATCH_BYTES = 64 * 1024;
+    static constexpr int HANDSHAKE_TIMEOUT_MS = 10000;
+    // Frames one connection may dispatch per turn before the loop moves on.
+    static constexpr size_t INPUT_BUDGET_FRAMES = 64;
+    // Input a held connection may pile up when the backend reads on our
+    // behalf (io_uring); past this its messages are shed instead.
+    static constexpr size_t MAX_HELD_INPUT_BYTES = 256 * 1024;
+#ifndef __linux__
+    // How long an admin scrape or peer traffic can wait for a shard with
+    // no wakeup fd.
+    static constexpr int ADMIN_POLL_MS = 100;
+#endif
+
+    ServerOptions options;
+    SOCKET listeningSocket;
+    // Shard 0's --unix-socket listener; local clients are handed to the
+    // shard that owns their room like any other.
+    SOCKET unixListener = INVALID_SOCKET;
+    std::unique_ptr<Poller> poller;
+    ChatCore<Connection> core;
+    // Poller events arrive by socket.
+    std::unordered_map<SOCKET, SlotHandle> socketIndex;
+    // Connections whose queue overflowed or failed mid-broadcast; closed
+    // once the current event has been handled so room iteration stays valid.
+    std::vector<SlotHandle> closingConnections;
+    // Scratch list for asynchronous sends, reused to avoid reallocating.
+    std::vector<SendBuffer> sendBuffers;
+    // Connections with output queued during this loop iteration, and when
+    // the first of them was added.
+    std::vector<SlotHandle> flushList;
+    Clock::time_point flushListSince;
+    // Connections that used up their turn with input left. Each gets one
+    // more turn per loop iteration, round robin, so a client pasting a
+    // script cannot monopolise the loop.
+    std::vector<SlotHandle> readyList;
+    std::vector<SlotHandle> serving;
+    SlowConsumerStats slowConsumerStats;
+    // Handshake deadlines, heartbeats and idle timeouts, in milliseconds
+    // since timerEpoch. A connection's deadline is re-armed when it fires
+    // rather than on every read; entries whose connection has closed or
+    // moved shard, or that an earlier deadline superseded, are ignored.
+    TimerWheel<SlotHandle> timers;
+    Clock::time_point timerEpoch;
+    SharedMessage pingMessage;
+    std::unique_ptr<LogStore> logStore;
+    Clock::time_point lastCommit;
+    Clock::time_point lastLogReport;
+    unsigned long long lastReportedRecords = 0;
+    // Chat and PM lines seen, for --log-sample.
+    uint64_t chatLines = 0;
+    ServerStats stats;
+    // When the input being processed was read, for fan-out latency.
+    Clock::time_point ingressTime;
+
+    size_t shardIndex;
+    std::vector<ChatServer*> shards;
+    Mailbox<ShardMessage> mailbox;
+    // Set by the first post after a wakeup, so a burst costs one write.
+    std::atomic<bool> wakePending{false};
+    SOCKET wakeFd = INVALID_SOCKET;
+    uint64_t nextRelayId = 1;
+    std::unordered_map<uint64_t, PendingRelay> pendingRelays;
+    // Shared with the other shards when --capture is set; records go to
+    // captureBatch and are submitted at the end of each loop iteration.
+    TrafficCapture* capture = nullptr;
+    std::string captureBatch;
+    // Set when federated: frames about this shard's clients for the peers
+    // go to federationBatch, submitted at the end of each loop iteration.
+    Federation* federation = nullptr;
+    std::string federationBatch;
+
+    size_t shardFor(const std::string& roomName) const {
+        return roomShard(roomName, options.threads);
+    }
+
+    void post(size_t shard, ShardMessage message) {
+        shards[shard]->mailbox.push(std::move(message));
+        if (!shards[shard]->wakePending.exchange(true)) shards[shard]->wake();
+    }
+
+    void drainMailbox() {
+#ifdef __linux__
+        uint64_t count;
+        if (read(wakeFd, &count, sizeof(count)) < 0) {
+            // Nothing to clear; the queue is still checked below.
+        }
+#endif
+        wakePending = false;
+        ShardMessage message;
+        while (mailbox.pop(message)) {
+            handleShardMessage(message);
+        }
+    }
+
+    void handleShardMessage(ShardMessage& message) {
+        switch (message.kind) {
+        case ShardMessage::Kind::Handoff: {
+            SlotHandle handle = core.open();
+            Connection& conn = *core.connections.get(handle);
+            conn = std::move(*message.connection);
+            conn.handle = handle;
+            conn.output.flushScheduled = false;
+            conn.timerDue = UINT64_MAX;
+            conn.inputReady = false;
+            if (!poller->add(conn.socket)) {
+                closesocket(conn.socket);
+                core.connections.erase(handle);
+                return;
+            }
+            socketIndex[conn.socket] = handle;
+#ifdef __linux__
+            if (conn.ring && !watchBell(conn)) {
+                disconnect(handle);
+                return;
+            }
+#endif
+            ingressTime = Clock::now();
+            // Frames that followed the Hello arrived on the old shard.
+            if (admitted(handle, core.join(conn, message.hello))) serviceInput(conn);
+            break;
+        }
+        case ShardMessage::Kind::PrivateMessage: {
+            ShardMessage reply;
+            reply.kind = ShardMessage::Kind::PrivateResult;
+            reply.relayId = message.relayId;
+            Connection* target = core.findByUsername(message.target);
+            if (target) {
+                deliver(target->handle, makeMessage(FrameType::Private, 0, message.payload));
+                reply.delivered = true;
+            }
+            post(message.origin, std::move(reply));
+            break;
+        }
+        case ShardMessage::Kind::PrivateResult: {
+            auto it = pendingRelays.find(message.relayId);
+            if (it == pendingRelays.end()) return;
+            PendingRelay& relay = it->second;
+            relay.delivered = relay.delivered || message.delivered;
+            if (--relay.outstanding > 0) return;
+            Connection* sender = core.connections.get(relay.sender);
+            if (sender && relay.delivered) {
+                deliver(relay.sender, makeMessage(FrameType::Private, 0, {sender->username, ":", relay.content}));
+                if (sampleChatLine()) {
+                    LOG(Info) << "[" << sender->room->name << "] PM from " << sender->username << " to " << relay.target
+                              << ": " << relay.content;
+                }
+            } else if (sender) {
+                deliver(relay.sender, makeMessage(FrameType::System, 0, {"User ", relay.target, " not found."}));
+            }
+            pendingRelays.erase(it);
+            break;
+        }
+        case ShardMessage::Kind::Metrics:
+            snapshotMetrics(message.metrics->shards[shardIndex]);
+            if (--message.metrics->remaining == 0) message.metrics->done.set_value();
+            break;
+        case ShardMessage::Kind::PeerRoomMessage: {
+            // Recorded and fanned out here, but not forwarded again.
+            auto it = core.rooms.find(message.room);
+            if (it == core.rooms.end()) return;
+            ChatRoom& room = it->second;
+            room.broadcast(room.addMessage(message.type, message.payload), SlotHandle(), *this);
+            break;
+        }
+        case ShardMessage::Kind::PeerPresence:
+            core.remotePresence(message.room, message.payload, message.present);
+            break;
+        case ShardMessage::Kind::PeerPrivate: {
+            Connection* target = core.findByUsername(message.target);
+            if (target) deliver(target->handle, makeMessage(FrameType::Private, 0, message.payload));
+            break;
+        }
+        }
+    }
+
+    void snapshotMetrics(ShardSnapshot& snapshot) {
+        snapshot.stats = stats;
+        snapshot.core = core.stats;
+        snapshot.slowConsumers = slowConsumerStats;
+        snapshot.connections = core.connections.size();
+        core.connections.forEach([&snapshot](Connection& conn) {
+            snapshot.queuedBytes += conn.output.queuedBytes;
+            snapshot.maxQueuedBytes = std::max(snapshot.maxQueuedBytes, conn.output.queuedBytes);
+        });
+        for (const auto& entry : core.rooms) {
+            const ChatRoom& room = entry.second;
+            RoomSnapshot roomSnapshot;
+            roomSnapshot.name = room.name;
+            roomSnapshot.members = room.members.size();
+            roomSnapshot.history = room.messageHistory.size();
+            roomSnapshot.stats = room.stats;
+            snapshot.rooms.push_back(std::move(roomSnapshot));
+        }
+    }
+
+    // Moves a connection that has just sent its handshake to the shard
+    // that owns its room.
+    void handOff(Connection& conn, std::string_view hello, size_t owner) {
+        poller->remove(conn.socket);
+        socketIndex.erase(conn.socket);
+#ifdef __linux__
+        forgetBell(conn);
+#endif
+        SlotHandle handle = conn.handle;
+        ShardMessage message;
+        message.kind = ShardMessage::Kind::Handoff;
+        message.connection.reset(new Connection(std::move(conn)));
+        message.hello.assign(hello.data(), hello.size());
+        core.connections.erase(handle);
+        post(owner, std::move(message));
+    }
+
+    // Acts on the core's verdict on a handshake; a Moved connection is
+    // already on its way to another shard. Returns true if it joined here.
+    bool admitted(SlotHandle handle, HelloResult result) {
+        if (result == HelloResult::Rejected) disconnect(handle);
+        if (result != HelloResult::Joined) return false;
+        superviseIdle(*core.connections.get(handle), Clock::now());
+        return true;
+    }
+
+    // ChatTransport hooks, called by the core.
+
+    bool moveElsewhere(Connection& conn, std::string_view hello, const std::string& roomName) override {
+        size_t owner = shardFor(roomName);
+        if (owner == shardIndex) return false;
+        handOff(conn, hello, owner);
+        return true;
+    }
+
+    // Loads the tail of a logged room's history as it is opened.
+    void roomOpened(ChatRoom& room) override {
+        if (!logStore) return;
+        RoomLog& roomLog = logStore->open(room.name);
+        std::vector<SharedMessage> recovered;
+        uint64_t next = roomLog.recover(core.historyFor(room.name), recovered);
+        room.attachLog(roomLog, next, recovered);
+    }
+
+    // Asks every other shard, and the federation's directory of users on
+    // other nodes, to deliver a PM; the sender is answered once all of
+    // them have replied.
+    bool relayPrivate(Connection& sender, std::string_view target, std::string_view content) override {
+        if (shards.size() < 2 && !federation) return false;
+        uint64_t relayId = nextRelayId++;
+        size_t outstanding = shards.size() - 1 + (federation ? 1 : 0);
+        pendingRelays[relayId] = PendingRelay{sender.handle, outstanding, false, std::string(target), std::string(content)};
+        if (federation) {
+            appendFrame(federationBatch, FrameType::PeerPrivate, relayId, {target, ":", sender.username, ":", content});
+        }
+        for (size_t shard = 0; shard < shards.size(); ++shard) {
+            if (shard == shardIndex) continue;
+            ShardMessage message;
+            message.kind = ShardMessage::Kind::PrivateMessage;
+            message.origin = shardIndex;
+            message.relayId = relayId;
+            message.target.assign(target.data(), target.size());
+            message.payload.reserve(sender.username.size() + 1 + content.size());
+            message.payload.append(sender.username).append(1, ':').append(content.data(), content.size());
+            post(shard, std::move(message));
+        }
+        return true;
+    }
+
+    void joined(Connection& conn, uint64_t lastSeen, size_t replayed) override {
+        LOG(Info) << conn.username << " connected to room " << conn.room->name << " from " << peerName(conn)
+                  << (conn.framed ? "" : " (legacy text)") << (usesRing(conn) ? " over shared memory" : "")
+                  << (lastSeen > 0 ? ", resuming after #" + std::to_string(lastSeen) + " (" + std::to_string(replayed) + " replayed)" : "");
+        if (federation) appendFrame(federationBatch, FrameType::UserUp, 0, {conn.username, ":", conn.room->name});
+    }
+
+    void left(std::string_view username, ChatRoom& room) override {
+        if (federation) appendFrame(federationBatch, FrameType::UserDown, 0, {username, ":", room.name});
+    }
+
+    void published(ChatRoom& room, const SharedMessage& message) override {
+        if (!federation) return;
+        FrameType type = message->type == FrameType::Chat ? FrameType::RoomChat : FrameType::RoomNotice;
+        appendFrame(federationBatch, type, 0, {room.name, "\n", message->payload()});
+    }
+
+    void chatted(Connection& conn, std::string_view line) override {
+        if (sampleChatLine()) {
+            LOG(Info) << "[" << conn.room->name << "] " << line;
+        }
+    }
+
+    void privateSent(Connection& conn, std::string_view target, std::string_view content) override {
+        if (sampleChatLine()) {
+            LOG(Info) << "[" << conn.room->name << "] PM from " << conn.username << " to " << target << ": " << content;
+        }
+    }
+
+#ifndef _WIN32
+    // Listens on --unix-socket. A socket file left behind by an earlier run
+    // is replaced, unless a server still answers on it.
+    void listenLocally() {
+        const std::string& path = options.unixSocket;
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Unix socket path too long: " + path);
+        }
+        std::memcpy(address.sun_path, path.data(), path.size());
+        unixListener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (unixListener == INVALID_SOCKET) {
+            throw std::runtime_error("Failed to create Unix socket.");
+        }
+        struct stat info{};
+        if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+            if (connect(unixListener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+                closesocket(unixListener);
+                unixListener = INVALID_SOCKET;
+                throw std::runtime_error("Unix socket " + path + " is in use by another server.");
+            }
+            unlink(path.c_str());
+        }
+        if (bind(unixListener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+            listen(unixListener, SOMAXCONN) == SOCKET_ERROR || !setNonBlocking(unixListener) || !poller->add(unixListener)) {
+            std::string error = "Unix socket " + path + ": " + strerror(errno);
+            closesocket(unixListener);
+            unixListener = INVALID_SOCKET;
+            throw std::runtime_error(error);
+        }
+    }
+#endif
+
+    // Loads the tail of every room log on disk. Only the newest segments
+    // are mapped, so this stays fast however much history has accumulated.
+    void recoverRooms() {
+        Clock::time_point start = Clock::now();
+        for (const auto& roomName : logStore->rooms()) {
+            if (shardFor(roomName) != shardIndex) continue;
+            ChatRoom& room = core.openRoom(roomName);
+            ++logStore->stats.recoveredRooms;
+            logStore->stats.recoveredMessages += room.messageHistory.size();
+        }
+        const LogStats& stats = logStore->stats;
+        logStore->stats.recoveryMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        LOG(Info) << "Recovered " << stats.recoveredMessages << " messages in " << stats.recoveredRooms << " rooms from "
+                  << options.dataDir << " in " << stats.recoveryMs << " ms (" << stats.bytesMapped << " bytes mapped).";
+    }
+
+    // Group commit. Records appended during the window share one fsync
+    // per room; a summary line reports write amplification once a minute.
+    void commitLogs(Clock::time_point now) {
+        if (!logStore || !logStore->dirty()) return;
+        if (now - lastCommit < std::chrono::milliseconds(options.fsyncIntervalMs)) return;
+        logStore->commit();
+        lastCommit = now;
+
+        const LogStats& stats = logStore->stats;
+        if (now - lastLogReport >= std::chrono::seconds(60) && stats.records != lastReportedRecords) {
+            LOG(Info) << "Room log: " << stats.records << " records, " << stats.payloadBytes << " payload bytes, "
+                      << stats.bytesWritten.load() << " bytes written (write amplification " << stats.writeAmplification()
+                      << "), " << stats.commits.load() << " commits ("
+                      << (stats.commits ? static_cast<double>(stats.records) / stats.commits : 0.0) << " records per fsync), "
+                      << stats.writeFailures.load() << " failed writes.";
+            lastLogReport = now;
+            lastReportedRecords = stats.records;
+        }
+    }
+
+    Connection* findConnection(SOCKET socket) {
+        auto it = socketIndex.find(socket);
+        return it != socketIndex.end() ? core.connections.get(it->second) : nullptr;
+    }
+
+    static std::string peerName(const Connection& conn) {
+        return conn.local ? "local socket" : inet_ntoa(conn.address.sin_addr);
+    }
+
+    static bool usesRing(const Connection& conn) {
+#ifdef __linux__
+        return conn.ring != nullptr;
+#else
+        (void)conn;
+        return false;
+#endif
+    }
+
+    void scheduleClose(Connection& conn) {
+        if (conn.output.closing) return;
+        conn.output.closing = true;
+        closingConnections.push_back(conn.handle);
+    }
+
+    void flushOutput(Connection& conn) {
+        OutputQueue& out = conn.output;
+        if (out.closing) return;
+#ifdef __linux__
+        if (conn.ring) {
+            // What does not fit waits for the client to make room and ring
+            // our bell.
+            size_t queued = out.queuedBytes;
+            bool ok = out.flush(*conn.ring);
+            countBytesOut(conn, queued - out.queuedBytes);
+            if (!ok) scheduleClose(conn);
+            return;
+        }
+#endif
+        if (poller->completesIo()) {
+            // One send in flight per connection keeps the byte order.
+            if (!out.empty() && out.inFlight == 0) {
+                out.gather(sendBuffers, 1024);
+                ++stats.writeCalls;
+                poller->submitSend(conn.socket, sendBuffers);
+            }
+            return;
+        }
+        size_t queued = out.queuedBytes;
+        bool ok = out.flush(conn.socket, stats.writeCalls);
+        countBytesOut(conn, queued - out.queuedBytes);
+        if (!ok) {
+            scheduleClose(conn);
+            return;
+        }
+        bool waiting = !out.empty();
+        if (waiting != out.waitingWritable) {
+            out.waitingWritable = waiting;
+            poller->watchWritable(conn.socket, waiting);
+        }
+    }
+
+    // Arranges for a connection whose queue just became non-empty to be
+    // written at the end of this loop iteration, so everything it is sent
+    // meanwhile goes out in one write.
+    void scheduleFlush(Connection& conn) {
+        if (options.flushDelayUs == 0) {
+            flushOutput(conn);
+            return;
+        }
+        if (conn.output.flushScheduled) return;
+        conn.output.flushScheduled = true;
+        if (flushList.empty()) flushListSince = Clock::now();
+        flushList.push_back(conn.handle);
+    }
+
+    // A burst for one recipient within an iteration, e.g. a client's whole
+    // backlog read at once, is written in FLUSH_BATCH_BYTES pieces instead
+    // of piling up against the high-water mark. Queues waiting for
+    // writability are left to the poller.
+    void flushIfLarge(Connection& conn) {
+        const OutputQueue& out = conn.output;
+        if (out.flushScheduled && !out.waitingWritable && out.queuedBytes >= std::min(FLUSH_BATCH_BYTES, options.highWaterBytes / 2)) {
+            flushOutput(conn);
+        }
+    }
+
+    void flushScheduled() {
+        for (SlotHandle handle : flushList) {
+            Connection* conn = core.connections.get(handle);
+            if (!conn) continue;
+            conn->output.flushScheduled = false;
+            flushOutput(*conn);
+        }
+        flushList.clear();
+    }
+
+    void captureInput(const Connection& conn, CaptureEvent event, const Frame& frame) {
+        if (!capture) return;
+        capture->record(captureBatch, event, conn.captureId, frame.type, conn.framed ? 0 : CAPTURE_LEGACY, frame.payload);
+    }
+
+    void countBytesOut(Connection& conn, size_t bytes) {
+        stats.bytesOut += bytes;
+        if (conn.room) conn.room->stats.bytesOut += bytes;
+    }
+
+    // Busy rooms would otherwise put a line per message on the log ring.
+    bool sampleChatLine() {
+        return logger.enabled(LogLevel::Info) && chatLines++ % options.logSampleEvery == 0;
+    }
+
+    void applySlowConsumerPolicy(Connection& conn, size_t incoming) {
+        OutputQueue& out = conn.output;
+        switch (options.slowConsumerPolicy) {
+        case SlowConsumerPolicy::DropOldest: {
+            size_t droppedBytes = 0;
+            size_t excess = out.queuedBytes + incoming - options.highWaterBytes;
+            size_t dropped = out.dropOldest(excess, droppedBytes);
+            slowConsumerStats.droppedMessages += dropped;
+            slowConsumerStats.droppedBytes += droppedBytes;
+            if (conn.room) conn.room->stats.dropped += dropped;
+            break;
+        }
+        case SlowConsumerPolicy::Coalesce: {
+            size_t coalesced = out.coalesce();
+            slowConsumerStats.coalescedMessages += coalesced;
+            if (conn.room) conn.room->stats.dropped += coalesced;
+            break;
+        }
+        case SlowConsumerPolicy::Disconnect: {
+            ++slowConsumerStats.disconnects;
+            LOG(Warn) << (conn.joined ? conn.username : std::string("client"))
+                      << " disconnected: output queue exceeded " << options.highWaterBytes << " bytes.";
+            scheduleClose(conn);
+            break;
+        }
+        }
+    }
+
+    void enqueue(Connection& conn, const SharedMessage& message) {
+        OutputQueue& out = conn.output;
+        if (out.closing) return;
+        size_t size = message->wire(out.framed).size();
+        if (out.queuedBytes + size > options.highWaterBytes) {
+            applySlowConsumerPolicy(conn, size);
+            if (out.closing) return;
+        }
+        out.push(message);
+        ++stats.messagesOut;
+        if (conn.room) ++conn.room->stats.messagesOut;
+    }
+
+    void closePendingConnections() {
+        while (!closingConnections.empty()) {
+            SlotHandle handle = closingConnections.back();
+            closingConnections.pop_back();
+            Connection* conn = core.connections.get(handle);
+            if (conn && conn->output.closing) {
+                disconnect(handle);
+            }
+        }
+    }
+
+    // Listening sockets are non-blocking, so drain every pending
+    // connection; an edge-triggered poller only reports the burst once.
+    void acceptConnections(SOCKET listener) {
+        while (true) {
+            sockaddr_storage clientAddr{};
+            socklen_t clientSize = sizeof(clientAddr);
+#ifdef __linux__
+            SOCKET clientSocket = accept4(listener, reinterpret_cast<sockaddr*>(&clientAddr), &clientSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+            SOCKET clientSocket = accept(listener, reinterpret_cast<sockaddr*>(&clientAddr), &clientSize);
 #endif
+            if (clientSocket == INVALID_SOCKET) {
+                if (socketInterrupted()) continue;
+                if (!socketWouldBlock()) {
+                    LOG(Error) << "Accept error.";
+                }
+                return;
+            }
 
-class Client {
-public:
-    SOCKET socket;
-    std::string username;
-    std::string room;
+#ifndef __linux__
+            if (!setNonBlocking(clientSocket)) {
+                closesocket(clientSocket);
+                continue;
+            }
+#endif
+            registerConnection(clientSocket, clientAddr);
+        }
+    }
 
-    Client(SOCKET s, const std::string& u, const std::string& r)
-        : socket(s), username(u), room(r) {}
-};
+    void registerConnection(SOCKET clientSocket, const sockaddr_storage& clientAddr) {
+        if (!poller->add(clientSocket)) {
+            LOG(Warn) << "Rejecting connection: " << poller->name() << " backend cannot register socket.";
+            closesocket(clientSocket);
+            return;
+        }
 
-class ChatRoom {
-public:
-    std::string name;
-    std::vector<Client> clients;
-    std::vector<std::string> messageHistory;
+        // Writes are already batched per loop iteration, so Nagle's
+        // algorithm would only hold back the batch behind a delayed ACK.
+        bool local = clientAddr.ss_family != AF_INET;
+        if (options.flushDelayUs > 0 && !local) {
+            int noDelay = 1;
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        }
 
-    ChatRoom(const std::string& n) : name(n) {}
-    ChatRoom() {}
+        SlotHandle handle = core.open();
+        Connection& conn = *core.connections.get(handle);
+        conn.socket = clientSocket;
+        conn.local = local;
+        if (!local) conn.address = reinterpret_cast<const sockaddr_in&>(clientAddr);
+        socketIndex[clientSocket] = handle;
+        conn.lastHeard = Clock::now();
+        arm(conn, conn.lastHeard + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS));
+        ++stats.connectionsAccepted;
+        if (capture) {
+            conn.captureId = capture->newConnectionId();
+            capture->record(captureBatch, CaptureEvent::Connect, conn.captureId);
+        }
+    }
 
-    void addClient(const Client& client) {
-        clients.push_back(client);
+    // Completion backends: a connection the poller already accepted.
+    void handleAccepted(SOCKET clientSocket) {
+        sockaddr_storage clientAddr{};
+        socklen_t clientSize = sizeof(clientAddr);
+        getpeername(clientSocket, reinterpret_cast<sockaddr*>(&clientAddr), &clientSize);
+        registerConnection(clientSocket, clientAddr);
     }
 
-    void removeClient(SOCKET socket) {
-        for (auto it = clients.begin(); it != clients.end(); ++it) {
-            if (it->socket == socket) {
-                clients.erase(it);
-                break;
+    // Completion backends: bytes the poller already read. Each completion
+    // is everything that was available, so it counts as a drained read.
+    void handleReceived(SOCKET clientSocket, const char* data, size_t length) {
+        Connection* conn = findConnection(clientSocket);
+        if (!conn) return;
+        // A ring client's socket only ever hangs up.
+        if (length == 0 || usesRing(*conn)) {
+            disconnect(conn->handle);
+            return;
+        }
+        ingressTime = Clock::now();
+        conn->lastHeard = ingressTime;
+        std::memcpy(conn->decoder.prepare(length), data, length);
+        conn->decoder.commit(length);
+        stats.bytesIn += length;
+        size_t budget = INPUT_BUDGET_FRAMES;
+        if (processInput(*conn, true, budget) && budget == 0) markReady(*conn);
+    }
+
+    // Completion backends: an asynchronous send finished.
+    void handleSent(SOCKET clientSocket, long result) {
+        Connection* conn = findConnection(clientSocket);
+        if (!conn) return;
+        if (result < 0) {
+            conn->output.inFlight = 0;
+            scheduleClose(*conn);
+            return;
+        }
+        conn->output.complete(static_cast<size_t>(result));
+        countBytesOut(*conn, static_cast<size_t>(result));
+        flushOutput(*conn);
+    }
+
+    uint64_t timerTick(Clock::time_point at) const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(at - timerEpoch).count());
+    }
+
+    // Deadlines round up, so a timer never fires before its time. A later
+    // deadline than the pending one needs no entry: the earlier wake-up
+    // re-arms.
+    void arm(Connection& conn, Clock::time_point deadline) {
+        uint64_t due = timerTick(deadline + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1));
+        if (due >= conn.timerDue) return;
+        timers.schedule(due, conn.handle);
+        conn.timerDue = due;
+    }
+
+    void expireTimers(Clock::time_point now) {
+        uint64_t tick = timerTick(now);
+        timers.advance(tick, [this, now, tick](SlotHandle handle) {
+            Connection* conn = core.connections.get(handle);
+            if (!conn || conn->timerDue > tick) return;
+            conn->timerDue = UINT64_MAX;
+            if (!conn->joined) {
+                LOG(Info) << "Handshake timed out for " << peerName(*conn) << ".";
+                disconnect(handle);
+                return;
             }
+            // Held input is retried, and held again if still over the limit.
+            // A client whose messages are waiting on it is not silent.
+            if (conn->inputHeld) {
+                conn->lastHeard = now;
+                releaseInput(*conn);
+            }
+            superviseIdle(*conn, now);
+        });
+    }
+
+    // Pings a framed client once per heartbeat interval of silence and
+    // drops it after the idle timeout, then re-arms its timer for
+    // whichever comes next.
+    void superviseIdle(Connection& conn, Clock::time_point now) {
+        if (!conn.framed) return;
+        std::chrono::seconds heartbeat(options.heartbeatSeconds);
+        std::chrono::seconds idleTimeout(options.idleTimeoutSeconds);
+        if (options.idleTimeoutSeconds > 0 && now - conn.lastHeard >= idleTimeout) {
+            LOG(Info) << conn.username << " timed out after " << options.idleTimeoutSeconds << " s of silence.";
+            disconnect(conn.handle);
+            return;
+        }
+        Clock::time_point next = Clock::time_point::max();
+        if (options.heartbeatSeconds > 0) {
+            Clock::time_point quietSince = std::max(conn.lastHeard, conn.lastPing);
+            if (now - quietSince >= heartbeat) {
+                deliver(conn.handle, pingMessage);
+                conn.lastPing = now;
+                quietSince = now;
+            }
+            next = quietSince + heartbeat;
+        }
+        if (options.idleTimeoutSeconds > 0) next = std::min(next, conn.lastHeard + idleTimeout);
+        if (next != Clock::time_point::max()) arm(conn, next);
+    }
+
+    // Sleep until the next timer is due or buffered log records are due
+    // for commit, or forever if neither is pending. Connections with input
+    // left over from their turn mean no sleep at all.
+    int nextTimeoutMs(Clock::time_point now) const {
+        if (!readyList.empty()) return 0;
+        long long timeout = -1;
+        uint64_t due = timers.nextDeadline();
+        if (due != UINT64_MAX) {
+            // Rounded up: a wait cut short of the tick would wake to find
+            // nothing due and spin until it passes.
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                timerEpoch + std::chrono::milliseconds(due) - now).count();
+            timeout = std::max<long long>(remaining, 0);
         }
+        if (logStore && logStore->dirty()) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                lastCommit + std::chrono::milliseconds(options.fsyncIntervalMs) - now).count();
+            remaining = remaining <= 0 ? 0 : remaining + 1;
+            timeout = timeout < 0 ? remaining : std::min(timeout, static_cast<long long>(remaining));
+        }
+#ifndef __linux__
+        if (options.adminPort != 0 || federation) {
+            timeout = timeout < 0 ? ADMIN_POLL_MS : std::min(timeout, static_cast<long long>(ADMIN_POLL_MS));
+        }
+#endif
+        return static_cast<int>(timeout);
+    }
+
+    // Closes any connection. Joined clients leave their room and the rest
+    // of the room is told.
+    void disconnect(SlotHandle handle) {
+        Connection* conn = core.connections.get(handle);
+        if (!conn) return;
+        poller->remove(conn->socket);
+        closesocket(conn->socket);
+        ++stats.connectionsClosed;
+        socketIndex.erase(conn->socket);
+#ifdef __linux__
+        forgetBell(*conn);
+#endif
+        if (capture) capture->record(captureBatch, CaptureEvent::Disconnect, conn->captureId);
+        if (conn->joined) {
+            LOG(Info) << conn->username << " disconnected from room " << conn->room->name << ".";
+        }
+        core.close(handle);
     }
 
-    void broadcast(const std::string& message, SOCKET excludeSocket) const {
-        for (const auto& client : clients) {
-            if (client.socket != excludeSocket) {
-                send(client.socket, message.c_str(), static_cast<int>(message.length()), 0);
+    void handleReadable(SOCKET clientSocket) {
+        Connection* conn = findConnection(clientSocket);
+        if (!conn) return;
+#ifdef __linux__
+        if (conn->ring) {
+            if (clientSocket == conn->socket) {
+                checkHangup(*conn);
+                return;
             }
+            // The bell: input arrived, or the client made room for output.
+            conn->ring->clearBell();
+            flushOutput(*conn);
         }
+#endif
+        serviceInput(*conn);
     }
 
-    void addMessage(const std::string& message) {
-        messageHistory.push_back(message);
+#ifdef __linux__
+    // Nothing follows the ring setup on a ring client's socket, so anything
+    // readable there is the hangup or a protocol error.
+    void checkHangup(Connection& conn) {
+        char byte;
+        int bytes = recv(conn.socket, &byte, 1, 0);
+        if (bytes == SOCKET_ERROR && (socketWouldBlock() || socketInterrupted())) return;
+        disconnect(conn.handle);
+    }
+
+    bool watchBell(Connection& conn) {
+        if (!poller->add(conn.ring->bell())) return false;
+        socketIndex[conn.ring->bell()] = conn.handle;
+        return true;
+    }
+
+    void forgetBell(Connection& conn) {
+        if (!conn.ring) return;
+        poller->remove(conn.ring->bell());
+        socketIndex.erase(conn.ring->bell());
+    }
+#endif
+
+    // Answers a RingSetup: a client on the Unix socket is sent the rings
+    // and carries on over them. Any other is told why not and stays on its
+    // socket. Returns false if the connection must close.
+    bool openRing(Connection& conn, std::string_view request) {
+#ifdef __linux__
+        bool valid = request.size() <= 9 && !usesRing(conn) && conn.output.empty();
+        size_t requested = 0;
+        for (char c : request) {
+            valid = valid && c >= '0' && c <= '9';
+            requested = requested * 10 + static_cast<size_t>(c - '0');
+        }
+        if (!conn.local || !valid) {
+            deliver(conn.handle, makeMessage(FrameType::System, 0, conn.local ? "Invalid ring setup." : "Shared-memory rings need the server's Unix socket."));
+            return true;
+        }
+        size_t capacity = SharedRing::capacityFor(requested);
+        try {
+            conn.ring.reset(new SharedRing(capacity));
+        } catch (const std::exception& e) {
+            LOG(Warn) << e.what();
+        }
+        if (conn.ring && !watchBell(conn)) {
+            LOG(Warn) << "Declining ring: " << poller->name() << " backend cannot register its bell.";
+            conn.ring.reset();
+        }
+        if (!conn.ring) {
+            deliver(conn.handle, makeMessage(FrameType::System, 0, "Shared-memory rings are unavailable."));
+            return true;
+        }
+        return conn.ring->handOver(conn.socket, encodeFrame(FrameType::RingSetup, 0, std::to_string(capacity)));
+#else
+        (void)request;
+        deliver(conn.handle, makeMessage(FrameType::System, 0, "Shared-memory rings are not supported on this platform."));
+        return true;
+#endif
     }
 
-    void sendHistory(SOCKET socket) const {
-        for (const auto& message : messageHistory) {
-            send(socket, message.c_str(), static_cast<int>(message.length()), 0);
+    // One turn at a connection's input: frames left from its last turn
+    // first, then reads until the socket would block, as edge-triggered
+    // polling requires, or the turn's frame budget runs out. A connection
+    // stopped by the budget goes on the ready list, since no new edge will
+    // come for what is still unread. Bytes land directly in the
+    // connection's frame decoder.
+    void serviceInput(Connection& conn) {
+        if (conn.inputHeld) return;
+        size_t budget = INPUT_BUDGET_FRAMES;
+        ingressTime = Clock::now();
+        if (!processInput(conn, false, budget)) return;
+        if (poller->completesIo() && !usesRing(conn)) {
+            if (budget == 0) markReady(conn);
+            return;
+        }
+        while (budget > 0 && !conn.inputHeld) {
+            char* buffer = conn.decoder.prepare(4096);
+            int bytes;
+            bool drained;
+#ifdef __linux__
+            if (conn.ring) {
+                // An empty ring asks the client to ring our bell.
+                bytes = static_cast<int>(conn.ring->read(buffer, conn.decoder.capacity()));
+                drained = bytes == 0;
+            } else
+#endif
+            {
+                bytes = recv(conn.socket, buffer, static_cast<int>(conn.decoder.capacity()), 0);
+                if (bytes == SOCKET_ERROR && socketInterrupted()) {
+                    continue;
+                }
+                drained = bytes == SOCKET_ERROR && socketWouldBlock();
+            }
+            if (!drained && bytes <= 0) {
+                disconnect(conn.handle);
+                return;
+            }
+            if (bytes > 0) {
+                conn.lastHeard = ingressTime;
+                conn.decoder.commit(bytes);
+                stats.bytesIn += static_cast<size_t>(bytes);
+            }
+            if (!processInput(conn, drained, budget) || drained) {
+                return;
+            }
         }
+        if (!conn.inputHeld) markReady(conn);
+    }
+
+    void markReady(Connection& conn) {
+        if (conn.inputReady) return;
+        conn.inputReady = true;
+        readyList.push_back(conn.handle);
     }
 
-    std::string getMemberList() const {
-        std::string result = "Members in room " + name + ": ";
-        for (size_t i = 0; i < clients.size(); ++i) {
-            result += clients[i].username;
-            if (i < clients.size() - 1) result += ", ";
+    // Gives every connection on the ready list one more turn. Those that
+    // use it up again wait for the next iteration.
+    void serveReadyList() {
+        serving.swap(readyList);
+        for (SlotHandle handle : serving) {
+            Connection* conn = core.connections.get(handle);
+            if (!conn) continue;
+            conn->inputReady = false;
+            serviceInput(*conn);
+            closePendingConnections();
         }
-        result += "\n";
-        return result;
+        serving.clear();
     }
-};
 
-class ChatServer {
-private:
-    SOCKET listeningSocket;
-    std::map<std::string, ChatRoom> rooms;
-    std::vector<Client> clients;
+    // Stops dispatching a connection's input until its rate limit has a
+    // token; the timer wheel wakes it at retryAt.
+    void holdInput(Connection& conn, Clock::time_point retryAt) {
+        conn.inputHeld = true;
+        poller->watchReadable(conn.socket, false);
+        arm(conn, retryAt);
+    }
 
-    void sendToClient(SOCKET socket, const std::string& message) {
-        send(socket, message.c_str(), static_cast<int>(message.length()), 0);
+    void releaseInput(Connection& conn) {
+        conn.inputHeld = false;
+        poller->watchReadable(conn.socket, true);
+        markReady(conn);
     }
 
-    Client* findClientByUsername(const std::string& username) {
-        for (auto& client : clients) {
-            if (client.username == username) {
-                return &client;
+    // Dispatches complete frames buffered for a connection, one per unit
+    // of budget. Returns false once the connection has been closed.
+    bool processInput(Connection& conn, bool drained, size_t& budget) {
+        if (!conn.joined) {
+            conn.framed = conn.decoder.mode() == FrameDecoder::Mode::Framed;
+            conn.output.framed = conn.framed;
+        }
+        Frame frame;
+        while (budget > 0) {
+            FrameDecoder::Status status = conn.decoder.next(frame);
+            if (status == FrameDecoder::Status::Error) {
+                LOG(Warn) << "Protocol error from " << peerName(conn) << ", closing.";
+                disconnect(conn.handle);
+                return false;
+            }
+            if (status == FrameDecoder::Status::NeedMore) break;
+            --budget;
+            if (!conn.joined && frame.type == FrameType::RingSetup) {
+                if (!openRing(conn, frame.payload)) {
+                    disconnect(conn.handle);
+                    return false;
+                }
+            } else if (!conn.joined) {
+                captureInput(conn, CaptureEvent::Hello, frame);
+                SlotHandle handle = conn.handle;
+                if (!admitted(handle, core.hello(conn, frame))) return false;
+            } else if (frame.type == FrameType::Ping) {
+                captureInput(conn, CaptureEvent::Frame, frame);
+                deliver(conn.handle, makeMessage(FrameType::Pong, 0, frame.payload));
+            } else if (frame.type == FrameType::Pong) {
+                captureInput(conn, CaptureEvent::Frame, frame);
+            } else {
+                Clock::time_point retryAt;
+                bool canHold = conn.decoder.pending().size() <= MAX_HELD_INPUT_BYTES;
+                Admission verdict = core.admit(conn, frame, ingressTime, canHold, retryAt);
+                if (verdict == Admission::Deferred) {
+                    conn.decoder.unread();
+                    holdInput(conn, retryAt);
+                    return true;
+                }
+                // Captured once admitted or shed, so a held frame is not
+                // recorded twice.
+                captureInput(conn, CaptureEvent::Frame, frame);
+                if (verdict == Admission::Accepted) core.receive(conn, frame, ingressTime);
             }
         }
-        return nullptr;
+
+        if (!conn.joined) {
+            // Legacy clients send "username:room" with no terminator, so a
+            // drained read containing the separator is a complete handshake.
+            std::string_view pending = conn.decoder.pending();
+            if (drained && conn.decoder.mode() == FrameDecoder::Mode::Legacy && pending.find(':') != std::string_view::npos) {
+                std::string data(pending);
+                conn.decoder.consume(pending.size());
+                captureInput(conn, CaptureEvent::Hello, Frame{FrameType::Chat, 0, data});
+                SlotHandle handle = conn.handle;
+                return admitted(handle, core.join(conn, data));
+            }
+            if (pending.size() > MAX_HANDSHAKE_BYTES) {
+                disconnect(conn.handle);
+                return false;
+            }
+        }
+        return true;
     }
 
 public:
-    ChatServer(int port) {
+    ChatServer(int port, const ServerOptions& opts, size_t shard = 0)
+        : options(opts), poller(createPoller(opts.backend)), core(*this), shardIndex(shard) {
+        core.history = options.history;
+        core.roomHistory = options.roomHistory;
+        // Logged rooms stay loaded; their history is bounded by the ring.
+        core.keepEmptyRooms = !options.dataDir.empty();
+        core.limits = options.rateLimits;
+        timerEpoch = Clock::now();
+        pingMessage = makeMessage(FrameType::Ping, 0, "");
+
         listeningSocket = socket(AF_INET, SOCK_STREAM, 0);
         if (listeningSocket == INVALID_SOCKET) {
             throw std::runtime_error("Failed to create listening socket.");
@@ -114,6 +3613,19 @@ public:
         serverAddr.sin_port = htons(port);
         serverAddr.sin_addr.s_addr = INADDR_ANY;
 
+#ifndef _WIN32
+        // Rebind straight away on restart, while reconnecting clients'
+        // old connections are still in TIME_WAIT.
+        int reuse = 1;
+        setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+#ifdef __linux__
+        // Every shard binds the port; the kernel spreads new connections.
+        if (options.threads > 1) {
+            setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        }
+#endif
+
         if (bind(listeningSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
             std::string error = "Bind failed: ";
             error += errno ? strerror(errno) : std::to_string(WSAGetLastError());
@@ -121,157 +3633,647 @@ public:
             throw std::runtime_error(error);
         }
 
-        if (listen(listeningSocket, 10) == SOCKET_ERROR) {
+        if (listen(listeningSocket, SOMAXCONN) == SOCKET_ERROR) {
             std::string error = "Listen failed: ";
             error += errno ? strerror(errno) : std::to_string(WSAGetLastError());
             closesocket(listeningSocket);
             throw std::runtime_error(error);
         }
+
+        if (!setNonBlocking(listeningSocket) || !poller->add(listeningSocket)) {
+            closesocket(listeningSocket);
+            throw std::runtime_error("Failed to register listening socket with " + std::string(poller->name()) + ".");
+        }
+
+#ifndef _WIN32
+        if (shardIndex == 0 && !options.unixSocket.empty()) {
+            try {
+                listenLocally();
+            } catch (const std::exception&) {
+                closesocket(listeningSocket);
+                throw;
+            }
+        }
+#endif
+
+#ifdef __linux__
+        if (options.threads > 1 || options.adminPort != 0 || options.federated()) {
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeFd < 0 || !poller->add(wakeFd)) {
+                closesocket(listeningSocket);
+                throw std::runtime_error("Failed to create shard wakeup eventfd.");
+            }
+        }
+#endif
+
+        if (!options.dataDir.empty()) {
+            logStore.reset(new LogStore(options.dataDir, options.segmentBytes));
+            recoverRooms();
+        }
+    }
+
+    // Gives this shard the full shard list, indexed by shard number.
+    void joinShards(const std::vector<ChatServer*>& group) {
+        shards = group;
+    }
+
+    // Records this shard's inbound traffic to a capture shared by all shards.
+    void captureTraffic(TrafficCapture* target) {
+        capture = target;
+    }
+
+    // Shares this shard's rooms with federated peers.
+    void joinFederation(Federation* target) {
+        federation = target;
+    }
+
+    // Queues traffic from federated peers. Safe from any thread.
+    void receiveFromPeers(ShardMessage message) {
+        mailbox.push(std::move(message));
+        if (!wakePending.exchange(true)) wake();
+    }
+
+    // Queues a scrape for this shard's event loop. Safe from any thread.
+    void requestMetrics(const std::shared_ptr<MetricsRequest>& request) {
+        ShardMessage message;
+        message.kind = ShardMessage::Kind::Metrics;
+        message.metrics = request;
+        mailbox.push(std::move(message));
+        if (!wakePending.exchange(true)) wake();
+    }
+
+    // Interrupts the shard's poller wait. Safe from any thread.
+    void wake() {
+#ifdef __linux__
+        uint64_t one = 1;
+        if (wakeFd != INVALID_SOCKET && write(wakeFd, &one, sizeof(one)) < 0) {
+            // The counter is already non-zero, so the shard will wake.
+        }
+#endif
     }
 
     ~ChatServer() {
-        for (const auto& client : clients) {
-            closesocket(client.socket);
+        if (logStore) {
+            logStore->commit();
         }
+        core.connections.forEach([](Connection& conn) { closesocket(conn.socket); });
+        if (wakeFd != INVALID_SOCKET) closesocket(wakeFd);
         closesocket(listeningSocket);
+#ifndef _WIN32
+        if (unixListener != INVALID_SOCKET) {
+            closesocket(unixListener);
+            unlink(options.unixSocket.c_str());
+        }
+#endif
 #ifdef _WIN32
         WSACleanup();
 #endif
     }
 
-    void run() {
-        std::cout << "Server running. Waiting for connections...\n";
+    // Queues a message for a connected client. If nothing was waiting it
+    // is written at the end of the loop iteration (see scheduleFlush);
+    // otherwise it goes out on writability.
+    void deliver(SlotHandle recipient, const SharedMessage& message) override {
+        Connection* conn = core.connections.get(recipient);
+        if (!conn || conn->output.closing) return;
+        bool wasEmpty = conn->output.empty();
+        enqueue(*conn, message);
+        if (wasEmpty) {
+            scheduleFlush(*conn);
+        } else {
+            flushIfLarge(*conn);
+        }
+    }
 
-        fd_set read_fds;
-        struct timeval tv;
-        bool serverRunning = true;
+    void deliverBatch(SlotHandle recipient, const std::vector<SharedMessage>& messages) override {
+        Connection* conn = core.connections.get(recipient);
+        if (!conn || conn->output.closing) return;
+        bool wasEmpty = conn->output.empty();
+        for (const auto& message : messages) {
+            enqueue(*conn, message);
+        }
+        if (wasEmpty) scheduleFlush(*conn);
+        flushIfLarge(*conn);
+    }
 
-        while (serverRunning) {
-            FD_ZERO(&read_fds);
-            FD_SET(listeningSocket, &read_fds);
-            int max_fd = listeningSocket;
+    const SlowConsumerStats& getSlowConsumerStats() const {
+        return slowConsumerStats;
+    }
 
-            for (const auto& client : clients) {
-                FD_SET(client.socket, &read_fds);
-                if (client.socket > max_fd) max_fd = client.socket;
+    void run() {
+        Logger::logShard = static_cast<uint8_t>(shardIndex);
+        if (shardIndex == 0) {
+            LOG(Info) << "Server running (" << poller->name()
+                      << (options.threads > 1 ? ", " + std::to_string(options.threads) + " reactor threads" : "")
+                      << "). Waiting for connections...";
+            if (unixListener != INVALID_SOCKET) {
+                LOG(Info) << "Local clients may connect on " << options.unixSocket << ".";
             }
+        }
 
-            tv.tv_sec = 0;
-            tv.tv_usec = 100000;
+        std::vector<PollEvent> events;
+        bool serverRunning = true;
+        const auto flushDelay = std::chrono::microseconds(options.flushDelayUs);
 
-            int result = select(max_fd + 1, &read_fds, nullptr, nullptr, &tv);
-            if (result == SOCKET_ERROR) {
-                std::cerr << "Select failed: " << (errno ? strerror(errno) : std::to_string(WSAGetLastError())) << "\n";
+        while (serverRunning && !shutdownRequested) {
+            int result = poller->wait(events, nextTimeoutMs(Clock::now()));
+            if (result < 0) {
+                LOG(Error) << "Poll failed: " << (errno ? strerror(errno) : std::to_string(WSAGetLastError()));
                 break;
-            } else if (result > 0) {
-                if (FD_ISSET(listeningSocket, &read_fds)) {
-                    sockaddr_in clientAddr{};
-                    socklen_t clientSize = sizeof(clientAddr);
-                    SOCKET clientSocket = accept(listeningSocket, reinterpret_cast<sockaddr*>(&clientAddr), &clientSize);
-                    if (clientSocket == INVALID_SOCKET) {
-                        std::cerr << "Accept error.\n";
-                        continue;
-                    }
-
-                    char buffer[1024];
-                    memset(buffer, 0, sizeof(buffer));
-                    int bytes = recv(clientSocket, buffer, sizeof(buffer), 0);
-                    if (bytes <= 0) {
-                        closesocket(clientSocket);
-                        continue;
-                    }
-
-                    std::string data(buffer, bytes);
-                    size_t delim = data.find(':');
-                    if (delim == std::string::npos) {
-                        closesocket(clientSocket);
-                        continue;
-                    }
-
-                    std::string username = data.substr(0, delim);
-                    std::string roomName = data.substr(delim + 1);
-
-                    Client client(clientSocket, username, roomName);
-                    clients.push_back(client);
-
-                    auto it = rooms.find(roomName);
-                    if (it == rooms.end()) {
-                        it = rooms.emplace(roomName, ChatRoom(roomName)).first;
-                    }
-                    it->second.addClient(client);
-
-                    std::cout << username << " connected to room " << roomName << " from " << inet_ntoa(clientAddr.sin_addr) << "\n";
-
-                    it->second.sendHistory(clientSocket);
-                    sendToClient(clientSocket, it->second.getMemberList());
-
-                    std::string joinMsg = username + " joined room " + roomName + "!\n";
-                    it->second.addMessage(joinMsg);
-                    it->second.broadcast(joinMsg, clientSocket);
-                }
+            }
+            Clock::time_point woke = Clock::now();
 
-                for (size_t i = 0; i < clients.size(); ++i) {
-                    SOCKET clientSocket = clients[i].socket;
-                    if (FD_ISSET(clientSocket, &read_fds)) {
-                        char buffer[1024];
-                        memset(buffer, 0, sizeof(buffer));
-                        int bytes = recv(clientSocket, buffer, sizeof(buffer), 0);
-                        if (bytes <= 0) {
-                            std::string roomName = clients[i].room;
-                            std::string username = clients[i].username;
-                            std::cout << username << " disconnected from room " << roomName << ".\n";
-                            rooms[roomName].removeClient(clientSocket);
-                            closesocket(clientSocket);
-                            clients.erase(clients.begin() + i);
-                            --i;
-                            std::string leftMsg = username + " left room " + roomName + "!\n";
-                            rooms[roomName].addMessage(leftMsg);
-                            rooms[roomName].broadcast(leftMsg, INVALID_SOCKET);
-                            if (rooms[roomName].clients.empty()) {
-                                rooms.erase(roomName);
-                            }
-                        } else {
-                            std::string message(buffer, bytes);
-                            std::string roomName = clients[i].room;
-                            std::string username = clients[i].username;
-
-                            if (message.find("[PM]") == 0) {
-                                size_t firstColon = message.find(':', 4);
-                                size_t secondColon = message.find(':', firstColon + 1);
-                                if (firstColon != std::string::npos && secondColon != std::string::npos) {
-                                    std::string sender = message.substr(4, firstColon - 4);
-                                    std::string targetUser = message.substr(firstColon + 1, secondColon - firstColon - 1);
-                                    std::string pmContent = message.substr(secondColon + 1);
-                                    Client* target = findClientByUsername(targetUser);
-                                    if (target) {
-                                        std::string pmMessage = "[PM]" + sender + ":" + pmContent;
-                                        sendToClient(target->socket, pmMessage);
-                                        sendToClient(clientSocket, pmMessage);
-                                        std::cout << "[" << roomName << "] PM from " << sender << " to " << targetUser << ": " << pmContent;
-                                    } else {
-                                        std::string errorMsg = "User " + targetUser + " not found.\n";
-                                        sendToClient(clientSocket, errorMsg);
-                                    }
-                                }
-                            } else {
-                                std::cout << "[" << roomName << "] " << message << std::endl;
-                                rooms[roomName].addMessage(message);
-                                rooms[roomName].broadcast(message, clientSocket);
-                            }
-                        }
-                    }
+            for (const auto& event : events) {
+                // A long batch of events must not hold earlier output back
+                // past the bound.
+                if (!flushList.empty() && Clock::now() - flushListSince >= flushDelay) {
+                    flushScheduled();
+                    closePendingConnections();
+                }
+                switch (event.kind) {
+                case PollEvent::Kind::Ready:
+                    break;
+                case PollEvent::Kind::Accepted:
+                    handleAccepted(event.accepted);
+                    continue;
+                case PollEvent::Kind::Received:
+                    handleReceived(event.socket, event.data, static_cast<size_t>(event.result));
+                    closePendingConnections();
+                    continue;
+                case PollEvent::Kind::Sent:
+                    handleSent(event.socket, event.result);
+                    closePendingConnections();
+                    continue;
+                }
+                if (event.socket == listeningSocket || event.socket == unixListener) {
+                    acceptConnections(event.socket);
+                    continue;
+                }
+                if (event.socket == wakeFd) {
+                    drainMailbox();
+                    closePendingConnections();
+                    continue;
                 }
+                if (event.writable) {
+                    Connection* conn = findConnection(event.socket);
+                    if (conn) flushOutput(*conn);
+                }
+                if (event.readable) {
+                    handleReadable(event.socket);
+                }
+                closePendingConnections();
+            }
+#ifndef __linux__
+            // No eventfd to wake on: admin scrapes and peer traffic are
+            // picked up here.
+            if (options.adminPort != 0 || federation) drainMailbox();
+#endif
+            serveReadyList();
+            Clock::time_point now = Clock::now();
+            expireTimers(now);
+            flushScheduled();
+            closePendingConnections();
+            commitLogs(now);
+            if (capture) capture->submit(captureBatch);
+            if (federation) federation->submit(shardIndex, federationBatch);
+            stats.loopIterationNs.record(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - woke).count()));
+        }
+        flushScheduled();
+        if (capture) capture->submit(captureBatch);
+    }
+};
+
+void Federation::toShard(size_t shard, ShardMessage message) {
+    shards[shard]->receiveFromPeers(std::move(message));
+}
+
+// Prometheus text exposition of a finished scrape.
+class MetricsWriter {
+public:
+    std::string text;
+
+    void family(const char* name, const char* type, const char* help) {
+        text += "# HELP ";
+        text += name;
+        text += ' ';
+        text += help;
+        text += "\n# TYPE ";
+        text += name;
+        text += ' ';
+        text += type;
+        text += '\n';
+    }
+
+    void sample(const std::string& name, const std::string& labels, double value) {
+        char number[32];
+        snprintf(number, sizeof(number), "%.17g", value);
+        text += name;
+        if (!labels.empty()) text += "{" + labels + "}";
+        text += ' ';
+        text += number;
+        text += '\n';
+    }
+
+    void single(const char* name, const char* type, const char* help, double value) {
+        family(name, type, help);
+        sample(name, "", value);
+    }
+
+    // Cumulative buckets, only where the count changes, plus +Inf. `scale`
+    // converts recorded units to the exported ones (ns to seconds).
+    void histogram(const char* name, const char* help, const Histogram& histogram, double scale) {
+        family(name, "histogram", help);
+        uint64_t cumulative = 0;
+        char bound[32];
+        for (size_t i = 0; i < Histogram::BUCKETS && cumulative < histogram.count(); ++i) {
+            if (histogram.bucketCount(i) == 0) continue;
+            cumulative += histogram.bucketCount(i);
+            snprintf(bound, sizeof(bound), "%.9g", static_cast<double>(Histogram::upperBound(i)) * scale);
+            sample(std::string(name) + "_bucket", std::string("le=\"") + bound + "\"", static_cast<double>(cumulative));
+        }
+        sample(std::string(name) + "_bucket", "le=\"+Inf\"", static_cast<double>(histogram.count()));
+        sample(std::string(name) + "_sum", "", static_cast<double>(histogram.valueSum()) * scale);
+        sample(std::string(name) + "_count", "", static_cast<double>(histogram.count()));
+    }
+
+    static std::string roomLabel(const std::string& room) {
+        std::string label = "room=\"";
+        for (char c : room) {
+            if (c == '\\' || c == '"') label += '\\';
+            if (c == '\n') {
+                label += "\\n";
+                continue;
+            }
+            label += c;
+        }
+        return label + "\"";
+    }
+};
+
+static std::string renderMetrics(const std::vector<ShardSnapshot>& shards) {
+    ServerStats total;
+    CoreStats routing;
+    SlowConsumerStats slow;
+    size_t connections = 0;
+    size_t queuedBytes = 0;
+    size_t maxQueuedBytes = 0;
+    for (const auto& shard : shards) {
+        total.connectionsAccepted += shard.stats.connectionsAccepted;
+        total.connectionsClosed += shard.stats.connectionsClosed;
+        routing.messagesIn += shard.core.messagesIn;
+        routing.shed += shard.core.shed;
+        routing.deferred += shard.core.deferred;
+        total.messagesOut += shard.stats.messagesOut;
+        total.bytesIn += shard.stats.bytesIn;
+        total.bytesOut += shard.stats.bytesOut;
+        total.writeCalls += shard.stats.writeCalls;
+        routing.fanout.merge(shard.core.fanout);
+        routing.fanoutLatencyNs.merge(shard.core.fanoutLatencyNs);
+        total.loopIterationNs.merge(shard.stats.loopIterationNs);
+        slow.droppedMessages += shard.slowConsumers.droppedMessages;
+        slow.droppedBytes += shard.slowConsumers.droppedBytes;
+        slow.coalescedMessages += shard.slowConsumers.coalescedMessages;
+        slow.disconnects += shard.slowConsumers.disconnects;
+        connections += shard.connections;
+        queuedBytes += shard.queuedBytes;
+        maxQueuedBytes = std::max(maxQueuedBytes, shard.maxQueuedBytes);
+    }
+
+    MetricsWriter out;
+    out.single("chatsphere_connections", "gauge", "Open client connections.", static_cast<double>(connections));
+    out.single("chatsphere_connections_accepted_total", "counter", "Connections accepted.", static_cast<double>(total.connectionsAccepted));
+    out.single("chatsphere_connections_closed_total", "counter", "Connections closed.", static_cast<double>(total.connectionsClosed));
+    out.single("chatsphere_messages_in_total", "counter", "Chat and private messages received.", static_cast<double>(routing.messagesIn));
+    out.single("chatsphere_rate_limited_shed_total", "counter", "Messages dropped for exceeding a rate limit.", static_cast<double>(routing.shed));
+    out.single("chatsphere_rate_limited_deferred_total", "counter", "Times a client's input was held back by a rate limit.", static_cast<double>(routing.deferred));
+    out.single("chatsphere_messages_out_total", "counter", "Messages queued to recipients.", static_cast<double>(total.messagesOut));
+    out.single("chatsphere_bytes_in_total", "counter", "Bytes read from clients.", static_cast<double>(total.bytesIn));
+    out.single("chatsphere_bytes_out_total", "counter", "Bytes written to clients.", static_cast<double>(total.bytesOut));
+    out.single("chatsphere_write_calls_total", "counter", "Writes issued to client sockets (writev or io_uring sends).",
+               static_cast<double>(total.writeCalls));
+    out.single("chatsphere_output_queue_bytes", "gauge", "Bytes queued for all clients.", static_cast<double>(queuedBytes));
+    out.single("chatsphere_output_queue_max_bytes", "gauge", "Deepest single client output queue.", static_cast<double>(maxQueuedBytes));
+    out.single("chatsphere_slow_consumer_dropped_messages_total", "counter", "Queued messages dropped by drop-oldest.", static_cast<double>(slow.droppedMessages));
+    out.single("chatsphere_slow_consumer_dropped_bytes_total", "counter", "Queued bytes dropped by drop-oldest.", static_cast<double>(slow.droppedBytes));
+    out.single("chatsphere_slow_consumer_coalesced_messages_total", "counter", "Queued messages collapsed by coalesce.", static_cast<double>(slow.coalescedMessages));
+    out.single("chatsphere_slow_consumer_disconnects_total", "counter", "Clients disconnected by the slow-consumer policy.", static_cast<double>(slow.disconnects));
+    out.histogram("chatsphere_fanout_recipients", "Recipients per room message.", routing.fanout, 1.0);
+    out.histogram("chatsphere_fanout_latency_seconds", "From reading a chat message to handing it to its last recipient.", routing.fanoutLatencyNs, 1e-9);
+    out.histogram("chatsphere_loop_iteration_seconds", "Time spent handling one poller wait's events.", total.loopIterationNs, 1e-9);
+
+    struct RoomFamily {
+        const char* name;
+        const char* type;
+        const char* help;
+        double (*value)(const RoomSnapshot&);
+    };
+    static const RoomFamily roomFamilies[] = {
+        {"chatsphere_room_members", "gauge", "Members in the room.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.members); }},
+        {"chatsphere_room_history_messages", "gauge", "Messages in the room's history ring.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.history); }},
+        {"chatsphere_room_messages_in_total", "counter", "Chat messages sent to the room.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.stats.messagesIn); }},
+        {"chatsphere_room_messages_out_total", "counter", "Messages queued to the room's members.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.stats.messagesOut); }},
+        {"chatsphere_room_bytes_in_total", "counter", "Payload bytes sent to the room.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.stats.bytesIn); }},
+        {"chatsphere_room_bytes_out_total", "counter", "Bytes written to the room's members.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.stats.bytesOut); }},
+        {"chatsphere_room_dropped_messages_total", "counter", "Messages the slow-consumer policy dropped or coalesced.",
+         [](const RoomSnapshot& r) { return static_cast<double>(r.stats.dropped); }},
+    };
+    for (const auto& family : roomFamilies) {
+        out.family(family.name, family.type, family.help);
+        for (const auto& shard : shards) {
+            for (const auto& room : shard.rooms) {
+                out.sample(family.name, MetricsWriter::roomLabel(room.name), family.value(room));
+            }
+        }
+    }
+    return out.text;
+}
+
+// Serves metrics on a loopback TCP port from its own thread, so scrapes
+// never run socket I/O on an event loop. A request is answered once every
+// shard has filled in its snapshot from its own thread. HTTP requests get
+// an HTTP response, for Prometheus and curl; anything else gets the bare
+// text, so `nc` works too.
+class AdminServer {
+private:
+    static constexpr int ACCEPT_POLL_MS = 200;
+    static constexpr int SCRAPE_TIMEOUT_MS = 2000;
+
+    SOCKET listener = INVALID_SOCKET;
+    std::vector<ChatServer*> shards;
+
+    std::string collect() {
+        std::shared_ptr<MetricsRequest> request = std::make_shared<MetricsRequest>();
+        request->shards.resize(shards.size());
+        request->remaining = shards.size();
+        std::future<void> done = request->done.get_future();
+        for (auto* shard : shards) {
+            shard->requestMetrics(request);
+        }
+        if (done.wait_for(std::chrono::milliseconds(SCRAPE_TIMEOUT_MS)) != std::future_status::ready) {
+            return std::string();
+        }
+        return renderMetrics(request->shards);
+    }
+
+    void serve(SOCKET client) {
+#ifdef _WIN32
+        DWORD timeout = 1000;
+#else
+        timeval timeout{1, 0};
+#endif
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+        std::string request;
+        char buffer[1024];
+        // An HTTP request ends with a blank line, anything else with a newline.
+        while (request.size() < 8192) {
+            int bytes = recv(client, buffer, sizeof(buffer), 0);
+            if (bytes <= 0) break;
+            request.append(buffer, static_cast<size_t>(bytes));
+            bool http = request.compare(0, 4, "GET ") == 0;
+            if (http ? request.find("\r\n\r\n") != std::string::npos : request.find('\n') != std::string::npos) break;
+        }
+
+        std::string body = collect();
+        std::string response;
+        if (request.compare(0, 4, "GET ") == 0) {
+            bool found = request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0;
+            if (!found) {
+                response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+            } else if (body.empty()) {
+                response = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+            } else {
+                response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\n\r\n" + body;
             }
+        } else {
+            response = body;
+        }
+        size_t sent = 0;
+        while (sent < response.size()) {
+            int bytes = send(client, response.data() + sent, static_cast<int>(response.size() - sent), 0);
+            if (bytes <= 0) break;
+            sent += static_cast<size_t>(bytes);
+        }
+        closesocket(client);
+    }
+
+public:
+    AdminServer(int port, const std::vector<ChatServer*>& group) : shards(group) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET) throw std::runtime_error("Admin socket creation failed.");
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+            listen(listener, 16) == SOCKET_ERROR) {
+            std::string error = "Admin bind failed: ";
+            error += errno ? strerror(errno) : std::to_string(WSAGetLastError());
+            closesocket(listener);
+            throw std::runtime_error(error);
+        }
+    }
+
+    ~AdminServer() {
+        closesocket(listener);
+    }
+
+    // Serves scrapes one at a time until shutdown is requested.
+    void run() {
+        while (!shutdownRequested) {
+            fd_set readSet;
+            FD_ZERO(&readSet);
+            FD_SET(listener, &readSet);
+            timeval timeout{0, ACCEPT_POLL_MS * 1000};
+            if (select(static_cast<int>(listener) + 1, &readSet, nullptr, nullptr, &timeout) <= 0) continue;
+            SOCKET client = accept(listener, nullptr, nullptr);
+            if (client != INVALID_SOCKET) serve(client);
         }
     }
 };
 
+// The test driver includes this file for the server's internals and
+// brings its own main().
+#ifndef CHATSPHERE_NO_MAIN
+static void printUsage() {
+    std::cerr << "Usage: server <Port> [--backend epoll|select|io_uring] [--high-water <bytes>]\n"
+              << "              [--slow-consumer drop-oldest|coalesce|disconnect]\n"
+              << "              [--history <messages>:<bytes>] [--room-history <room>=<messages>:<bytes>]...\n"
+              << "              [--data-dir <path>] [--fsync-ms <milliseconds>] [--segment-bytes <bytes>]\n"
+              << "              [--threads <count>] [--log-level debug|info|warn|error] [--log-sample <n>]\n"
+              << "              [--admin-port <port>] [--capture <file>] [--flush-delay-us <microseconds>]\n"
+              << "              [--heartbeat <seconds>] [--idle-timeout <seconds>]\n"
+              << "              [--rate-limit <per second>[:<burst>]] [--room-rate-limit <per second>[:<burst>]]\n"
+              << "              [--flood-policy shed|defer]\n"
+              << "              [--node-name <name>] [--peer-port <port>] [--peer <host>:<port>]...\n"
+              << "              [--unix-socket <path>]\n";
+}
+
+// "<per second>[:<burst>]"; the burst defaults to one second's worth.
+static RateLimit parseRateLimit(const std::string& value) {
+    size_t colon = value.find(':');
+    unsigned long rate = std::stoul(value.substr(0, colon));
+    unsigned long burst = colon == std::string::npos ? rate : std::stoul(value.substr(colon + 1));
+    if (rate > 1000000000 || burst > 1000000) {
+        throw std::invalid_argument("rate limit out of range: " + value);
+    }
+    return RateLimit::perSecond(static_cast<uint32_t>(rate), static_cast<uint32_t>(burst));
+}
+
+static HistoryLimits parseHistoryLimits(const std::string& value) {
+    size_t colon = value.find(':');
+    if (colon == std::string::npos) {
+        throw std::invalid_argument("expected <messages>:<bytes>, got " + value);
+    }
+    HistoryLimits limits;
+    limits.maxMessages = std::stoul(value.substr(0, colon));
+    limits.maxBytes = std::stoul(value.substr(colon + 1));
+    // Rooms keep at least their latest message.
+    if (limits.maxMessages == 0 || limits.maxBytes == 0) {
+        throw std::invalid_argument("history limits must be at least 1: " + value);
+    }
+    return limits;
+}
+
+// Parses "--flag value" pairs after the port. Returns false on an unknown
+// flag or value; malformed numbers throw std::invalid_argument.
+static bool parseOptions(int argc, char* argv[], ServerOptions& options) {
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--backend") {
+            options.backend = value;
+        } else if (flag == "--high-water") {
+            options.highWaterBytes = std::stoul(value);
+        } else if (flag == "--data-dir") {
+            options.dataDir = value;
+        } else if (flag == "--fsync-ms") {
+            options.fsyncIntervalMs = std::stoi(value);
+        } else if (flag == "--segment-bytes") {
+            options.segmentBytes = std::stoul(value);
+        } else if (flag == "--threads") {
+            options.threads = std::stoul(value);
+#ifndef __linux__
+            if (options.threads > 1) throw std::invalid_argument("--threads above 1 needs SO_REUSEPORT balancing (Linux only)");
+#endif
+            if (options.threads == 0) return false;
+        } else if (flag == "--log-level") {
+            if (value == "debug") {
+                options.logLevel = LogLevel::Debug;
+            } else if (value == "info") {
+                options.logLevel = LogLevel::Info;
+            } else if (value == "warn") {
+                options.logLevel = LogLevel::Warn;
+            } else if (value == "error") {
+                options.logLevel = LogLevel::Error;
+            } else {
+                return false;
+            }
+        } else if (flag == "--admin-port") {
+            options.adminPort = std::stoi(value);
+            if (options.adminPort <= 0 || options.adminPort > 65535) return false;
+        } else if (flag == "--capture") {
+            options.capturePath = value;
+        } else if (flag == "--heartbeat") {
+            options.heartbeatSeconds = std::stoi(value);
+            if (options.heartbeatSeconds < 0) throw std::invalid_argument("--heartbeat must not be negative");
+        } else if (flag == "--idle-timeout") {
+            options.idleTimeoutSeconds = std::stoi(value);
+            if (options.idleTimeoutSeconds < 0) throw std::invalid_argument("--idle-timeout must not be negative");
+        } else if (flag == "--flush-delay-us") {
+            options.flushDelayUs = std::stoi(value);
+            if (options.flushDelayUs < 0) throw std::invalid_argument("--flush-delay-us must not be negative");
+        } else if (flag == "--log-sample") {
+            options.logSampleEvery = std::stoul(value);
+            if (options.logSampleEvery == 0) return false;
+        } else if (flag == "--history") {
+            options.history = parseHistoryLimits(value);
+        } else if (flag == "--room-history") {
+            size_t eq = value.find('=');
+            if (eq == std::string::npos) return false;
+            options.roomHistory[value.substr(0, eq)] = parseHistoryLimits(value.substr(eq + 1));
+        } else if (flag == "--rate-limit") {
+            options.rateLimits.connection = parseRateLimit(value);
+        } else if (flag == "--room-rate-limit") {
+            options.rateLimits.room = parseRateLimit(value);
+        } else if (flag == "--flood-policy") {
+            if (value == "shed") {
+                options.rateLimits.policy = FloodPolicy::Shed;
+            } else if (value == "defer") {
+                options.rateLimits.policy = FloodPolicy::Defer;
+            } else {
+                return false;
+            }
+        } else if (flag == "--node-name") {
+            if (value.empty()) return false;
+            options.nodeName = value;
+        } else if (flag == "--peer-port") {
+            options.peerPort = std::stoi(value);
+            if (options.peerPort <= 0 || options.peerPort > 65535) return false;
+        } else if (flag == "--unix-socket") {
+#ifdef _WIN32
+            return false;
+#else
+            if (value.empty()) return false;
+            options.unixSocket = value;
+#endif
+        } else if (flag == "--peer") {
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos || colon == 0 || colon + 1 == value.size()) return false;
+            options.peers.push_back(value);
+        } else if (flag == "--slow-consumer") {
+            if (value == "drop-oldest") {
+                options.slowConsumerPolicy = SlowConsumerPolicy::DropOldest;
+            } else if (value == "coalesce") {
+                options.slowConsumerPolicy = SlowConsumerPolicy::Coalesce;
+            } else if (value == "disconnect") {
+                options.slowConsumerPolicy = SlowConsumerPolicy::Disconnect;
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    if (options.backend == "io_uring" && options.threads > 1) {
+        // Handing a connection to another shard would race its armed recv.
+        throw std::invalid_argument("--backend io_uring runs a single reactor thread");
+    }
+    return true;
+}
+
+static void requestShutdown(int) {
+    shutdownRequested = true;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: server <Port>\n";
+    if (argc < 2 || argc % 2 != 0) {
+        printUsage();
+        return 1;
+    }
+
+    int port = 0;
+    ServerOptions options;
+    try {
+        port = std::stoi(argv[1]);
+        if (!parseOptions(argc, argv, options)) {
+            printUsage();
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        printUsage();
         return 1;
     }
-    int port = std::stoi(argv[1]);
 
 #ifdef _WIN32
     WSADATA wsa;
@@ -279,15 +4281,101 @@ int main(int argc, char* argv[]) {
         std::cerr << "WSAStartup failed: " << WSAGetLastError() << "\n";
         return 1;
     }
+#else
+    // Peers vanish mid-broadcast during reconnect storms; report EPIPE instead of dying.
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, requestShutdown);
+#endif
+    signal(SIGINT, requestShutdown);
+
+#ifndef _WIN32
+    // Shard threads and the log writer leave SIGINT/SIGTERM to the main
+    // thread, whose poller wait they interrupt; it then wakes the others.
+    sigset_t stopSignals, previous;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &previous);
+#endif
+    logger.configure(options.logLevel, options.threads > 1);
+    logger.start();
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
 #endif
 
+    int status = 0;
     try {
-        ChatServer server(port);
-        server.run();
+        // Declared first so it outlives the shards, which submit on exit.
+        std::unique_ptr<TrafficCapture> capture;
+        if (!options.capturePath.empty()) {
+            capture.reset(new TrafficCapture(options.capturePath));
+        }
+        // Likewise, shards submit to the federation until they stop.
+        std::unique_ptr<Federation> federation;
+        if (options.federated()) {
+            if (options.nodeName.empty()) {
+                char host[256] = "localhost";
+                gethostname(host, sizeof(host) - 1);
+                options.nodeName = std::string(host) + ":" + std::to_string(port);
+            }
+            federation.reset(new Federation(options));
+        }
+        std::vector<std::unique_ptr<ChatServer>> shards;
+        std::vector<ChatServer*> group;
+        for (size_t i = 0; i < options.threads; ++i) {
+            shards.emplace_back(new ChatServer(port, options, i));
+            group.push_back(shards.back().get());
+        }
+        for (auto& shard : shards) {
+            shard->joinShards(group);
+            shard->captureTraffic(capture.get());
+            shard->joinFederation(federation.get());
+        }
+        if (federation) {
+            federation->joinShards(group);
+        }
+        std::unique_ptr<AdminServer> admin;
+        if (options.adminPort != 0) {
+            admin.reset(new AdminServer(options.adminPort, group));
+        }
+
+#ifndef _WIN32
+        pthread_sigmask(SIG_BLOCK, &stopSignals, &previous);
+#endif
+        if (capture) {
+            capture->startWriter();
+        }
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < shards.size(); ++i) {
+            threads.emplace_back(&ChatServer::run, shards[i].get());
+        }
+        if (admin) {
+            threads.emplace_back(&AdminServer::run, admin.get());
+        }
+        if (federation) {
+            threads.emplace_back(&Federation::run, federation.get());
+        }
+#ifndef _WIN32
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+#endif
+
+        shards[0]->run();
+        shutdownRequested = true;
+        for (size_t i = 1; i < shards.size(); ++i) {
+            shards[i]->wake();
+        }
+        if (federation) {
+            federation->wake();
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
     } catch (const std::exception& e) {
-        std::cerr << e.what() << "\n";
-        return 1;
+        LOG(Error) << e.what();
+        status = 1;
     }
 
-    return 0;
+    logger.stop();
+    return status;
 }
+#endif